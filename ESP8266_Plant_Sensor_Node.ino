@@ -8,38 +8,823 @@ https://www.analog.com/media/en/technical-documentation/data-sheets/OP282_482.pd
 
 #include <WiFiManager.h>
 
+#include "config.h"
+#include "board.h"
+#include "status_led.h"
+#include "mux_scan.h"
+#include "settle_tune.h"
+#include "adc_stream.h"
+#include "rtc_state.h"
+#include "wifi_fast.h"
+#include "portal.h"
+#include "telemetry_frame.h"
+#include "mqtt_uplink.h"
+#include "button.h"
+#include "calibration.h"
+#include "energy.h"
+#include "battery.h"
+#include "serial_cmd.h"
+#include "history.h"
+#include "ota.h"
+#include "supervisor.h"
+#if NODE_ROLE != NODE_ROLE_STANDALONE
+#include "espnow_link.h"
+#endif
+#if !DUTY_CYCLE_MODE
+#include "http_api.h"
+#endif
 
-#define RESET_BTN_PIN       D5
-#define EXTRN_LED_PIN       D0
-#define ANALOG_MOISTURE_PIN A0
-#define AMUX_SLCT_0_PIN     D1
-#define AMUX_SLCT_1_PIN     D2
-#define AMUX_SLCT_2_PIN     D3
 
-#define BOOT_0_PIN          (D3)       //! Vcc for flash run, GND for program
-#define BOOT_2_PIN          (D4)       //! Always Vcc (via external pullup)
-#define BOOT_15_PIN         (D8)       //! Always GND (via external pulldown)
+static muxscan_t scanner;
+static settletune_t settleTune;
+static bool settleTuneRequested = false;            //! Re-measure settle times once no sweep is running
+static adcstream_t adcStream;
+static rtcstate_t rtcState;
+static WiFiManager wifiManager;
+static wififast_t wifiConn;
+static tframe_ctx_t frameCtx;
+static cal_table_t calTable;
+static energy_meter_t energyMeter;
+static mqttuplink_t mqtt;
+static button_t resetButton;
+static statusled_engine_t statusLed;
+static bool uploadFailed = false;
+static serialcmd_t serialCli;
+static history_t history;
+#if !DUTY_CYCLE_MODE
+static AsyncWebServer httpServer(HTTP_API_PORT);
+static httpapi_t httpApi;
+#endif
+static portal_t portal;
+static bool wifiFallbackDone = false;
+static ota_t ota;
+static bool otaLanStarted = false;
+static bool reportPending = false;
+static bool sweepRequested = true;                  //! Sweep at the next loop, regardless of interval
+static bool reportRequested = false;                //! Report the next sweep even if nothing changed
+#if DUTY_CYCLE_MODE
+static bool sleepPending = false;                   //! Upload done, sleep once nothing else holds the node up
+#endif
+static uint32_t lastSweepStart_ms = 0;
+static supervisor_t supervisor;
+#if NODE_ROLE == NODE_ROLE_LEAF
+static espnow_leaf_t espnowLeaf;
+#elif NODE_ROLE == NODE_ROLE_GATEWAY
+static espnow_gateway_t espnowGw;
+static bool espnowGwStarted = false;
+#endif
 
 /**
  * Initialize hardware pins as defined in the device pinout
  */
 static inline void hwcfig_init(void) {
-  pinMode(MOISTURE_SENSOR, INPUT);
+  pinMode(Board::moistureAdc, INPUT);
 
-  pinMode(STATUS_LED_PIN, OUTPUT);
-  digitalWrite(STATUS_LED_PIN, LOW);
+  // Strap pins are held by their external resistors; leave them as inputs
+  // unless the board puts the LED on GPIO2
+  pinMode(Board::boot0, INPUT);
+  if (Board::boot2 != Board::statusLed) {
+    pinMode(Board::boot2, INPUT);
+  }
+  pinMode(Board::boot15, INPUT);
+}
+
+
+/**
+ * Unix time once SNTP has answered, seconds since power-on before that.
+ * Carried across deep sleep without a network round trip.
+ */
+static uint32_t node_time_s(void) {
+  return timesync_now_s(&rtcState.time);
+}
+
+/**
+ * Safe mode keeps the node to scanning and logging
+ */
+static bool radio_allowed(void) {
+  return !supervisor_safe_mode(&supervisor);
+}
+
+/**
+ * Tell the supervisor what the pipeline is doing. Node time is only worked
+ * out on an actual change.
+ */
+static void set_stage(sup_stage_t stage) {
+  if (supervisor.stage != stage) {
+    supervisor_enter(&supervisor, stage, node_time_s());
+  }
+}
+
+/**
+ * The longest-running thing in progress, for the supervisor
+ */
+static sup_stage_t current_stage(void) {
+  if (portal.open) {
+    return SUP_PORTAL;
+  }
+  if (ota_busy(&ota)) {
+    return SUP_OTA;
+  }
+  if (wifiConn.state == WIFIFAST_CONNECTING) {
+    return SUP_CONNECT;
+  }
+  if (muxscan_busy(&scanner)) {
+    return SUP_SWEEP;
+  }
+  return SUP_IDLE;
+}
 
-  pinMode(BOOT_0_PIN, INPUT);
-  pinMode(BOOT_2_PIN, INPUT);
-  pinMode(BOOT_15_PIN, INPUT);
+/**
+ * Log sink: encode one record and publish it
+ */
+static bool report_record(const tlog_record_t* record) {
+  const size_t mark = arena_mark(&netArena);
+#if TELEMETRY_TEXT_FORMAT
+  char* text = (char*)arena_alloc(&netArena, TFRAME_TEXT_MAX_BYTES);
+  if (text == nullptr) {
+    return false;
+  }
+  const size_t length = tframe_format_text(text, record, ESP.getChipId());
+  Serial.println(text);
+  const bool sent = mqttuplink_publish(&mqtt, ESP.getChipId(), record, (const uint8_t*)text, length);
+  arena_release(&netArena, mark);
+  return sent;
+#else
+  uint8_t* frame = (uint8_t*)arena_alloc(&netArena, TFRAME_MAX_BYTES);
+  if (frame == nullptr) {
+    return false;
+  }
+  const energy_report_t* energy = (rtcState.energy.flags & ENERGY_FLAG_UNSENT) ? &rtcState.energy : nullptr;
+  const sup_crash_t* unsent = supervisor_unsent(&supervisor);
+  tframe_crash_t crash;
+  if (unsent) {
+    crash = { unsent->reason, unsent->stage, unsent->count, unsent->flags, unsent->epc1 };
+  }
+#if NODE_ROLE == NODE_ROLE_LEAF
+  // No delta chains over ESP-NOW: a lost packet must not cost the next one
+  tframe_reset(&frameCtx);
+#endif
+  const uint32_t encodeStart = stats_cycles_begin();
+  const size_t length = tframe_encode(frame, &frameCtx, record, ESP.getChipId(), energy, unsent ? &crash : nullptr);
+  stats_cycles_end(STAGE_FRAME_ENCODE, encodeStart);
+#if NODE_ROLE == NODE_ROLE_LEAF
+  const bool sent = espnow_leaf_send(&espnowLeaf, frame, length);
+#else
+  const bool sent = mqttuplink_publish(&mqtt, ESP.getChipId(), record, frame, length);
+#endif
+  arena_release(&netArena, mark);
+  if (!sent) {
+    return false;
+  }
+  if (energy) {
+    rtcState.energy.flags = 0;
+  }
+  if (unsent) {
+    supervisor_sent(&supervisor);
+  }
+  return true;
+#endif
 }
 
+#if NODE_ROLE == NODE_ROLE_GATEWAY
+/**
+ * Gateway sink: republish a leaf's record under the leaf's node id
+ */
+static bool forward_leaf_record(uint32_t nodeId, const tlog_record_t* record,
+                                const uint8_t* frame, size_t length) {
+  if (!mqttuplink_connected(&mqtt)) {
+    return false;
+  }
+#if TELEMETRY_TEXT_FORMAT
+  (void)frame;
+  (void)length;
+  const size_t mark = arena_mark(&netArena);
+  char* text = (char*)arena_alloc(&netArena, TFRAME_TEXT_MAX_BYTES);
+  if (text == nullptr) {
+    return false;
+  }
+  const size_t textLength = tframe_format_text(text, record, nodeId);
+  const bool sent = mqttuplink_publish(&mqtt, nodeId, record, (const uint8_t*)text, textLength);
+  arena_release(&netArena, mark);
+  return sent;
+#else
+  // Leaf frames are keyframes, so they go out as they came in
+  return mqttuplink_publish(&mqtt, nodeId, record, frame, length);
+#endif
+}
+#endif
+
+/**
+ * Pick the LED pattern for what the node is doing right now
+ */
+static led_state_t current_led_state(void) {
+  if (portal.open) {
+    return LED_PORTAL;
+  }
+  if (wifiConn.state == WIFIFAST_CONNECTING) {
+    return LED_CONNECTING;
+  }
+  if (uploadFailed) {
+    return LED_UPLOAD_FAILED;
+  }
+  if (rtcState.battery.low) {
+    return LED_LOW_BATTERY;
+  }
+  if (muxscan_busy(&scanner)) {
+    return LED_SAMPLING;
+  }
+  return LED_IDLE;
+}
+
+/**
+ * WiFiManager callback after the portal's parameter form is submitted
+ */
+static void on_portal_params_saved(void) {
+  mqttuplink_params_saved(&mqtt);
+  cal_param_saved(&calTable);
+}
+
+/**
+ * cal                      print the table
+ * cal <ch> <dry> <wet>     set both points
+ * cal <ch> dry|wet         take one point from the last sweep
+ */
+static void cmd_cal(uint8_t argc, char** argv) {
+  if (argc >= 3) {
+    const unsigned long ch = strtoul(argv[1], nullptr, 10);
+    if (ch >= CAL_CHANNELS) {
+      Serial.println("bad channel");
+      return;
+    }
+    cal_channel_t* cal = &calTable.channel[ch];
+    uint16_t dry = cal->dry;
+    uint16_t wet = cal->wet;
+
+    if (strcmp(argv[2], "dry") == 0) {
+      dry = scanner.readings[ch];
+    } else if (strcmp(argv[2], "wet") == 0) {
+      wet = scanner.readings[ch];
+    } else if (argc >= 4) {
+      dry = (uint16_t)min(strtoul(argv[2], nullptr, 10), (unsigned long)ADC_RESULT_MAX);
+      wet = (uint16_t)min(strtoul(argv[3], nullptr, 10), (unsigned long)ADC_RESULT_MAX);
+    } else {
+      Serial.println("usage: cal <ch> <dry> <wet> | cal <ch> dry|wet");
+      return;
+    }
+    cal_channel_set(cal, dry, wet);
+    cal_save(&calTable);
+  }
+
+  for (uint8_t ch = 0; ch < CAL_CHANNELS; ch++) {
+    const cal_channel_t* cal = &calTable.channel[ch];
+    Serial.printf("ch%u dry=%u wet=%u slope=%d now=%u\n", ch, cal->dry, cal->wet,
+                  cal->slope_q16, cal_to_permille(cal, scanner.readings[ch]));
+  }
+}
+
+/**
+ * history                  hourly mean moisture for the last 24 h
+ */
+static void cmd_history(uint8_t, char**) {
+  const auto& hours = history.hour.closed();
+  const size_t first = (hours.size() > 24) ? hours.size() - 24 : 0;
+
+  for (size_t i = first; i < hours.size(); i++) {
+    const history_rollup_t& h = hours.at(i);
+    Serial.printf("%u n=%u", h.start_s, h.count);
+    for (uint8_t ch = 0; ch < HISTORY_CHANNELS; ch++) {
+      Serial.printf(" %u", history_rollup_get(h, ch, HISTORY_MEAN_SHIFT));
+    }
+    Serial.println();
+  }
+}
+
+/**
+ * stats                    stage timings and heap
+ * stats reset              clear the timing table
+ */
+static void cmd_stats(uint8_t argc, char** argv) {
+  if (argc >= 2 && strcmp(argv[1], "reset") == 0) {
+    stats_reset();
+  }
+  stats_print(&Serial);
+}
+
+/**
+ * energy                   charge breakdown of the last accounting period
+ */
+static void cmd_energy(uint8_t, char**) {
+  const energy_report_t* e = &rtcState.energy;
+  for (uint8_t s = 0; s < ENERGY_STATE_COUNT; s++) {
+    Serial.printf("%-7s %7u uAh\n", ENERGY_STATE_NAMES[s], e->charge_uah[s]);
+  }
+  Serial.printf("total   %7u uAh%s, life %u days\n", e->total_uah,
+                (e->flags & ENERGY_FLAG_OVER_BUDGET) ? " (over budget)" : "", e->life_days);
+}
+
+/**
+ * settle                   per-channel settle times
+ * settle tune              measure them again
+ */
+static void cmd_settle(uint8_t argc, char** argv) {
+  if (argc >= 2 && strcmp(argv[1], "tune") == 0) {
+    settleTuneRequested = true;
+    Serial.println("settle tuning queued");
+    return;
+  }
+  for (uint8_t ch = 0; ch < MUX_CHANNEL_COUNT; ch++) {
+    Serial.printf("ch%u %u us\n", ch, scanner.settle_us[ch]);
+  }
+}
+
+/**
+ * health                   per-channel probe fault detector state
+ */
+static void cmd_health(uint8_t, char**) {
+  static const char* const names[] = HEALTH_FAULT_NAMES;
+  for (uint8_t ch = 0; ch < HEALTH_CHANNELS; ch++) {
+    if (BATTERY_CHANNEL_MASK & chmask_bit(ch)) {
+      continue;
+    }
+    const health_channel_t* c = &rtcState.health.channel[ch];
+    const uint8_t faults = health_channel_faults(&rtcState.health, ch, rtcState.readings[ch]);
+    const uint8_t spread = health_spread_qc(c);
+    Serial.printf("ch%u spread %u.%02u stuck %u misses %u", ch, spread / 4, (spread % 4) * 25,
+                  c->stuck, c->misses);
+    for (uint8_t f = 0; f < sizeof(names) / sizeof(names[0]); f++) {
+      if (faults & (1U << f)) {
+        Serial.printf(" %s", names[f]);
+      }
+    }
+    Serial.println(faults ? "" : " ok");
+  }
+}
+
+/**
+ * stream <ch> [rate_hz]    binary raw A0 packets from one channel
+ * stream stop
+ */
+static void cmd_stream(uint8_t argc, char** argv) {
+  if (argc >= 2 && strcmp(argv[1], "stop") == 0) {
+    adcstream_stop(&adcStream);
+    Serial.printf("\nstream stopped, %u packets, %u dropped\n", adcStream.packets, adcStream.dropped);
+    return;
+  }
+  if (argc < 2) {
+    Serial.println("usage: stream <ch> [rate_hz] | stream stop");
+    return;
+  }
+  const unsigned long ch = strtoul(argv[1], nullptr, 10);
+  if (ch >= MUX_CHANNEL_COUNT) {
+    Serial.println("bad channel");
+    return;
+  }
+  if (muxscan_busy(&scanner) || settletune_busy(&settleTune) || adcStream.active) {
+    Serial.println("busy, try again");
+    return;
+  }
+  const uint32_t rate = (argc >= 3) ? strtoul(argv[2], nullptr, 10) : ADC_STREAM_RATE_HZ;
+  adcstream_start(&adcStream, (uint8_t)ch, rate);
+}
+
+static const serialcmd_entry_t SERIAL_COMMANDS[] = {
+  { "cal", cmd_cal, "show or set per-channel dry/wet calibration" },
+  { "history", cmd_history, "hourly mean moisture (0.1 %) for the last 24 h" },
+  { "stats", cmd_stats, "stage timings and heap; 'stats reset' clears" },
+  { "energy", cmd_energy, "charge used in the last wake / upload period" },
+  { "stream", cmd_stream, "binary raw A0 capture of one channel; 'stream stop' ends it" },
+  { "settle", cmd_settle, "per-channel mux settle times; 'settle tune' re-measures" },
+  { "health", cmd_health, "per-channel probe fault checks" },
+};
+
+
+/**
+ * True if this boot is the RTC timer waking us from deep sleep with the
+ * state we left behind still intact
+ */
+static bool woke_from_timer(bool rtcValid) {
+  return rtcValid && ESP.getResetInfoPtr()->reason == REASON_DEEP_SLEEP_AWAKE;
+}
+
+/**
+ * Record the finished sweep in RTC state, retune the interval and append
+ * the sweep to the log if it is worth reporting
+ *
+ * @return true if queued records should be uploaded now
+ */
+static bool commit_sweep(const muxscan_t* scan) {
+  // Fault checks run against the previous sweep and the EMA before it moves
+  const chmask_t lastFaults = health_faults(&rtcState.health, rtcState.readings, BATTERY_CHANNEL_MASK);
+  const chmask_t faults = health_update(&rtcState.health, &rtcState.adaptive, scan->readings,
+                                        rtcState.readings, BATTERY_CHANNEL_MASK);
+  memcpy(rtcState.readings, scan->readings, sizeof(rtcState.readings));
+  rtcState.sweepCount = scan->sweepCount;
+
+  // So is a probe failing or coming back
+  if (faults != lastFaults) {
+    Serial.print("health: faulty channels");
+    for (uint8_t ch = 0; ch < MUX_CHANNEL_COUNT; ch++) {
+      if (faults & chmask_bit(ch)) {
+        Serial.printf(" %u", ch);
+      }
+    }
+    Serial.println(faults ? "" : " none");
+    reportRequested = true;
+  }
+
+  // Entering or leaving low power mode is always reported
+  if ((scan->sampledMask & BATTERY_CHANNEL_MASK)
+      && battery_update(&rtcState.battery, scan->readings[Board::batteryMuxChannel])) {
+    reportRequested = true;
+  }
+  const bool forced = reportRequested;
+
+  uint16_t moisture[MUX_CHANNEL_COUNT];
+  for (uint8_t ch = 0; ch < MUX_CHANNEL_COUNT; ch++) {
+    moisture[ch] = (BATTERY_CHANNEL_MASK & chmask_bit(ch)) ? 0 : cal_to_permille(&calTable.channel[ch], scan->readings[ch]);
+  }
+  history.add(node_time_s(), moisture);
+
+  const bool changed = adaptive_update(&rtcState.adaptive, scan->readings, BATTERY_CHANNEL_MASK | faults, node_time_s());
+  if (changed || forced) {
+    reportRequested = false;
+
+    tlog_record_t record;
+    memset(&record, 0, sizeof(record));
+    record.timestamp = node_time_s();
+    record.channelMask = CHMASK_ALL & ~(BATTERY_CHANNEL_MASK | faults);
+    record.flags = TLOG_FLAG_CALIBRATED | (timesync_valid(&rtcState.time) ? TLOG_FLAG_EPOCH : 0)
+                 | (faults ? TLOG_FLAG_FAULTS : 0);
+    record.batteryMv = rtcState.battery.mv;
+    memcpy(record.readings, moisture, sizeof(moisture));
+    for (uint8_t ch = 0; ch < TLOG_CHANNELS; ch++) {
+      if (faults & chmask_bit(ch)) {
+        record.readings[ch] = health_channel_faults(&rtcState.health, ch, scan->readings[ch]);
+      }
+    }
+    tlog_append(&rtcState.log, &record);
+  }
+
+  // Low power mode only brings the radio up for full batches
+  const uint32_t pending = tlog_pending(&rtcState.log);
+  return pending > 0 && (!rtcState.battery.low || forced || pending >= TLOG_UPLOAD_BATCH);
+}
+
+/**
+ * End the current accounting period and log it if it went over budget
+ */
+static void close_energy_period(uint32_t sleep_ms) {
+  const energy_report_t* e = &rtcState.energy;
+  if (!energy_close(&energyMeter, &rtcState.energy, millis(), sleep_ms)) {
+    Serial.printf("energy: %u uAh over %u uAh budget (cpu %u radio %u sensor %u sleep %u)\n",
+                  e->total_uah, (unsigned)ENERGY_WAKE_BUDGET_UAH, e->charge_uah[ENERGY_CPU],
+                  e->charge_uah[ENERGY_RADIO], e->charge_uah[ENERGY_SENSOR], e->charge_uah[ENERGY_SLEEP]);
+  }
+}
+
+/**
+ * Time between sweeps: the adaptive interval, stretched in low power mode
+ */
+static uint32_t sweep_interval_s(void) {
+  const uint32_t interval_s = rtcState.adaptive.interval_s;
+  return (rtcState.battery.low && interval_s < BATTERY_LOW_INTERVAL_S) ? BATTERY_LOW_INTERVAL_S : interval_s;
+}
+
+/**
+ * Drain a batch of queued records while the radio is up
+ */
+static void upload_pending(void) {
+#if NODE_ROLE == NODE_ROLE_LEAF
+  if (!espnow_leaf_begin(&espnowLeaf)) {
+#else
+  if (WiFi.status() != WL_CONNECTED || !mqttuplink_connected(&mqtt)) {
+#endif
+    uploadFailed = tlog_pending(&rtcState.log) > 0;
+    return;
+  }
+#if !DUTY_CYCLE_MODE
+  close_energy_period(0);
+#endif
+  set_stage(SUP_UPLOAD);
+  tframe_reset(&frameCtx);
+  const uint32_t uploadStart = micros();
+  const uint16_t sent = tlog_drain(&rtcState.log, TLOG_UPLOAD_BATCH, report_record);
+  stats_record_us(STAGE_UPLOAD, micros() - uploadStart);
+  if (sent > 0) {
+    rtcState.sequence++;
+    supervisor_healthy(&supervisor);
+  }
+  uploadFailed = sent == 0 && tlog_pending(&rtcState.log) > 0;
+
+  arena_reset(&netArena);
+  const uint32_t previousMaxBlock = stats_heap_cycle();
+  if (previousMaxBlock != 0) {
+    Serial.printf("heap: max free block down to %u from %u\n", statsHeapWatch.lastMaxBlock, previousMaxBlock);
+  }
+}
+
+/**
+ * Stop trying to connect for now. Always-on nodes start over with the next
+ * report; duty-cycled ones go back to sleep.
+ */
+static void wifi_give_up(void) {
+  wifiConn.state = WIFIFAST_IDLE;
+  wifiFallbackDone = false;
+#if DUTY_CYCLE_MODE
+  sleepPending = true;
+#endif
+}
+
+/**
+ * Drive the connect: the cached AP first, then one attempt with a full
+ * scan. The portal opens when there are no credentials at all or after
+ * WIFI_PORTAL_AFTER_FAILURES failed sessions in a row.
+ */
+static void service_wifi(void) {
+  switch (portal_service(&portal, &wifiManager)) {
+    case PORTAL_CONNECTED:
+      wififast_capture(&rtcState.wifi);
+      rtcState.wifi.failures = 0;
+      wifiConn.state = WIFIFAST_CONNECTED;
+      // Send whatever queued up while the node was offline
+      sweepRequested = true;
+      reportRequested = true;
+      return;
+
+    case PORTAL_TIMEOUT:
+      wifi_give_up();
+      return;
+
+    case PORTAL_NONE:
+    default:
+      break;
+  }
+
+  const wififast_state_t state = wififast_service(&wifiConn, &rtcState.wifi);
+  if (state == WIFIFAST_CONNECTED) {
+    rtcState.wifi.failures = 0;
+  }
+  if (state != WIFIFAST_FAILED) {
+    return;
+  }
+
+  if (!wifiFallbackDone && !wifiConn.noCredentials) {
+    // The cache was dropped on failure, so this is a plain scan and DHCP
+    wifiFallbackDone = true;
+    wififast_begin(&wifiConn, &rtcState.wifi);
+    return;
+  }
+
+  if (rtcState.wifi.failures < 0xFF) {
+    rtcState.wifi.failures++;
+  }
+  if (wifiConn.noCredentials || rtcState.wifi.failures >= WIFI_PORTAL_AFTER_FAILURES) {
+    wifiConn.state = WIFIFAST_IDLE;
+    portal_open(&portal, &wifiManager);
+  } else {
+    wifi_give_up();
+  }
+}
+
+/**
+ * Short press: sweep and upload now. Long press: forget the WiFi
+ * credentials and reopen the config portal.
+ */
+static void handle_button(button_event_t event) {
+  switch (event) {
+    case BUTTON_SHORT_PRESS:
+      sweepRequested = true;
+      reportRequested = true;
+      break;
+
+    case BUTTON_LONG_PRESS:
+      if (!radio_allowed()) {
+        break;
+      }
+      wifiManager.resetSettings();
+      rtcState.wifi.valid = 0;
+      wifiConn.state = WIFIFAST_IDLE;
+      portal_open(&portal, &wifiManager);
+      break;
+
+    case BUTTON_NONE:
+    default:
+      break;
+  }
+}
+
+#if DUTY_CYCLE_MODE
+/**
+ * Persist state and power down until the next sweep is due. Time spent
+ * awake is taken off the sleep so the wake period stays on schedule.
+ */
+static void enter_deep_sleep(void) {
+  const uint64_t period_us = (uint64_t)sweep_interval_s() * 1000000ULL;
+  const uint64_t awake_us = (uint64_t)millis() * 1000ULL;
+  const uint64_t sleep_us = (awake_us < period_us) ? (period_us - awake_us) : period_us;
+
+  set_stage(SUP_SLEEP);
+  timesync_sleep(&rtcState.time, (uint32_t)(awake_us / 1000ULL), (uint32_t)(sleep_us / 1000ULL));
+  close_energy_period((uint32_t)(sleep_us / 1000ULL));
+  rtcstate_save(&rtcState);
+
+  Serial.flush();
+  ESP.deepSleep(sleep_us, RF_DEFAULT);
+}
+#endif
+
 
 void setup() {
-    Serial.begin(9600);
+    Serial.begin(SERIAL_BAUD);
+    energy_meter_init(&energyMeter, 0);
 
+    const bool timerWake = woke_from_timer(rtcstate_load(&rtcState));
+    if (timerWake) {
+        wififast_radio_off();
+    }
+    timesync_boot(&rtcState.time, timerWake);
+    if (supervisor_boot(&supervisor, ESP.getResetInfoPtr(), node_time_s())) {
+        const sup_crash_t* c = &supervisor.rtc.crash;
+        Serial.printf("crash: reason %u in %s, exccause %u epc1 0x%08x, %u in a row%s\n",
+                      c->reason, c->stage < SUP_STAGE_COUNT ? SUP_STAGE_NAMES[c->stage] : "?",
+                      c->exccause, c->epc1, c->count, supervisor_safe_mode(&supervisor) ? ", safe mode" : "");
+    }
+
+    muxscan_init(&scanner);
+    button_init(&resetButton);
+
+    if (timerWake) {
+        // Warm wake: pins are at reset defaults already and WiFi credentials
+        // are in the SDK config, so skip pin setup and the portal
+        memcpy(scanner.readings, rtcState.readings, sizeof(scanner.readings));
+        scanner.sweepCount = rtcState.sweepCount;
+    } else {
+        hwcfig_init();
+    }
+    statusled_engine_init(&statusLed);
+
+    if (!tlog_mount(&rtcState.log, timerWake)) {
+        Serial.println("telemetry log unavailable");
+    }
+
+    cal_load(&calTable);
+    if (!settle_load(scanner.settle_us) && !timerWake) {
+        // First boot on this board: measure before the first sweep
+        settleTuneRequested = true;
+    }
+    if (!timerWake) {
+        adaptive_init(&rtcState.adaptive, DUTY_CYCLE_MODE ? DUTY_CYCLE_PERIOD_S : SCAN_INTERVAL_MS / 1000);
+        health_init(&rtcState.health);
+    }
+
+    mqttuplink_init(&mqtt);
+    ota_init(&ota);
+    mqttuplink_add_params(&mqtt, &wifiManager);
+    cal_add_param(&calTable, &wifiManager);
+    wifiManager.setSaveParamsCallback(on_portal_params_saved);
+
+#if !DUTY_CYCLE_MODE
+    if (radio_allowed()) {
+        httpapi_init(&httpApi, &httpServer, &history, &scanner);
+    }
+#endif
+
+    // Associates in the background while the first sweep runs. A timer
+    // wake waits for the sweep instead: most of them have nothing to send
+    // and never need the radio. Leaves never associate at all.
+    if (!timerWake && NODE_ROLE != NODE_ROLE_LEAF && radio_allowed()) {
+        wififast_begin(&wifiConn, &rtcState.wifi);
+    }
+    set_stage(SUP_IDLE);
 }
 
 void loop() {
+    const uint32_t now = millis();
+
+    supervisor_service(&supervisor);
+    if (supervisor_safe_mode(&supervisor)) {
+        supervisor_retry(&supervisor, node_time_s());
+    }
+
+    handle_button(button_service(&resetButton));
+    serialcmd_service(&serialCli, SERIAL_COMMANDS, sizeof(SERIAL_COMMANDS) / sizeof(SERIAL_COMMANDS[0]));
+    service_wifi();
+    mqttuplink_service(&mqtt);
+#if NODE_ROLE == NODE_ROLE_LEAF
+    const bool radioOn = espnowLeaf.up || portal.open;
+#else
+    const bool radioOn = wifiConn.state != WIFIFAST_IDLE || portal.open;
+#endif
+    if (radioOn) {
+        energy_begin(&energyMeter, ENERGY_RADIO, now);
+    }
+
+#if !DUTY_CYCLE_MODE
+    if (httpApi.settleTuneRequested) {
+        httpApi.settleTuneRequested = false;
+        settleTuneRequested = true;
+    }
+#endif
+    adcstream_service(&adcStream);
+    if (settleTuneRequested && !muxscan_busy(&scanner) && !adcStream.active) {
+        settleTuneRequested = false;
+        settletune_start(&settleTune);
+        energy_begin(&energyMeter, ENERGY_SENSOR, now);
+    }
+    if (settletune_service(&settleTune)) {
+        energy_end(&energyMeter, ENERGY_SENSOR, millis());
+        memcpy(scanner.settle_us, settleTune.result_us, sizeof(scanner.settle_us));
+        settle_save(scanner.settle_us);
+        Serial.print("settle us:");
+        for (uint8_t ch = 0; ch < MUX_CHANNEL_COUNT; ch++) {
+            Serial.printf(" %u", scanner.settle_us[ch]);
+        }
+        Serial.println();
+    }
+
+    if (!muxscan_busy(&scanner) && !settletune_busy(&settleTune) && !adcStream.active
+        && (sweepRequested || (now - lastSweepStart_ms) >= sweep_interval_s() * 1000UL)) {
+        sweepRequested = false;
+        lastSweepStart_ms = now;
+        muxscan_start(&scanner, battery_skip_mask(scanner.sweepCount));
+        energy_begin(&energyMeter, ENERGY_SENSOR, now);
+    }
+
+    if (muxscan_service(&scanner)) {
+        energy_end(&energyMeter, ENERGY_SENSOR, millis());
+        set_stage(SUP_COMMIT);
+        reportPending = commit_sweep(&scanner) && radio_allowed();
+        if (reportPending && wifiConn.state == WIFIFAST_IDLE && !portal.open && NODE_ROLE != NODE_ROLE_LEAF) {
+            wififast_begin(&wifiConn, &rtcState.wifi);
+        }
+#if DUTY_CYCLE_MODE
+        if (!reportPending) {
+            sleepPending = true;
+        }
+#endif
+    }
+
+    // Hold the report until the link has either come up or been given up on
+    if (reportPending && wifiConn.state != WIFIFAST_CONNECTING) {
+        reportPending = false;
+        upload_pending();
+#if DUTY_CYCLE_MODE
+        // Every radio session asks for an update; sleep waits for the pull
+        if (NODE_ROLE != NODE_ROLE_LEAF) {
+            ota_check(&ota);
+        }
+        sleepPending = true;
+#endif
+    }
+
+#if !DUTY_CYCLE_MODE
+    if (wifiConn.state == WIFIFAST_CONNECTED) {
+        if (!otaLanStarted) {
+            ota_lan_begin();
+            otaLanStarted = true;
+        }
+        if (ota_check_due(&ota)) {
+            ota_check(&ota);
+        }
+    }
+#endif
+    if (wifiConn.state == WIFIFAST_CONNECTED && timesync_due(&rtcState.time)) {
+        timesync_begin(&rtcState.time);
+    }
+    timesync_service(&rtcState.time);
+
+#if NODE_ROLE == NODE_ROLE_LEAF
+    // The gateway answers every frame with its time, so there is no SNTP
+    const bool espnowBusy = espnow_leaf_service(&espnowLeaf, &rtcState.time, timesync_due(&rtcState.time));
+#if !DUTY_CYCLE_MODE
+    (void)espnowBusy;                               // only ever holds off deep sleep
+#endif
+#elif NODE_ROLE == NODE_ROLE_GATEWAY
+    if (!espnowGwStarted && wifiConn.state == WIFIFAST_CONNECTED) {
+        espnowGwStarted = espnow_gateway_begin(&espnowGw);
+    }
+    if (espnowGwStarted) {
+        espnow_gateway_service(&espnowGw, &rtcState.time, forward_leaf_record);
+    }
+#endif
+
+    if (ota_service(&ota)) {
+        // The new image may not accept this RTC layout, so staged records go to flash
+        tlog_flush(&rtcState.log);
+        rtcstate_save(&rtcState);
+        ESP.restart();
+    }
+#if DUTY_CYCLE_MODE
+#if NODE_ROLE != NODE_ROLE_LEAF
+    const bool espnowBusy = false;
+#endif
+    if (sleepPending && !ota_busy(&ota) && !timesync_busy(&rtcState.time) && !portal.open && !espnowBusy
+        && !settletune_busy(&settleTune) && !settleTuneRequested && !adcStream.active) {
+        enter_deep_sleep();
+    }
+#endif
 
+    set_stage(current_stage());
+    statusled_set_state(&statusLed, current_led_state());
+    statusled_tick(&statusLed);
 }
\ No newline at end of file
@@ -0,0 +1,124 @@
+/**
+ * Adaptive sweep interval and report-on-change.
+ *
+ * Every channel keeps an exponential moving average of its readings and a
+ * smoothed per-sweep derivative of that average, both in fixed point with
+ * ADAPTIVE_FRAC_BITS fraction bits (as many as fit in 16 bits, 4 with the
+ * default 12-bit results) and updated with shifts only. After each sweep:
+ *
+ *  - a reading that jumps more than ADAPTIVE_STEP_COUNTS away from its
+ *    average (watering) drops the interval to ADAPTIVE_MIN_INTERVAL_S
+ *  - if every channel's derivative is under ADAPTIVE_STABLE_COUNTS the
+ *    interval doubles, up to ADAPTIVE_MAX_INTERVAL_S
+ *  - otherwise the interval halves back toward the base interval
+ *
+ * A sweep is only worth reporting when some channel has moved by more than
+ * ADAPTIVE_DEADBAND_COUNTS since it was last reported, or when
+ * ADAPTIVE_HEARTBEAT_S has passed. All values are filtered ADC counts, so
+ * calibration changes do not upset the state.
+ *
+ * The state is small enough to live in RTC memory across deep sleep.
+ */
+
+#pragma once
+
+#include "hal.h"
+#include "config.h"
+#include "adc_filter.h"
+#include "channel_mask.h"
+
+
+#define ADAPTIVE_CHANNELS       (MUX_CHANNEL_COUNT)
+#define ADAPTIVE_FRAC_BITS      (16 - ADC_RESULT_BITS)
+
+typedef struct adaptive_channel {
+  uint16_t ema;                                 //! Reading average, ADAPTIVE_FRAC_BITS fixed point
+  int16_t slope;                                //! Smoothed EMA change per sweep, same scale
+  uint16_t reported;                            //! Reading at the last report
+} adaptive_channel_t;
+
+typedef struct adaptive {
+  adaptive_channel_t channel[ADAPTIVE_CHANNELS];
+  uint32_t base_s;                              //! Interval to relax back to
+  uint32_t interval_s;                          //! Current sweep interval
+  uint32_t lastReport_s;
+  uint8_t primed;                               //! EMA seeded from a first sweep
+  uint8_t reserved[3];
+} adaptive_t;
+
+
+static inline void adaptive_init(adaptive_t* ad, uint32_t base_s) {
+  memset(ad, 0, sizeof(*ad));
+  ad->base_s = base_s;
+  ad->interval_s = base_s;
+}
+
+static inline uint32_t adaptive_interval_ms(const adaptive_t* ad) {
+  return ad->interval_s * 1000UL;
+}
+
+/**
+ * Fold in one sweep and retune the interval
+ *
+ * @param ignoreMask  channels left out of the rate decision
+ * @return true if this sweep should be reported
+ */
+static inline bool adaptive_update(adaptive_t* ad, const uint16_t* readings,
+                                   chmask_t ignoreMask, uint32_t now_s) {
+  if (!ad->primed) {
+    for (uint8_t ch = 0; ch < ADAPTIVE_CHANNELS; ch++) {
+      ad->channel[ch].ema = (uint16_t)(readings[ch] << ADAPTIVE_FRAC_BITS);
+      ad->channel[ch].slope = 0;
+      ad->channel[ch].reported = readings[ch];
+    }
+    ad->primed = 1;
+    ad->lastReport_s = now_s;
+    return true;
+  }
+
+  bool step = false;
+  bool stable = true;
+  bool changed = false;
+
+  for (uint8_t ch = 0; ch < ADAPTIVE_CHANNELS; ch++) {
+    adaptive_channel_t* c = &ad->channel[ch];
+    const int32_t sample = (int32_t)readings[ch] << ADAPTIVE_FRAC_BITS;
+    const int32_t prev = c->ema;
+    const int32_t ema = prev + ((sample - prev) >> ADAPTIVE_EMA_SHIFT);
+
+    c->ema = (uint16_t)ema;
+    c->slope += (int16_t)(((ema - prev) - c->slope) >> ADAPTIVE_EMA_SHIFT);
+
+    if (ignoreMask & chmask_bit(ch)) {
+      continue;
+    }
+    if (abs((int)readings[ch] - (int)c->reported) > ADAPTIVE_DEADBAND_COUNTS) {
+      changed = true;
+    }
+    if (abs(sample - prev) > ((int32_t)ADAPTIVE_STEP_COUNTS << ADAPTIVE_FRAC_BITS)) {
+      step = true;
+    }
+    if (abs(c->slope) >= ((int32_t)ADAPTIVE_STABLE_COUNTS << ADAPTIVE_FRAC_BITS)) {
+      stable = false;
+    }
+  }
+
+  if (step) {
+    ad->interval_s = ADAPTIVE_MIN_INTERVAL_S;
+  } else if (stable) {
+    ad->interval_s = min(ad->interval_s * 2, (uint32_t)ADAPTIVE_MAX_INTERVAL_S);
+  } else if (ad->interval_s > ad->base_s) {
+    ad->interval_s = max(ad->interval_s / 2, ad->base_s);
+  } else if (ad->interval_s < ad->base_s) {
+    ad->interval_s = min(ad->interval_s * 2, ad->base_s);
+  }
+
+  const bool report = changed || step || (uint32_t)(now_s - ad->lastReport_s) >= ADAPTIVE_HEARTBEAT_S;
+  if (report) {
+    for (uint8_t ch = 0; ch < ADAPTIVE_CHANNELS; ch++) {
+      ad->channel[ch].reported = readings[ch];
+    }
+    ad->lastReport_s = now_s;
+  }
+  return report;
+}
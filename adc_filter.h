@@ -0,0 +1,72 @@
+/**
+ * Oversampling and decimation for the 10-bit moisture ADC.
+ *
+ * Each channel gets a short burst of raw reads into a fixed-size stack
+ * buffer. The burst is sorted, ADC_TRIM_SAMPLES are dropped from both ends
+ * to reject outliers (trimming (N - 1) / 2 from each end turns this into a
+ * plain median) and the rest are averaged in integer math with
+ * ADC_EXTRA_BITS of extra resolution.
+ *
+ * Results are unsigned fixed point with ADC_RESULT_BITS total bits, i.e.
+ * 0 .. ADC_RESULT_MAX rather than 0 .. 1023.
+ */
+
+#pragma once
+
+#include "hal.h"
+#include "config.h"
+
+
+#define ADC_RAW_BITS        (10)
+#define ADC_RESULT_BITS     (ADC_RAW_BITS + ADC_EXTRA_BITS)
+#define ADC_RESULT_MAX      ((1U << ADC_RESULT_BITS) - 1)
+#define ADC_KEPT_SAMPLES    (ADC_BURST_SAMPLES - 2 * ADC_TRIM_SAMPLES)
+
+static_assert(ADC_BURST_SAMPLES >= 1 && ADC_BURST_SAMPLES <= 64,
+              "ADC burst must be 1..64 samples");
+static_assert(ADC_KEPT_SAMPLES >= 1, "ADC_TRIM_SAMPLES drops the whole burst");
+static_assert(ADC_RESULT_BITS <= 16, "decimated result must fit in uint16_t");
+
+
+/**
+ * Sort a small buffer in place. Insertion sort is the cheapest option for
+ * at most 64 mostly-similar values and needs no extra memory.
+ */
+static inline void adcfilter_sort(uint16_t* buf, uint8_t count) {
+  for (uint8_t i = 1; i < count; i++) {
+    const uint16_t v = buf[i];
+    uint8_t j = i;
+    while (j > 0 && buf[j - 1] > v) {
+      buf[j] = buf[j - 1];
+      j--;
+    }
+    buf[j] = v;
+  }
+}
+
+/**
+ * Reduce a raw burst of ADC_BURST_SAMPLES reads to one fixed-point value.
+ * The buffer is reordered.
+ */
+static inline uint16_t adcfilter_decimate(uint16_t* buf) {
+  adcfilter_sort(buf, ADC_BURST_SAMPLES);
+
+  uint32_t sum = 0;
+  for (uint8_t i = ADC_TRIM_SAMPLES; i < ADC_BURST_SAMPLES - ADC_TRIM_SAMPLES; i++) {
+    sum += buf[i];
+  }
+
+  // Divisor is a compile-time constant, so this becomes a multiply
+  return (uint16_t)(((sum << ADC_EXTRA_BITS) + ADC_KEPT_SAMPLES / 2) / ADC_KEPT_SAMPLES);
+}
+
+/**
+ * Take one burst from an analog pin and return the decimated value
+ */
+static inline uint16_t adcfilter_burst(uint8_t pin) {
+  uint16_t buf[ADC_BURST_SAMPLES];
+  for (uint8_t i = 0; i < ADC_BURST_SAMPLES; i++) {
+    buf[i] = hal_adc_read(pin);
+  }
+  return adcfilter_decimate(buf);
+}
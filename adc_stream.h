@@ -0,0 +1,188 @@
+/**
+ * Raw A0 capture streamed over the serial port as binary packets.
+ *
+ * For probe diagnostics: one mux channel stays selected with the sensor
+ * rail up, and unfiltered 10-bit reads go out as fast as the link takes
+ * them. At SERIAL_BAUD 921600 that is ~40 k samples/s of link capacity.
+ * The ADC is the limit in practice. ADC_STREAM_RATE_HZ (or the rate given
+ * to "stream") paces the reads for a fixed sample period.
+ *
+ * Packet, little endian, ADCSTREAM_PACKET_BYTES long:
+ *
+ *   0   2   sync 0x5A 0xA5
+ *   2   2   sequence, +1 per packet, including packets dropped here
+ *   4   1   mux channel
+ *   5   1   sample count (ADC_STREAM_SAMPLES)
+ *   6   4   micros() at the first sample
+ *   10  2   µs from the first to the last sample
+ *   12  2n  samples
+ *   ..  2   CRC-16 of everything before it
+ *
+ * Sampling and sending are interleaved. One buffer fills while the other
+ * drains into the UART FIFO, never more than availableForWrite(), so
+ * neither ever blocks. If the link falls behind, a full buffer is dropped
+ * and the host sees the gap in the sequence. Console text printed
+ * meanwhile ends up between packets. The host resynchronises on the sync
+ * marker and the CRC.
+ *
+ * Each adcstream_service() call samples for at most ADC_STREAM_SLICE_US,
+ * then returns to the loop. Sweeps and tuning are held off while a stream
+ * runs, since all three drive the mux and the sensor rail.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include "hal.h"
+#include "config.h"
+#include "board.h"
+#include "crc.h"
+#include "mux_scan.h"
+#include "sensor_power.h"
+
+
+#define ADCSTREAM_SYNC0         (0x5A)
+#define ADCSTREAM_SYNC1         (0xA5)
+#define ADCSTREAM_HEADER_BYTES  (12)
+#define ADCSTREAM_PACKET_BYTES  (ADCSTREAM_HEADER_BYTES + 2 * ADC_STREAM_SAMPLES + 2)
+
+static_assert(ADC_STREAM_SAMPLES > 0 && ADC_STREAM_SAMPLES <= 255, "sample count must fit the count byte");
+
+typedef struct adcstream_buffer {
+  uint8_t data[ADCSTREAM_PACKET_BYTES];
+  uint16_t sent;                                //! Bytes already written to the UART
+  bool ready;                                   //! Complete, waiting to be sent
+} adcstream_buffer_t;
+
+typedef struct adcstream {
+  bool active;
+  bool warm;                                    //! Sensor rail has had SENSOR_WARMUP_MS
+  uint8_t channel;
+  uint16_t sequence;
+  uint32_t period_us;                           //! 0 for back to back reads
+  uint32_t next_us;                             //! Due time of the next read (end of warm-up at first)
+  uint8_t count;                                //! Samples in the filling buffer
+  uint8_t fill;                                 //! Buffer being filled, the other one drains
+  uint32_t first_us;
+  uint32_t packets;
+  uint32_t dropped;
+  adcstream_buffer_t buffer[2];
+} adcstream_t;
+
+
+/**
+ * Select the channel and start streaming
+ *
+ * @param rate_hz  sample rate, 0 for as fast as possible
+ */
+static inline void adcstream_start(adcstream_t* stream, uint8_t channel, uint32_t rate_hz) {
+  memset(stream, 0, sizeof(*stream));
+  stream->channel = channel;
+  stream->period_us = rate_hz ? 1000000UL / rate_hz : 0;
+  sensorpower<Board>::on(false);
+  MuxArray::write(channel);
+  stream->next_us = hal_micros() + SENSOR_WARMUP_MS * 1000UL;
+  stream->active = true;
+}
+
+static inline void adcstream_stop(adcstream_t* stream) {
+  if (stream->active) {
+    sensorpower<Board>::off();
+    stream->active = false;
+  }
+}
+
+/**
+ * Fill in header and CRC and queue the buffer for sending
+ */
+static inline void adcstream_seal(adcstream_t* stream, uint32_t last_us) {
+  adcstream_buffer_t* b = &stream->buffer[stream->fill];
+  uint8_t* p = b->data;
+  const uint32_t span = last_us - stream->first_us;
+  p[0] = ADCSTREAM_SYNC0;
+  p[1] = ADCSTREAM_SYNC1;
+  p[2] = (uint8_t)stream->sequence;
+  p[3] = (uint8_t)(stream->sequence >> 8);
+  p[4] = stream->channel;
+  p[5] = ADC_STREAM_SAMPLES;
+  p[6] = (uint8_t)stream->first_us;
+  p[7] = (uint8_t)(stream->first_us >> 8);
+  p[8] = (uint8_t)(stream->first_us >> 16);
+  p[9] = (uint8_t)(stream->first_us >> 24);
+  p[10] = (uint8_t)(span > 0xFFFF ? 0xFF : span);
+  p[11] = (uint8_t)(span > 0xFFFF ? 0xFF : span >> 8);
+  const uint16_t crc = crc16_compute(p, ADCSTREAM_PACKET_BYTES - 2);
+  p[ADCSTREAM_PACKET_BYTES - 2] = (uint8_t)crc;
+  p[ADCSTREAM_PACKET_BYTES - 1] = (uint8_t)(crc >> 8);
+  stream->sequence++;
+  stream->count = 0;
+
+  adcstream_buffer_t* other = &stream->buffer[stream->fill ^ 1];
+  if (other->ready) {
+    // Link is behind: this packet is lost, its sequence number stays used
+    stream->dropped++;
+    return;
+  }
+  b->sent = 0;
+  b->ready = true;
+  stream->packets++;
+  stream->fill ^= 1;
+}
+
+/**
+ * Push queued bytes into whatever room the UART FIFO has
+ */
+static inline void adcstream_send(adcstream_t* stream) {
+  adcstream_buffer_t* b = &stream->buffer[stream->fill ^ 1];
+  if (!b->ready) {
+    return;
+  }
+  const int room = Serial.availableForWrite();
+  if (room <= 0) {
+    return;
+  }
+  const size_t n = min((size_t)room, (size_t)(ADCSTREAM_PACKET_BYTES - b->sent));
+  b->sent += Serial.write(b->data + b->sent, n);
+  if (b->sent >= ADCSTREAM_PACKET_BYTES) {
+    b->ready = false;
+  }
+}
+
+/**
+ * Sample and send for one time slice
+ */
+static inline void adcstream_service(adcstream_t* stream) {
+  if (!stream->active) {
+    return;
+  }
+  const uint32_t sliceStart = hal_micros();
+  if (!stream->warm) {
+    if ((int32_t)(sliceStart - stream->next_us) < 0) {
+      return;
+    }
+    stream->warm = true;
+  }
+
+  uint32_t now = sliceStart;
+  do {
+    if (stream->period_us == 0 || (int32_t)(now - stream->next_us) >= 0) {
+      uint16_t* samples = (uint16_t*)(stream->buffer[stream->fill].data + ADCSTREAM_HEADER_BYTES);
+      if (stream->count == 0) {
+        stream->first_us = now;
+      }
+      samples[stream->count++] = hal_adc_read(Board::moistureAdc);
+      if (stream->period_us) {
+        stream->next_us += stream->period_us;
+        // Fell behind by more than a period (WiFi, a long loop): re-anchor
+        if ((int32_t)(now - stream->next_us) > (int32_t)stream->period_us) {
+          stream->next_us = now + stream->period_us;
+        }
+      }
+      if (stream->count == ADC_STREAM_SAMPLES) {
+        adcstream_seal(stream, now);
+      }
+    }
+    adcstream_send(stream);
+    now = hal_micros();
+  } while ((uint32_t)(now - sliceStart) < ADC_STREAM_SLICE_US);
+}
@@ -0,0 +1,81 @@
+/**
+ * Fixed-size scratch arena for the reporting path.
+ *
+ * Frame and payload buffers, the MQTT pipeline and the OTA request are
+ * only needed for one record or one request. They are carved out of one
+ * static block (NET_ARENA_BYTES) instead of being malloc'd, or kept as
+ * separate statics that all sit idle at once. Allocation is a 4-byte
+ * aligned bump. A caller that is done with its scratch gives it back with
+ * arena_release() to the mark it took on the way in. The upload loop
+ * resets the arena after every cycle, so a missed release cannot
+ * accumulate.
+ *
+ * Running out returns nullptr. Callers treat that like a failed send, so
+ * the record stays queued. The peak is kept so NET_ARENA_BYTES can be
+ * sized from the field ("stats", GET /stats).
+ *
+ * The default size is worked out here from the largest user: one MQTT
+ * sweep (payload plus pipeline) or the OTA request, whichever is bigger.
+ * The publish sizes live here rather than in mqtt_uplink.h so the arena
+ * can be declared before the uplink is included.
+ */
+
+#pragma once
+
+#include "hal.h"
+#include "config.h"
+#include "telemetry_frame.h"
+
+
+#define MQTT_PREFIX_MAX         (32)
+#define MQTT_TOPIC_MAX          (MQTT_PREFIX_MAX + 24)  //! "<prefix>/<node>/ch/<n>/fault" and the terminator
+#define MQTT_VALUE_MAX          (8)
+#define MQTT_PUBLISH_HEADER_MAX (1 + 4 + 2)       //! Packet type, remaining length, topic length
+#define MQTT_PUBLISH_MAX(payload) (MQTT_PUBLISH_HEADER_MAX + MQTT_TOPIC_MAX + (payload))
+#define MQTT_FRAME_PAYLOAD_MAX  (TFRAME_TEXT_MAX_BYTES > TFRAME_MAX_BYTES ? TFRAME_TEXT_MAX_BYTES : TFRAME_MAX_BYTES)
+#define MQTT_PIPELINE_BYTES     (MQTT_PUBLISH_MAX(MQTT_FRAME_PAYLOAD_MAX) + TLOG_CHANNELS * MQTT_PUBLISH_MAX(MQTT_VALUE_MAX))
+#define OTA_REQUEST_MAX         (384)
+
+#define NET_ARENA_MQTT_BYTES    (((MQTT_FRAME_PAYLOAD_MAX + 3) & ~3) + MQTT_PIPELINE_BYTES)
+#define NET_ARENA_MIN_BYTES     (NET_ARENA_MQTT_BYTES > OTA_REQUEST_MAX ? NET_ARENA_MQTT_BYTES : OTA_REQUEST_MAX)
+
+
+typedef struct arena {
+  size_t used;
+  size_t peak;                                  //! Highest use since boot
+  uint32_t failures;                            //! Allocations that did not fit
+  alignas(4) uint8_t storage[NET_ARENA_BYTES];
+} arena_t;
+
+static arena_t netArena;
+
+
+static inline void* arena_alloc(arena_t* arena, size_t size) {
+  const size_t start = (arena->used + 3) & ~(size_t)3;
+  if (size > sizeof(arena->storage) || start > sizeof(arena->storage) - size) {
+    arena->failures++;
+    return nullptr;
+  }
+  arena->used = start + size;
+  if (arena->used > arena->peak) {
+    arena->peak = arena->used;
+  }
+  return arena->storage + start;
+}
+
+static inline size_t arena_mark(const arena_t* arena) {
+  return arena->used;
+}
+
+/**
+ * Free everything allocated since the mark was taken
+ */
+static inline void arena_release(arena_t* arena, size_t mark) {
+  if (mark < arena->used) {
+    arena->used = mark;
+  }
+}
+
+static inline void arena_reset(arena_t* arena) {
+  arena->used = 0;
+}
@@ -0,0 +1,62 @@
+/**
+ * Supply voltage monitoring through the moisture ADC.
+ *
+ * The ESP8266 has a single ADC, so the battery divider sits on one of the
+ * mux channels (Board::batteryMuxChannel) and is read as part of a sweep.
+ * The voltage changes slowly, so the channel is only included in every
+ * BATTERY_SAMPLE_EVERY-th sweep and left out of the others.
+ *
+ * The low flag has hysteresis. It is raised below BATTERY_LOW_MV and
+ * cleared above BATTERY_RECOVER_MV. While it is set the node runs in low
+ * power mode: it sleeps at least BATTERY_LOW_INTERVAL_S and only brings
+ * up the radio once a full upload batch has queued.
+ */
+
+#pragma once
+
+#include "hal.h"
+#include "config.h"
+#include "board.h"
+#include "adc_filter.h"
+#include "channel_mask.h"
+
+
+#define BATTERY_FITTED          (Board::batteryMuxChannel != CHANNEL_NONE)
+#define BATTERY_CHANNEL_MASK    (BATTERY_FITTED ? chmask_bit(Board::batteryMuxChannel) : (chmask_t)0)
+
+static_assert(!BATTERY_FITTED || Board::batteryMuxChannel < MUX_CHANNEL_COUNT, "battery channel is not a mux channel");
+static_assert(!BATTERY_FITTED || Board::batteryFullScaleMv > 0, "battery divider needs a full-scale voltage");
+
+/**
+ * Battery state, kept in RTC
+ */
+typedef struct battery {
+  uint16_t mv;                                  //! Last measurement, 0 before the first
+  uint8_t low;                                  //! Low power mode
+  uint8_t reserved;
+} battery_t;
+
+
+/**
+ * Channels to leave out of the sweep with this count
+ */
+static inline chmask_t battery_skip_mask(uint32_t sweepCount) {
+  return (sweepCount % BATTERY_SAMPLE_EVERY == 0) ? (chmask_t)0 : BATTERY_CHANNEL_MASK;
+}
+
+static constexpr uint16_t battery_counts_to_mv(uint16_t counts) {
+  return (uint16_t)(((uint32_t)counts * Board::batteryFullScaleMv + ADC_RESULT_MAX / 2) / ADC_RESULT_MAX);
+}
+
+/**
+ * Take a new reading from a sweep that included the battery channel
+ *
+ * @return true if low power mode was entered or left
+ */
+static inline bool battery_update(battery_t* bat, uint16_t counts) {
+  bat->mv = battery_counts_to_mv(counts);
+  const bool low = bat->low ? (bat->mv < BATTERY_RECOVER_MV) : (bat->mv < BATTERY_LOW_MV);
+  const bool changed = low != (bat->low != 0);
+  bat->low = low;
+  return changed;
+}
@@ -0,0 +1,205 @@
+/**
+ * Board descriptions, one per hardware revision.
+ *
+ * Pins are compile-time constants so the drivers templated on a board
+ * (mux select lines, status LED, sensor rail) reduce to fixed register
+ * writes. Every revision is checked at compile time for pins used twice
+ * and for anything driven on a boot strap pin.
+ *
+ * Rev 1: original layout. The mux S2 line was on D3, which is the GPIO0
+ *        boot strap, and is reworked to D7. The LED is on D0, so these
+ *        boards cannot be jumpered for deep-sleep wake.
+ * Rev 2: LED moved to D4 (active low, to Vcc, which keeps the GPIO2 strap
+ *        high) so D0 is free to be tied to RST for the deep-sleep timer.
+ *        Mux channel 4 carries a 1:1 battery divider instead of a probe.
+ * Rev 3: bench expander, one node for up to 32 probes. Rev 2 layout
+ *        without the battery divider. Up to four 4051s share S0..S2, and a
+ *        74HC139 on two bank lines (D0 and SD3) drives their INH pins, so
+ *        one mux is enabled at a time. D0 is a bank line, so the board
+ *        runs always-on.
+ *
+ * Bank lines (muxBank0..2) pick the mux. With muxBankEnable they are the
+ * active-low INH pins themselves, one per mux, which needs no decoder but
+ * one pin per mux. Otherwise they are a binary address for a decoder or a
+ * second-level 4051, three lines for up to eight muxes.
+ */
+
+#pragma once
+
+#include "hal.h"
+#include "config.h"
+
+
+#define PIN_NONE            (0xFF)
+#define CHANNEL_NONE        (0xFF)
+
+
+struct BoardRev1 {
+  static constexpr uint8_t resetButton        = D5;
+  static constexpr uint8_t statusLed          = D0;
+  static constexpr bool    statusLedActiveLow = false;
+  static constexpr uint8_t moistureAdc        = A0;
+  static constexpr uint8_t muxSelect0         = D1;
+  static constexpr uint8_t muxSelect1         = D2;
+  static constexpr uint8_t muxSelect2         = D7;
+  static constexpr uint8_t muxBank0           = PIN_NONE;
+  static constexpr uint8_t muxBank1           = PIN_NONE;
+  static constexpr uint8_t muxBank2           = PIN_NONE;
+  static constexpr bool    muxBankEnable      = false;
+  static constexpr uint8_t sensorPower        = D6;   //! High-side switch for the OP282 / probe rail
+  static constexpr uint8_t sensorPowerAlt     = PIN_NONE;
+  static constexpr uint8_t batteryMuxChannel  = CHANNEL_NONE;
+  static constexpr uint16_t batteryFullScaleMv = 0;
+  static constexpr uint8_t boot0              = D3;   //! Vcc for flash run, GND for program
+  static constexpr uint8_t boot2              = D4;   //! Always Vcc (via external pullup)
+  static constexpr uint8_t boot15             = D8;   //! Always GND (via external pulldown)
+  static constexpr bool    deepSleepWake      = false;
+};
+
+struct BoardRev2 {
+  static constexpr uint8_t resetButton        = D5;
+  static constexpr uint8_t statusLed          = D4;
+  static constexpr bool    statusLedActiveLow = true;
+  static constexpr uint8_t moistureAdc        = A0;
+  static constexpr uint8_t muxSelect0         = D1;
+  static constexpr uint8_t muxSelect1         = D2;
+  static constexpr uint8_t muxSelect2         = D7;
+  static constexpr uint8_t muxBank0           = PIN_NONE;
+  static constexpr uint8_t muxBank1           = PIN_NONE;
+  static constexpr uint8_t muxBank2           = PIN_NONE;
+  static constexpr bool    muxBankEnable      = false;
+  static constexpr uint8_t sensorPower        = D6;
+  static constexpr uint8_t sensorPowerAlt     = PIN_NONE;
+  static constexpr uint8_t batteryMuxChannel  = 4;      //! Last in sweep order, so skipping it keeps Gray steps
+  static constexpr uint16_t batteryFullScaleMv = 6400;  //! Battery voltage at ADC full scale (divider * 3.2 V)
+  static constexpr uint8_t boot0              = D3;
+  static constexpr uint8_t boot2              = D4;
+  static constexpr uint8_t boot15             = D8;
+  static constexpr bool    deepSleepWake      = true;   //! D0 jumpered to RST
+};
+
+struct BoardRev3 {
+  static constexpr uint8_t resetButton        = D5;
+  static constexpr uint8_t statusLed          = D4;
+  static constexpr bool    statusLedActiveLow = true;
+  static constexpr uint8_t moistureAdc        = A0;
+  static constexpr uint8_t muxSelect0         = D1;
+  static constexpr uint8_t muxSelect1         = D2;
+  static constexpr uint8_t muxSelect2         = D7;
+  static constexpr uint8_t muxBank0           = D0;
+  static constexpr uint8_t muxBank1           = 10;     //! SD3, free on modules with DIO flash
+  static constexpr uint8_t muxBank2           = PIN_NONE;
+  static constexpr bool    muxBankEnable      = false;  //! 74HC139 decodes the bank address
+  static constexpr uint8_t sensorPower        = D6;
+  static constexpr uint8_t sensorPowerAlt     = PIN_NONE;
+  static constexpr uint8_t batteryMuxChannel  = CHANNEL_NONE;
+  static constexpr uint16_t batteryFullScaleMv = 0;
+  static constexpr uint8_t boot0              = D3;
+  static constexpr uint8_t boot2              = D4;
+  static constexpr uint8_t boot15             = D8;
+  static constexpr bool    deepSleepWake      = false;
+};
+
+
+/**
+ * No GPIO is assigned to two functions
+ */
+template <class B>
+constexpr bool board_pins_unique(void) {
+  const uint8_t pins[] = {
+    B::resetButton, B::statusLed, B::muxSelect0, B::muxSelect1,
+    B::muxSelect2, B::muxBank0, B::muxBank1, B::muxBank2,
+    B::sensorPower, B::sensorPowerAlt
+  };
+  const size_t count = sizeof(pins) / sizeof(pins[0]);
+  for (size_t i = 0; i < count; i++) {
+    for (size_t j = i + 1; j < count; j++) {
+      if (pins[i] != PIN_NONE && pins[i] == pins[j]) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/**
+ * GPIO0 and GPIO15 must be left to their strap resistors. GPIO2 may only
+ * carry an active-low LED, which holds it high through reset.
+ */
+template <class B>
+constexpr bool board_straps_clear(void) {
+  const uint8_t pins[] = {
+    B::resetButton, B::statusLed, B::muxSelect0, B::muxSelect1,
+    B::muxSelect2, B::muxBank0, B::muxBank1, B::muxBank2,
+    B::sensorPower, B::sensorPowerAlt
+  };
+  for (uint8_t pin : pins) {
+    if (pin == B::boot0 || pin == B::boot15) {
+      return false;
+    }
+    if (pin == B::boot2 && !(pin == B::statusLed && B::statusLedActiveLow)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Deep-sleep wake needs GPIO16 tied to RST and nothing else on it
+ */
+template <class B>
+constexpr bool board_d0_free(void) {
+  return B::resetButton != D0 && B::statusLed != D0 && B::muxSelect0 != D0
+      && B::muxSelect1 != D0 && B::muxSelect2 != D0 && B::muxBank0 != D0
+      && B::muxBank1 != D0 && B::muxBank2 != D0 && B::sensorPower != D0
+      && B::sensorPowerAlt != D0;
+}
+
+static_assert(board_pins_unique<BoardRev1>(), "rev 1: pin assigned twice");
+static_assert(board_straps_clear<BoardRev1>(), "rev 1: boot strap pin in use");
+
+static_assert(board_pins_unique<BoardRev2>(), "rev 2: pin assigned twice");
+static_assert(board_straps_clear<BoardRev2>(), "rev 2: boot strap pin in use");
+static_assert(board_pins_unique<BoardRev3>(), "rev 3: pin assigned twice");
+static_assert(board_straps_clear<BoardRev3>(), "rev 3: boot strap pin in use");
+static_assert(!BoardRev1::deepSleepWake || board_d0_free<BoardRev1>(), "rev 1: D0 must be free for wake");
+static_assert(!BoardRev2::deepSleepWake || board_d0_free<BoardRev2>(), "rev 2: D0 must be free for wake");
+static_assert(!BoardRev3::deepSleepWake || board_d0_free<BoardRev3>(), "rev 3: D0 must be free for wake");
+
+
+#if BOARD_REVISION == 1
+typedef BoardRev1 Board;
+#elif BOARD_REVISION == 2
+typedef BoardRev2 Board;
+#elif BOARD_REVISION == 3
+typedef BoardRev3 Board;
+#else
+#error "unknown BOARD_REVISION"
+#endif
+
+static_assert(!DUTY_CYCLE_MODE || Board::deepSleepWake,
+              "DUTY_CYCLE_MODE needs a board revision with D0 wired to RST");
+
+
+/**
+ * Push-pull output on a fixed pin, written straight to the GPIO registers
+ */
+template <uint8_t Pin>
+struct gpio_out {
+  static_assert(Pin <= 16, "not a GPIO");
+
+  static inline void init(bool high) {
+    hal_pin_output(Pin);
+    write(high);
+  }
+
+  static inline void write(bool high) {
+    if constexpr (Pin == 16) {
+      hal_gpio16_write(high);
+    } else if (high) {
+      hal_gpio_set(1UL << Pin);
+    } else {
+      hal_gpio_clear(1UL << Pin);
+    }
+  }
+};
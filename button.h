@@ -0,0 +1,116 @@
+/**
+ * Interrupt-driven reset button on the board's resetButton pin.
+ *
+ * The ISR does the bare minimum: it timestamps the edge together with the
+ * pin level and pushes it into a single-producer / single-consumer ring.
+ * Debouncing and press classification run in button_service() from
+ * loop(). A press that lands while loop() is stuck in a network call is
+ * therefore still seen afterwards, and no cycles are spent polling the pin.
+ *
+ * The button is active low against the internal pull-up.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include "config.h"
+#include "board.h"
+
+
+#define BUTTON_RING_SIZE    (16)                  //! Power of two
+
+static_assert((BUTTON_RING_SIZE & (BUTTON_RING_SIZE - 1)) == 0, "ring size must be a power of two");
+static_assert(Board::resetButton < 16, "button must be on an interrupt-capable GPIO");
+
+typedef enum button_event {
+  BUTTON_NONE = 0,
+  BUTTON_SHORT_PRESS,                           //! Released before BUTTON_LONG_PRESS_MS
+  BUTTON_LONG_PRESS                             //! Held for BUTTON_LONG_PRESS_MS, fired while still held
+} button_event_t;
+
+typedef struct button {
+  bool rawPressed;                              //! Level of the last edge seen
+  bool pressed;                                 //! Debounced state
+  bool longFired;                               //! Long press already reported for this hold
+  uint32_t rawChange_ms;                        //! When rawPressed last changed
+  uint32_t pressStart_ms;                       //! When the debounced press began
+} button_t;
+
+// Edge ring: written only by the ISR (head), read only by loop() (tail).
+// Each entry is micros() with bit 0 replaced by "pressed".
+static volatile uint32_t buttonEdges[BUTTON_RING_SIZE];
+static volatile uint8_t buttonHead = 0;
+static volatile bool buttonOverflow = false;
+static uint8_t buttonTail = 0;
+
+
+static void IRAM_ATTR button_isr(void) {
+  const uint32_t pressed = (GPI & (1UL << Board::resetButton)) ? 0 : 1;
+  const uint8_t head = buttonHead;
+  const uint8_t next = (head + 1) & (BUTTON_RING_SIZE - 1);
+
+  if (next == buttonTail) {
+    buttonOverflow = true;
+    return;
+  }
+  buttonEdges[head] = (micros() & ~1UL) | pressed;
+  buttonHead = next;
+}
+
+static inline void button_init(button_t* btn) {
+  memset(btn, 0, sizeof(*btn));
+  pinMode(Board::resetButton, INPUT_PULLUP);
+  btn->rawPressed = btn->pressed = digitalRead(Board::resetButton) == LOW;
+  attachInterrupt(digitalPinToInterrupt(Board::resetButton), button_isr, CHANGE);
+}
+
+/**
+ * Drain queued edges and classify presses
+ *
+ * @return at most one event per call
+ */
+static inline button_event_t button_service(button_t* btn) {
+  const uint32_t now = millis();
+  const uint32_t now_us = micros();
+
+  while (buttonTail != buttonHead) {
+    const uint32_t edge = buttonEdges[buttonTail];
+    buttonTail = (buttonTail + 1) & (BUTTON_RING_SIZE - 1);
+
+    const bool level = edge & 1;
+    if (level != btn->rawPressed) {
+      btn->rawPressed = level;
+      // Map the edge time onto the millis() timeline
+      btn->rawChange_ms = now - (now_us - (edge & ~1UL)) / 1000;
+    }
+  }
+
+  // Lost edges: resync from the pin itself
+  if (buttonOverflow) {
+    buttonOverflow = false;
+    const bool level = digitalRead(Board::resetButton) == LOW;
+    if (level != btn->rawPressed) {
+      btn->rawPressed = level;
+      btn->rawChange_ms = now;
+    }
+  }
+
+  button_event_t event = BUTTON_NONE;
+
+  if (btn->rawPressed != btn->pressed && (uint32_t)(now - btn->rawChange_ms) >= BUTTON_DEBOUNCE_MS) {
+    btn->pressed = btn->rawPressed;
+    if (btn->pressed) {
+      btn->pressStart_ms = btn->rawChange_ms;
+      btn->longFired = false;
+    } else if (!btn->longFired) {
+      event = BUTTON_SHORT_PRESS;
+    }
+  }
+
+  if (btn->pressed && !btn->longFired && (uint32_t)(now - btn->pressStart_ms) >= BUTTON_LONG_PRESS_MS) {
+    btn->longFired = true;
+    event = BUTTON_LONG_PRESS;
+  }
+
+  return event;
+}
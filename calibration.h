@@ -0,0 +1,222 @@
+/**
+ * Per-channel two-point calibration to volumetric moisture.
+ *
+ * Every mux channel has a dry and a wet reference reading. From those, an
+ * offset and a signed Q16 slope are derived so that conversion is one
+ * subtract, one multiply and one shift:
+ *
+ *   permille = clamp(((reading - offset) * slope) >> 16, 0, 1000)
+ *
+ * Results are in 0.1 % units. The slope is 1000 / (wet - dry). It uses a
+ * reciprocal table generated at compile time, refined with one
+ * Newton-Raphson step, so setting a calibration point needs no divide and
+ * no float either.
+ *
+ * The table is stored in /cal.bin and read on every boot, timer wakes
+ * included, right after the telemetry log has mounted the filesystem. It
+ * is not cached in RTC state: at 12 bytes a channel it does not fit next
+ * to the log stage, and even dry/wet alone would take 4 bytes a channel of
+ * a block with none left. A 100-byte read from a mounted LittleFS costs
+ * far less than the wake around it. The table can be edited from the
+ * portal ("dry/wet,dry/wet,...") or with the serial "cal" command.
+ */
+
+#pragma once
+
+#include "hal.h"
+#if !HAL_HOST
+#include <LittleFS.h>
+#include <WiFiManager.h>
+#endif
+#include "config.h"
+#include "crc.h"
+#include "adc_filter.h"
+
+
+#define CAL_CHANNELS            (MUX_CHANNEL_COUNT)
+#define CAL_FULL_SCALE          (1000)            //! 100.0 %
+#define CAL_FILE_PATH           "/cal.bin"
+
+typedef struct cal_channel {
+  uint16_t dry;                                 //! Reading in air / bone-dry soil
+  uint16_t wet;                                 //! Reading in saturated soil
+  int16_t offset;                               //! Reading that maps to 0 %
+  uint16_t reserved;
+  int32_t slope_q16;                            //! Permille per count, Q16
+} cal_channel_t;
+
+typedef struct cal_table {
+  cal_channel_t channel[CAL_CHANNELS];
+} cal_table_t;
+
+
+// ---------------------------------------------------------------------------
+// Reciprocal lookup
+// ---------------------------------------------------------------------------
+
+/**
+ * 2^31 / n for normalized n in [2^15, 2^16), sampled at the middle of
+ * 256 buckets of width 128
+ */
+struct cal_recip_table {
+  uint16_t value[256];
+
+  constexpr cal_recip_table() : value() {
+    for (uint32_t i = 0; i < 256; i++) {
+      const uint32_t mid = 32768 + i * 128 + 64;
+      value[i] = (uint16_t)((0x80000000UL + mid / 2) / mid);
+    }
+  }
+};
+
+static constexpr cal_recip_table CAL_RECIP = cal_recip_table();
+
+/**
+ * 2^32 / span, for span >= 1
+ */
+static inline uint64_t cal_reciprocal(uint16_t span) {
+  uint8_t shift = 0;
+  uint32_t norm = span;
+  while (norm < 0x8000) {
+    norm <<= 1;
+    shift++;
+  }
+
+  // Table seed is good to ~1/512; one Newton step takes it to ~1e-5
+  uint64_t y = CAL_RECIP.value[(norm - 0x8000) >> 7];
+  y = (y * ((1ULL << 32) - (uint64_t)norm * y)) >> 31;
+
+  // 2^32 / span = (2^31 / norm) * 2^(shift + 1)
+  return y << (shift + 1);
+}
+
+/**
+ * Derive offset and slope from the two reference points
+ */
+static inline void cal_channel_set(cal_channel_t* cal, uint16_t dry, uint16_t wet) {
+  cal->dry = dry;
+  cal->wet = wet;
+  cal->offset = (int16_t)dry;
+
+  if (dry == wet) {
+    cal->slope_q16 = 0;
+    return;
+  }
+  const uint16_t span = (wet > dry) ? (wet - dry) : (dry - wet);
+  const int32_t slope = (int32_t)((CAL_FULL_SCALE * cal_reciprocal(span) + 0x8000) >> 16);
+  cal->slope_q16 = (wet > dry) ? slope : -slope;
+}
+
+/**
+ * Convert a filtered reading to moisture in 0.1 % units
+ */
+static inline uint16_t cal_to_permille(const cal_channel_t* cal, uint16_t reading) {
+  const int32_t value = (int32_t)(((int64_t)((int32_t)reading - cal->offset) * cal->slope_q16 + 0x8000) >> 16);
+  if (value < 0) {
+    return 0;
+  }
+  return (value > CAL_FULL_SCALE) ? CAL_FULL_SCALE : (uint16_t)value;
+}
+
+static inline void cal_defaults(cal_table_t* table) {
+  for (uint8_t ch = 0; ch < CAL_CHANNELS; ch++) {
+    cal_channel_set(&table->channel[ch], CAL_DEFAULT_DRY, CAL_DEFAULT_WET);
+  }
+}
+
+
+// ---------------------------------------------------------------------------
+// Persistence
+// ---------------------------------------------------------------------------
+
+#if !HAL_HOST
+static inline void cal_load(cal_table_t* table) {
+  uint32_t crc = 0;
+  File f = LittleFS.open(CAL_FILE_PATH, "r");
+  const bool ok = f && f.read((uint8_t*)table, sizeof(*table)) == sizeof(*table)
+               && f.read((uint8_t*)&crc, sizeof(crc)) == sizeof(crc)
+               && crc == crc32_compute(table, sizeof(*table));
+  if (f) {
+    f.close();
+  }
+  if (!ok) {
+    cal_defaults(table);
+  }
+}
+
+static inline bool cal_save(const cal_table_t* table) {
+  const uint32_t crc = crc32_compute(table, sizeof(*table));
+  File f = LittleFS.open(CAL_FILE_PATH, "w");
+  if (!f) {
+    return false;
+  }
+  const bool ok = f.write((const uint8_t*)table, sizeof(*table)) == sizeof(*table)
+               && f.write((const uint8_t*)&crc, sizeof(crc)) == sizeof(crc);
+  f.close();
+  return ok;
+}
+#endif
+
+/**
+ * Format the table as "dry/wet,dry/wet,..." for the portal
+ */
+static inline void cal_format(const cal_table_t* table, char* out, size_t size) {
+  size_t n = 0;
+  out[0] = '\0';
+  for (uint8_t ch = 0; ch < CAL_CHANNELS && n < size; ch++) {
+    n += snprintf(out + n, size - n, ch ? ",%u/%u" : "%u/%u",
+                  table->channel[ch].dry, table->channel[ch].wet);
+  }
+}
+
+/**
+ * Parse "dry/wet,dry/wet,..." as produced by cal_format(). Channels left
+ * out or malformed keep their current values.
+ *
+ * @return number of channels updated
+ */
+static inline uint8_t cal_parse(cal_table_t* table, const char* text) {
+  uint8_t updated = 0;
+  for (uint8_t ch = 0; ch < CAL_CHANNELS && *text; ch++) {
+    char* end;
+    const unsigned long dry = strtoul(text, &end, 10);
+    if (end != text && *end == '/') {
+      const char* wetText = end + 1;
+      const unsigned long wet = strtoul(wetText, &end, 10);
+      if (end != wetText && dry <= ADC_RESULT_MAX && wet <= ADC_RESULT_MAX) {
+        cal_channel_set(&table->channel[ch], (uint16_t)dry, (uint16_t)wet);
+        updated++;
+      }
+    }
+    text = strchr(text, ',');
+    if (text == nullptr) {
+      break;
+    }
+    text++;
+  }
+  return updated;
+}
+
+
+// ---------------------------------------------------------------------------
+// WiFiManager parameter
+// ---------------------------------------------------------------------------
+
+#if !HAL_HOST
+#define CAL_TEXT_MAX            (CAL_CHANNELS * 10)
+
+static char calText[CAL_TEXT_MAX + 1];
+static WiFiManagerParameter calParam("cal", "Calibration dry/wet per channel", "", CAL_TEXT_MAX);
+
+static inline void cal_add_param(const cal_table_t* table, WiFiManager* wm) {
+  cal_format(table, calText, sizeof(calText));
+  calParam.setValue(calText, CAL_TEXT_MAX);
+  wm->addParameter(&calParam);
+}
+
+static inline void cal_param_saved(cal_table_t* table) {
+  if (cal_parse(table, calParam.getValue()) > 0) {
+    cal_save(table);
+  }
+}
+#endif
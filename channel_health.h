@@ -0,0 +1,179 @@
+/**
+ * Per-channel probe fault detection.
+ *
+ * An open or shorted probe does not read as missing, it reads as a value
+ * pinned near 0 or full scale, and left alone it goes into the log and
+ * wakes the radio like any other change. Four cheap detectors run after
+ * each sweep, against the per-channel EMA in adaptive_t before that sweep
+ * is folded in:
+ *
+ *  - out of range: the reading is within HEALTH_RAIL_COUNTS of 0 or
+ *    ADC_RESULT_MAX. Real probes never get there, so this needs no history.
+ *  - stuck: HEALTH_STUCK_SWEEPS identical readings in a row. Oversampling
+ *    leaves a live channel at least a count of noise.
+ *  - flat: the mean absolute deviation from the EMA, averaged with weight
+ *    1 / 2^HEALTH_SPREAD_SHIFT, falls below HEALTH_MIN_SPREAD_QC. This
+ *    catches a floating input that wobbles by well under a count. The
+ *    average keeps HEALTH_SPREAD_SHIFT fraction bits, so deviations well
+ *    under a step of the average still move it, up as well as down.
+ *  - decorrelated: when most of the other healthy channels step past
+ *    ADAPTIVE_STEP_COUNTS the same way in one sweep (watering a bench), a
+ *    channel that does not follow misses once. HEALTH_CORR_MISSES misses
+ *    in a row mark it as faulty. Following a step clears the count. It
+ *    takes at least three channels to make a group.
+ *
+ * A fault clears by itself once its condition does. Faulty channels are
+ * left out of the adaptive rate decision and dropped from the record's
+ * channelMask, with their fault bits in readings[] (TLOG_FLAG_FAULTS) so
+ * the frame can carry them.
+ *
+ * The state is three bytes per channel and lives in RTC memory next to
+ * the EMA it runs on.
+ */
+
+#pragma once
+
+#include "hal.h"
+#include "config.h"
+#include "adc_filter.h"
+#include "adaptive_rate.h"
+#include "channel_mask.h"
+
+
+#define HEALTH_CHANNELS         (ADAPTIVE_CHANNELS)
+
+#define HEALTH_FAULT_RANGE      (0x01)            //! Pinned near a rail
+#define HEALTH_FAULT_STUCK      (0x02)            //! Same reading HEALTH_STUCK_SWEEPS times
+#define HEALTH_FAULT_FLAT       (0x04)            //! Deviation collapsed
+#define HEALTH_FAULT_DECORRELATED (0x08)          //! Sat out HEALTH_CORR_MISSES group steps
+
+#define HEALTH_FAULT_NAMES      { "range", "stuck", "flat", "decorrelated" }
+
+static_assert(HEALTH_STUCK_SWEEPS > 0 && HEALTH_STUCK_SWEEPS < 255, "stuck count is a uint8_t");
+static_assert(HEALTH_CORR_MISSES < 255, "miss count is a uint8_t");
+static_assert(HEALTH_SPREAD_SHIFT >= 1 && (HEALTH_MIN_SPREAD_QC << HEALTH_SPREAD_SHIFT) < 255,
+              "flat threshold does not fit the spread average");
+
+typedef struct health_channel {
+  uint8_t spread;                               //! Mean |reading - EMA|, 1/4 counts << HEALTH_SPREAD_SHIFT, saturating
+  uint8_t stuck;                                //! Identical readings in a row
+  uint8_t misses;                               //! Group steps sat out in a row
+} health_channel_t;
+
+typedef struct health {
+  health_channel_t channel[HEALTH_CHANNELS];
+} health_t;
+
+
+static inline void health_init(health_t* h) {
+  for (uint8_t ch = 0; ch < HEALTH_CHANNELS; ch++) {
+    // Start well above the floor so a flat channel takes a few sweeps to show
+    h->channel[ch].spread = (uint8_t)min(HEALTH_MIN_SPREAD_QC << (HEALTH_SPREAD_SHIFT + 3), 255);
+    h->channel[ch].stuck = 0;
+    h->channel[ch].misses = 0;
+  }
+}
+
+/**
+ * |reading - EMA| in 1/4 counts, rounded and saturated to a uint8_t
+ */
+static inline uint8_t health_deviation_qc(int32_t sample, int32_t ema) {
+  const int32_t diff = abs(sample - ema);
+  const int32_t qc = (ADAPTIVE_FRAC_BITS > 2) ? (diff + (1 << (ADAPTIVE_FRAC_BITS - 3))) >> (ADAPTIVE_FRAC_BITS - 2)
+                                              : diff << (2 - ADAPTIVE_FRAC_BITS);
+  return (uint8_t)min(qc, (int32_t)255);
+}
+
+/**
+ * Mean deviation in 1/4 counts, rounded
+ */
+static inline uint8_t health_spread_qc(const health_channel_t* c) {
+  return (uint8_t)((c->spread + (1 << (HEALTH_SPREAD_SHIFT - 1))) >> HEALTH_SPREAD_SHIFT);
+}
+
+/**
+ * HEALTH_FAULT_* bits of one channel for the given reading
+ */
+static inline uint8_t health_channel_faults(const health_t* h, uint8_t ch, uint16_t reading) {
+  const health_channel_t* c = &h->channel[ch];
+  uint8_t faults = 0;
+  if (reading <= HEALTH_RAIL_COUNTS || reading >= ADC_RESULT_MAX - HEALTH_RAIL_COUNTS) {
+    faults |= HEALTH_FAULT_RANGE;
+  }
+  if (c->stuck >= HEALTH_STUCK_SWEEPS) {
+    faults |= HEALTH_FAULT_STUCK;
+  }
+  if (c->spread < (HEALTH_MIN_SPREAD_QC << HEALTH_SPREAD_SHIFT)) {
+    faults |= HEALTH_FAULT_FLAT;
+  }
+  if (HEALTH_CORR_MISSES > 0 && c->misses >= HEALTH_CORR_MISSES) {
+    faults |= HEALTH_FAULT_DECORRELATED;
+  }
+  return faults;
+}
+
+/**
+ * Channels with any fault, for the given readings
+ */
+static inline chmask_t health_faults(const health_t* h, const uint16_t* readings, chmask_t ignoreMask) {
+  chmask_t mask = 0;
+  for (uint8_t ch = 0; ch < HEALTH_CHANNELS; ch++) {
+    if (!(ignoreMask & chmask_bit(ch)) && health_channel_faults(h, ch, readings[ch])) {
+      mask |= chmask_bit(ch);
+    }
+  }
+  return mask;
+}
+
+/**
+ * Fold in one sweep. Call before adaptive_update(), which moves the EMA.
+ *
+ * @param previous    readings of the sweep before
+ * @param ignoreMask  channels that are not probes
+ * @return channels with a fault after this sweep
+ */
+static inline chmask_t health_update(health_t* h, const adaptive_t* ad, const uint16_t* readings,
+                                     const uint16_t* previous, chmask_t ignoreMask) {
+  if (!ad->primed) {
+    health_init(h);
+    return health_faults(h, readings, ignoreMask);
+  }
+
+  const int32_t step = (int32_t)ADAPTIVE_STEP_COUNTS << ADAPTIVE_FRAC_BITS;
+  int8_t moved[HEALTH_CHANNELS];
+  chmask_t group = 0;
+  uint8_t up = 0;
+  uint8_t down = 0;
+
+  for (uint8_t ch = 0; ch < HEALTH_CHANNELS; ch++) {
+    health_channel_t* c = &h->channel[ch];
+    const int32_t sample = (int32_t)readings[ch] << ADAPTIVE_FRAC_BITS;
+    const int32_t ema = ad->channel[ch].ema;
+
+    c->stuck = (readings[ch] == previous[ch]) ? (uint8_t)min(c->stuck + 1, 255) : 0;
+    // spread is the average times 2^SHIFT: avg += (dev - avg) / 2^SHIFT, less the rounding loss
+    const int32_t spread = c->spread + health_deviation_qc(sample, ema) - health_spread_qc(c);
+    c->spread = (uint8_t)min(spread, (int32_t)255);
+
+    moved[ch] = (sample - ema > step) ? 1 : (ema - sample > step) ? -1 : 0;
+    if (!(ignoreMask & chmask_bit(ch)) && !(health_channel_faults(h, ch, readings[ch]) & ~HEALTH_FAULT_DECORRELATED)) {
+      group |= chmask_bit(ch);
+      up += (moved[ch] > 0);
+      down += (moved[ch] < 0);
+    }
+  }
+
+  // A group step: most of the channels that can tell moved the same way
+  const uint8_t members = chmask_count(group);
+  const int8_t direction = (up * 2 > members) ? 1 : (down * 2 > members) ? -1 : 0;
+  if (HEALTH_CORR_MISSES > 0 && members >= 3 && direction != 0) {
+    for (uint8_t ch = 0; ch < HEALTH_CHANNELS; ch++) {
+      if (group & chmask_bit(ch)) {
+        health_channel_t* c = &h->channel[ch];
+        c->misses = (moved[ch] == direction) ? 0 : (uint8_t)min(c->misses + 1, 255);
+      }
+    }
+  }
+
+  return health_faults(h, readings, ignoreMask);
+}
@@ -0,0 +1,32 @@
+/**
+ * Channel masks sized to the channel count.
+ *
+ * Anything that picks out a set of channels (skipped, sampled, valid,
+ * faulty) is a chmask_t with bit n for channel n. The type is the smallest
+ * unsigned integer that holds MUX_CHANNEL_COUNT bits, so a single-mux node
+ * keeps its one-byte masks and the record and frame layouts it always had.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <type_traits>
+#include "config.h"
+
+
+static_assert(MUX_CHANNEL_COUNT >= 1 && MUX_CHANNEL_COUNT <= 64, "1 to 64 channels are supported");
+
+typedef std::conditional<(MUX_CHANNEL_COUNT <= 8), uint8_t,
+        std::conditional<(MUX_CHANNEL_COUNT <= 16), uint16_t,
+        std::conditional<(MUX_CHANNEL_COUNT <= 32), uint32_t, uint64_t>::type>::type>::type chmask_t;
+
+#define CHMASK_BYTES            (sizeof(chmask_t))
+#define CHMASK_ALL              ((chmask_t)((chmask_t)~(chmask_t)0 >> (8 * CHMASK_BYTES - MUX_CHANNEL_COUNT)))
+
+static constexpr chmask_t chmask_bit(uint8_t channel) {
+  return (chmask_t)((chmask_t)1 << channel);
+}
+
+static inline uint8_t chmask_count(chmask_t mask) {
+  return (uint8_t)__builtin_popcountll(mask);
+}
@@ -0,0 +1,507 @@
+/**
+ * Build-time tunables for the plant sensor node.
+ *
+ * Every value here can be overridden from the build flags (-D...) without
+ * touching this file.
+ */
+
+#pragma once
+
+
+// ---------------------------------------------------------------------------
+// Hardware
+// ---------------------------------------------------------------------------
+
+#ifndef BOARD_REVISION
+#define BOARD_REVISION          (1)               //! Pinout to build for, see board.h
+#endif
+
+
+// ---------------------------------------------------------------------------
+// Multiplexer scan
+// ---------------------------------------------------------------------------
+
+#ifndef SCAN_INTERVAL_MS
+#define SCAN_INTERVAL_MS        (60UL * 1000UL)   //! Time between the start of two full mux sweeps
+#endif
+
+#ifndef MUX_COUNT
+#define MUX_COUNT               (1)               //! 4051s on the shared select lines, one per bank
+#endif
+
+#ifndef MUX_CHANNELS_PER_MUX
+#define MUX_CHANNELS_PER_MUX    (8)               //! Channels wired on each mux (1, 2, 4 or 8)
+#endif
+
+#define MUX_CHANNEL_COUNT       (MUX_COUNT * MUX_CHANNELS_PER_MUX)
+
+#ifndef MUX_SETTLE_US
+#define MUX_SETTLE_US           (150UL)           //! Wait after a select-line change, until tuned per channel
+#endif
+
+#ifndef MUX_SETTLE_MIN_US
+#define MUX_SETTLE_MIN_US       (20UL)            //! Floor for a tuned settle time
+#endif
+
+#ifndef MUX_SETTLE_TUNE_WINDOW_US
+#define MUX_SETTLE_TUNE_WINDOW_US (2000UL)        //! Longest settle a tuning run can measure
+#endif
+
+#ifndef MUX_SETTLE_TUNE_TOLERANCE
+#define MUX_SETTLE_TUNE_TOLERANCE (3)             //! Raw counts from the final value that count as settled
+#endif
+
+#ifndef MUX_SETTLE_TUNE_REPEATS
+#define MUX_SETTLE_TUNE_REPEATS (5)               //! Captures per channel; the median is kept
+#endif
+
+#ifndef MUX_SETTLE_TUNE_MARGIN_US
+#define MUX_SETTLE_TUNE_MARGIN_US (20UL)          //! Added to the measured settle time
+#endif
+
+
+// ---------------------------------------------------------------------------
+// Serial console
+// ---------------------------------------------------------------------------
+
+#ifndef SERIAL_BAUD
+#define SERIAL_BAUD             (921600UL)        //! Console and "stream" capture; the ROM still logs at 74880
+#endif
+
+#ifndef ADC_STREAM_SAMPLES
+#define ADC_STREAM_SAMPLES      (120)             //! Raw reads per streamed packet (254 bytes on the wire)
+#endif
+
+#ifndef ADC_STREAM_RATE_HZ
+#define ADC_STREAM_RATE_HZ      (0)               //! Default "stream" sample rate, 0 for back to back reads
+#endif
+
+#ifndef ADC_STREAM_SLICE_US
+#define ADC_STREAM_SLICE_US     (2000UL)          //! Longest a stream keeps the loop per pass
+#endif
+
+
+// ---------------------------------------------------------------------------
+// Moisture ADC oversampling
+// ---------------------------------------------------------------------------
+
+#ifndef ADC_BURST_SAMPLES
+#define ADC_BURST_SAMPLES       (16)              //! Raw A0 reads taken per channel per sweep (16..64)
+#endif
+
+#ifndef ADC_TRIM_SAMPLES
+#define ADC_TRIM_SAMPLES        (2)               //! Reads dropped from each end of the sorted burst
+#endif
+
+#ifndef ADC_EXTRA_BITS
+#define ADC_EXTRA_BITS          (2)               //! Fractional bits kept after decimation
+#endif
+
+
+// ---------------------------------------------------------------------------
+// Duty cycle / deep sleep
+// ---------------------------------------------------------------------------
+
+#ifndef DUTY_CYCLE_MODE
+#define DUTY_CYCLE_MODE         (0)               //! 1: wake, scan, report, deep sleep. Needs a board with D0 wired to RST.
+#endif
+
+#ifndef DUTY_CYCLE_PERIOD_S
+#define DUTY_CYCLE_PERIOD_S     (15UL * 60UL)     //! Wake-to-wake period in duty-cycle mode
+#endif
+
+
+// ---------------------------------------------------------------------------
+// WiFi
+// ---------------------------------------------------------------------------
+
+#ifndef WIFI_FAST_CONNECT_TIMEOUT_MS
+#define WIFI_FAST_CONNECT_TIMEOUT_MS  (1000UL)    //! Give up on the cached AP and fall back to a full scan
+#endif
+
+#ifndef WIFI_SCAN_CONNECT_TIMEOUT_MS
+#define WIFI_SCAN_CONNECT_TIMEOUT_MS  (8000UL)    //! Connect with a full scan and DHCP
+#endif
+
+#ifndef WIFI_PORTAL_AFTER_FAILURES
+#define WIFI_PORTAL_AFTER_FAILURES    (3)         //! Wakes in a row that failed to connect before the portal opens
+#endif
+
+#ifndef WIFI_PORTAL_TIMEOUT_S
+#define WIFI_PORTAL_TIMEOUT_S         (180UL)     //! Close an unused portal (and sleep, in duty-cycle mode)
+#endif
+
+
+// ---------------------------------------------------------------------------
+// Fleet mode (ESP-NOW)
+// ---------------------------------------------------------------------------
+
+#define NODE_ROLE_STANDALONE    (0)               //! Own WiFi and MQTT connection
+#define NODE_ROLE_LEAF          (1)               //! Report over ESP-NOW to a gateway, never associate
+#define NODE_ROLE_GATEWAY       (2)               //! Always-on standalone that also forwards for leaves
+
+#ifndef NODE_ROLE
+#define NODE_ROLE               (NODE_ROLE_STANDALONE)
+#endif
+
+#ifndef ESPNOW_CHANNEL
+#define ESPNOW_CHANNEL          (1)               //! Must match the channel of the gateway's AP
+#endif
+
+#ifndef ESPNOW_GATEWAY_MAC
+#define ESPNOW_GATEWAY_MAC      {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF}  //! Gateway station MAC. Broadcast works, but is not ACKed.
+#endif
+
+#ifndef ESPNOW_ACK_TIMEOUT_MS
+#define ESPNOW_ACK_TIMEOUT_MS   (30UL)            //! Wait for the send callback of one frame
+#endif
+
+#ifndef ESPNOW_TIME_WAIT_MS
+#define ESPNOW_TIME_WAIT_MS     (20UL)            //! Leaf: stay up this long for the gateway's time reply
+#endif
+
+#ifndef ESPNOW_GATEWAY_QUEUE
+#define ESPNOW_GATEWAY_QUEUE    (16)              //! Received frames held for forwarding, power of two
+#endif
+
+#ifndef ESPNOW_GATEWAY_BATCH
+#define ESPNOW_GATEWAY_BATCH    (8)               //! Forward once this many frames are queued...
+#endif
+
+#ifndef ESPNOW_GATEWAY_FLUSH_MS
+#define ESPNOW_GATEWAY_FLUSH_MS (5000UL)          //! ...or the oldest has waited this long
+#endif
+
+
+// ---------------------------------------------------------------------------
+// Time synchronisation
+// ---------------------------------------------------------------------------
+
+#ifndef TIME_NTP_SERVER
+#define TIME_NTP_SERVER         "pool.ntp.org"
+#endif
+
+#ifndef TIME_SYNC_INTERVAL_S
+#define TIME_SYNC_INTERVAL_S    (6UL * 3600UL)    //! SNTP at most this often, and only with the radio up
+#endif
+
+#ifndef TIME_SYNC_TIMEOUT_MS
+#define TIME_SYNC_TIMEOUT_MS    (3000UL)          //! Give up on an SNTP answer for this wake
+#endif
+
+#ifndef TIME_SYNC_RETRY_MS
+#define TIME_SYNC_RETRY_MS      (60UL * 1000UL)   //! Always-on mode: wait after a failed request
+#endif
+
+#ifndef TIME_DRIFT_LEARN_MIN_S
+#define TIME_DRIFT_LEARN_MIN_S  (600UL)           //! Sleep needed between syncs to update the drift
+#endif
+
+#ifndef TIME_DRIFT_MAX_PPM
+#define TIME_DRIFT_MAX_PPM      (100000L)         //! Clamp for the learned sleep timer error
+#endif
+
+
+// ---------------------------------------------------------------------------
+// Supervision
+// ---------------------------------------------------------------------------
+
+#ifndef SUP_STAGE_TIMEOUT_MS
+#define SUP_STAGE_TIMEOUT_MS    (60UL * 1000UL)   //! A sweep or connect still running after this is a hang
+#endif
+
+#ifndef SUP_OTA_TIMEOUT_MS
+#define SUP_OTA_TIMEOUT_MS      (5UL * 60UL * 1000UL)
+#endif
+
+#ifndef SUP_SAFE_MODE_CRASHES
+#define SUP_SAFE_MODE_CRASHES   (3)               //! Crashes without a good upload before safe mode
+#endif
+
+#ifndef SUP_SAFE_MODE_RETRY_S
+#define SUP_SAFE_MODE_RETRY_S   (24UL * 3600UL)   //! Leave safe mode and try the radio again after this
+#endif
+
+
+// ---------------------------------------------------------------------------
+// Telemetry log
+// ---------------------------------------------------------------------------
+
+#ifndef TLOG_CAPACITY
+#define TLOG_CAPACITY           (MUX_CHANNEL_COUNT <= 8 ? 1024 : MUX_CHANNEL_COUNT <= 16 ? 512 \
+                                 : MUX_CHANNEL_COUNT <= 32 ? 256 : 128)  //! Records kept in flash, 32 KB in all
+#endif
+
+#ifndef TLOG_STAGE_RECORDS
+#define TLOG_STAGE_RECORDS      (MUX_CHANNEL_COUNT <= 16 ? 4 : MUX_CHANNEL_COUNT <= 32 ? 2 : 1)  //! Records buffered in RTC memory per flash write
+#endif
+
+#ifndef TLOG_UPLOAD_BATCH
+#define TLOG_UPLOAD_BATCH       (32)              //! Most records drained per radio session
+#endif
+
+#ifndef TELEMETRY_TEXT_FORMAT
+#define TELEMETRY_TEXT_FORMAT   (0)               //! 1: send JSON text frames instead of binary (debugging)
+#endif
+
+
+// ---------------------------------------------------------------------------
+// MQTT uplink
+// ---------------------------------------------------------------------------
+
+#ifndef MQTT_DEFAULT_PORT
+#define MQTT_DEFAULT_PORT       (1883)
+#endif
+
+#ifndef MQTT_DEFAULT_PREFIX
+#define MQTT_DEFAULT_PREFIX     "plants"          //! Topics are <prefix>/<chip id>/...
+#endif
+
+#ifndef MQTT_KEEPALIVE_S
+#define MQTT_KEEPALIVE_S        (90)
+#endif
+
+#ifndef MQTT_CONNECT_TIMEOUT_MS
+#define MQTT_CONNECT_TIMEOUT_MS (3000UL)          //! Give up on an attempt (DNS, TCP, CONNACK) after this
+#endif
+
+#ifndef MQTT_BACKOFF_MIN_MS
+#define MQTT_BACKOFF_MIN_MS     (2UL * 1000UL)
+#endif
+
+#ifndef MQTT_BACKOFF_MAX_MS
+#define MQTT_BACKOFF_MAX_MS     (5UL * 60UL * 1000UL)
+#endif
+
+
+// ---------------------------------------------------------------------------
+// Network buffers
+// ---------------------------------------------------------------------------
+
+#ifndef NET_ARENA_BYTES
+#define NET_ARENA_BYTES         (NET_ARENA_MIN_BYTES)   //! Scratch for one record / request on the reporting path (arena.h)
+#endif
+
+#ifndef HEAP_WATCH_SLACK_BYTES
+#define HEAP_WATCH_SLACK_BYTES  (256)             //! Max block loss per upload cycle that is not reported
+#endif
+
+
+// ---------------------------------------------------------------------------
+// Sensor excitation
+// ---------------------------------------------------------------------------
+
+#ifndef SENSOR_WARMUP_MS
+#define SENSOR_WARMUP_MS        (20UL)            //! Rail on to first mux sample (OP282 + probe settling)
+#endif
+
+
+
+// ---------------------------------------------------------------------------
+// Reset button
+// ---------------------------------------------------------------------------
+
+#ifndef BUTTON_DEBOUNCE_MS
+#define BUTTON_DEBOUNCE_MS      (30UL)            //! Level must hold this long to count
+#endif
+
+#ifndef BUTTON_LONG_PRESS_MS
+#define BUTTON_LONG_PRESS_MS    (3000UL)          //! Hold time for the long-press action
+#endif
+
+
+// ---------------------------------------------------------------------------
+// Calibration
+// ---------------------------------------------------------------------------
+
+#ifndef CAL_DEFAULT_DRY
+#define CAL_DEFAULT_DRY         (ADC_RESULT_MAX)  //! Reading taken as 0 % until a channel is calibrated
+#endif
+
+#ifndef CAL_DEFAULT_WET
+#define CAL_DEFAULT_WET         (0)               //! Reading taken as 100 % until a channel is calibrated
+#endif
+
+
+// ---------------------------------------------------------------------------
+// Adaptive sampling rate
+// ---------------------------------------------------------------------------
+
+#ifndef ADAPTIVE_MIN_INTERVAL_S
+#define ADAPTIVE_MIN_INTERVAL_S     (60UL)            //! Interval right after a watering event
+#endif
+
+#ifndef ADAPTIVE_MAX_INTERVAL_S
+#define ADAPTIVE_MAX_INTERVAL_S     (4UL * 3600UL)    //! Longest interval when everything is stable
+#endif
+
+#ifndef ADAPTIVE_EMA_SHIFT
+#define ADAPTIVE_EMA_SHIFT          (2)               //! EMA weight 1 / 2^n for new readings
+#endif
+
+#ifndef ADAPTIVE_STABLE_COUNTS
+#define ADAPTIVE_STABLE_COUNTS      (8)               //! Per-sweep EMA drift below this is "stable"
+#endif
+
+#ifndef ADAPTIVE_STEP_COUNTS
+#define ADAPTIVE_STEP_COUNTS        (200)             //! Jump against the EMA that counts as watering
+#endif
+
+#ifndef ADAPTIVE_DEADBAND_COUNTS
+#define ADAPTIVE_DEADBAND_COUNTS    (24)              //! Change since the last report needed to report again
+#endif
+
+#ifndef ADAPTIVE_HEARTBEAT_S
+#define ADAPTIVE_HEARTBEAT_S        (6UL * 3600UL)    //! Report at least this often regardless
+#endif
+
+
+// ---------------------------------------------------------------------------
+// Channel health (probe fault detection)
+// ---------------------------------------------------------------------------
+
+#ifndef HEALTH_RAIL_COUNTS
+#define HEALTH_RAIL_COUNTS          (16)              //! Readings this close to 0 or full scale are out of range
+#endif
+
+#ifndef HEALTH_STUCK_SWEEPS
+#define HEALTH_STUCK_SWEEPS         (8)               //! Identical readings in a row that count as stuck
+#endif
+
+#ifndef HEALTH_MIN_SPREAD_QC
+#define HEALTH_MIN_SPREAD_QC        (1)               //! Mean deviation from the EMA, 1/4 counts, below which a channel is flat
+#endif
+
+#ifndef HEALTH_SPREAD_SHIFT
+#define HEALTH_SPREAD_SHIFT         (4)               //! Deviation average weight 1 / 2^n for new sweeps
+#endif
+
+#ifndef HEALTH_CORR_MISSES
+#define HEALTH_CORR_MISSES          (4)               //! Group watering steps a channel may sit out, 0 to disable
+#endif
+
+
+// ---------------------------------------------------------------------------
+// Battery monitoring (boards with a divider on a mux channel)
+// ---------------------------------------------------------------------------
+
+#ifndef BATTERY_SAMPLE_EVERY
+#define BATTERY_SAMPLE_EVERY    (8)               //! Read the battery channel on every n-th sweep
+#endif
+
+#ifndef BATTERY_LOW_MV
+#define BATTERY_LOW_MV          (3450)            //! Enter low power mode below this
+#endif
+
+#ifndef BATTERY_RECOVER_MV
+#define BATTERY_RECOVER_MV      (3650)            //! Leave low power mode above this
+#endif
+
+#ifndef BATTERY_LOW_INTERVAL_S
+#define BATTERY_LOW_INTERVAL_S  (2UL * 3600UL)    //! Shortest sweep interval in low power mode
+#endif
+
+
+// ---------------------------------------------------------------------------
+// Energy accounting
+// ---------------------------------------------------------------------------
+
+#ifndef ENERGY_CPU_UA
+#define ENERGY_CPU_UA           (16000UL)         //! Awake with the radio idle
+#endif
+
+#ifndef ENERGY_RADIO_UA
+#define ENERGY_RADIO_UA         (56000UL)         //! On top of CPU while associating / transmitting
+#endif
+
+#ifndef ENERGY_SENSOR_UA
+#define ENERGY_SENSOR_UA        (3000UL)          //! On top of CPU while the probe rail is up
+#endif
+
+#ifndef ENERGY_SLEEP_UA
+#define ENERGY_SLEEP_UA         (20UL)            //! Deep sleep, whole board
+#endif
+
+#ifndef ENERGY_BATTERY_MAH
+#define ENERGY_BATTERY_MAH      (2400UL)          //! Usable capacity for the life projection
+#endif
+
+#ifndef ENERGY_WAKE_BUDGET_UAH
+#define ENERGY_WAKE_BUDGET_UAH  (40UL)            //! Duty-cycle wakes above this are logged and flagged
+#endif
+
+
+// ---------------------------------------------------------------------------
+// Firmware updates
+// ---------------------------------------------------------------------------
+
+#ifndef FIRMWARE_VERSION
+#define FIRMWARE_VERSION        "dev"             //! Sent to the update server as x-ESP8266-version
+#endif
+
+#ifndef OTA_UPDATE_HOST
+#define OTA_UPDATE_HOST         ""                //! Update server for pulls, empty to disable
+#endif
+
+#ifndef OTA_UPDATE_PORT
+#define OTA_UPDATE_PORT         (80)
+#endif
+
+#ifndef OTA_UPDATE_PATH
+#define OTA_UPDATE_PATH         "/firmware"
+#endif
+
+#ifndef OTA_CHECK_INTERVAL_S
+#define OTA_CHECK_INTERVAL_S    (3600UL)          //! Always-on mode; duty cycle checks every radio session
+#endif
+
+#ifndef OTA_CHUNK_BYTES
+#define OTA_CHUNK_BYTES         (1024)            //! Most image bytes written per loop pass
+#endif
+
+#ifndef OTA_STALL_TIMEOUT_MS
+#define OTA_STALL_TIMEOUT_MS    (10000UL)         //! Abort a pull with no data for this long
+#endif
+
+#ifndef OTA_LAN_PASSWORD
+#define OTA_LAN_PASSWORD        ""                //! ArduinoOTA password, empty for none
+#endif
+
+
+// ---------------------------------------------------------------------------
+// On-device history
+// ---------------------------------------------------------------------------
+
+// Default depths shrink as channels are added, so the rings take about the
+// same RAM. The hour tier never drops below a day: up to 32 channels that
+// still fits the 8-channel footprint, at 64 it takes ~3 KB more.
+#define HISTORY_DEPTH_DIVISOR   ((MUX_CHANNEL_COUNT + 7) / 8)
+
+#ifndef HISTORY_RAW_SAMPLES
+#define HISTORY_RAW_SAMPLES     (32 / HISTORY_DEPTH_DIVISOR)  //! Most recent sweeps, unaggregated
+#endif
+
+#ifndef HISTORY_MINUTES
+#define HISTORY_MINUTES         (30 / HISTORY_DEPTH_DIVISOR)
+#endif
+
+#ifndef HISTORY_HOURS
+#define HISTORY_HOURS           (48 / HISTORY_DEPTH_DIVISOR < 24 ? 24 : 48 / HISTORY_DEPTH_DIVISOR)
+#endif
+
+#ifndef HISTORY_DAYS
+#define HISTORY_DAYS            (31 / HISTORY_DEPTH_DIVISOR)
+#endif
+
+
+// ---------------------------------------------------------------------------
+// Local HTTP API
+// ---------------------------------------------------------------------------
+
+#ifndef HTTP_API_PORT
+#define HTTP_API_PORT           (8080)            //! Kept off port 80, which WiFiManager's portal uses
+#endif
+
+#ifndef HTTP_API_STREAMS
+#define HTTP_API_STREAMS        (3)               //! Responses that can be in flight at once
+#endif
@@ -0,0 +1,60 @@
+/**
+ * Small CRC helpers shared by the persistence and telemetry code.
+ *
+ * Nibble-table implementations: 16 entries each, fast enough for the few
+ * hundred bytes we checksum per wake without spending 1 KB of RAM on a
+ * full byte table.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+/**
+ * Standard CRC-32 (IEEE 802.3, reflected, poly 0xEDB88320)
+ */
+static inline uint32_t crc32_update(uint32_t crc, const void* data, size_t length) {
+  static const uint32_t table[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+    0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+    0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+  };
+
+  const uint8_t* p = (const uint8_t*)data;
+  crc = ~crc;
+  while (length--) {
+    crc ^= *p++;
+    crc = (crc >> 4) ^ table[crc & 0x0F];
+    crc = (crc >> 4) ^ table[crc & 0x0F];
+  }
+  return ~crc;
+}
+
+static inline uint32_t crc32_compute(const void* data, size_t length) {
+  return crc32_update(0, data, length);
+}
+
+/**
+ * CRC-16/CCITT-FALSE (poly 0x1021, init 0xFFFF, no reflection)
+ */
+static inline uint16_t crc16_update(uint16_t crc, const void* data, size_t length) {
+  static const uint16_t table[16] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+  };
+
+  const uint8_t* p = (const uint8_t*)data;
+  while (length--) {
+    crc = (uint16_t)((crc << 4) ^ table[(crc >> 12) ^ (*p >> 4)]);
+    crc = (uint16_t)((crc << 4) ^ table[(crc >> 12) ^ (*p & 0x0F)]);
+    p++;
+  }
+  return crc;
+}
+
+static inline uint16_t crc16_compute(const void* data, size_t length) {
+  return crc16_update(0xFFFF, data, length);
+}
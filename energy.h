@@ -0,0 +1,151 @@
+/**
+ * Charge accounting per wake.
+ *
+ * Time awake is split into overlapping states, each with a configurable
+ * current draw on top of the ones below it:
+ *
+ *   CPU     the whole time awake (core running, radio idle)
+ *   RADIO   from the first association attempt until power down
+ *   SENSOR  while the probe rail is up for a sweep
+ *   SLEEP   the deep sleep that ends the wake
+ *
+ * An energy meter in RAM times the states as the wake goes on.
+ * energy_close() turns those into a report: charge per state and in
+ * total, in µAh, and the battery life projected if every period looked
+ * like this one. The report lives in RTC state and goes out with the next
+ * upload (see TFRAME_FLAG_ENERGY), because a duty-cycled wake can only be
+ * fully accounted once its sleep has been scheduled.
+ *
+ * In always-on mode there is no sleep. The period is then the time
+ * between two uploads, which at the CPU draw alone is ~270 µAh a minute.
+ * ENERGY_WAKE_BUDGET_UAH is a per-wake figure, so only duty-cycle periods
+ * are checked against it. Charges are 32-bit so a long always-on period
+ * does not saturate.
+ */
+
+#pragma once
+
+#include "hal.h"
+#include "config.h"
+
+
+typedef enum energy_state {
+  ENERGY_CPU = 0,
+  ENERGY_RADIO,
+  ENERGY_SENSOR,
+  ENERGY_SLEEP,
+  ENERGY_STATE_COUNT
+} energy_state_t;
+
+static constexpr uint32_t ENERGY_STATE_UA[ENERGY_STATE_COUNT] = {
+  ENERGY_CPU_UA, ENERGY_RADIO_UA, ENERGY_SENSOR_UA, ENERGY_SLEEP_UA
+};
+
+static const char* const ENERGY_STATE_NAMES[ENERGY_STATE_COUNT] = {
+  "cpu", "radio", "sensor", "sleep"
+};
+
+#define ENERGY_FLAG_OVER_BUDGET (0x01)            //! Duty-cycle wake used more than ENERGY_WAKE_BUDGET_UAH
+#define ENERGY_FLAG_UNSENT      (0x02)            //! Not uploaded yet
+
+/**
+ * One closed accounting period, kept in RTC state
+ */
+typedef struct energy_report {
+  uint32_t charge_uah[ENERGY_STATE_COUNT];      //! Per state, saturating
+  uint32_t total_uah;
+  uint16_t life_days;                           //! Projected from this period, saturating
+  uint8_t flags;                                //! ENERGY_FLAG_*
+  uint8_t reserved;
+} energy_report_t;
+
+/**
+ * Running timers for the current period
+ */
+typedef struct energy_meter {
+  uint32_t start_ms;                            //! Start of the period
+  uint32_t since_ms[ENERGY_STATE_COUNT];        //! Start of the current stretch, per running state
+  uint32_t elapsed_ms[ENERGY_STATE_COUNT];
+  uint8_t running;                              //! Bit n set while state n is on
+} energy_meter_t;
+
+
+static inline void energy_meter_init(energy_meter_t* meter, uint32_t now_ms) {
+  memset(meter, 0, sizeof(*meter));
+  meter->start_ms = now_ms;
+}
+
+/**
+ * Mark a state as on. Calling it again while on is harmless.
+ */
+static inline void energy_begin(energy_meter_t* meter, energy_state_t state, uint32_t now_ms) {
+  if (!(meter->running & (1U << state))) {
+    meter->running |= (1U << state);
+    meter->since_ms[state] = now_ms;
+  }
+}
+
+static inline void energy_end(energy_meter_t* meter, energy_state_t state, uint32_t now_ms) {
+  if (meter->running & (1U << state)) {
+    meter->running &= ~(1U << state);
+    meter->elapsed_ms[state] += now_ms - meter->since_ms[state];
+  }
+}
+
+static inline uint16_t energy_saturate_u16(uint64_t v) {
+  return (v > 0xFFFF) ? 0xFFFF : (uint16_t)v;
+}
+
+static inline uint32_t energy_saturate_u32(uint64_t v) {
+  return (v > 0xFFFFFFFFULL) ? 0xFFFFFFFFUL : (uint32_t)v;
+}
+
+/**
+ * Close the period at now_ms, with sleep_ms of deep sleep to follow, and
+ * start the next one. States still on carry over into the new period.
+ *
+ * @return true if the period stayed within ENERGY_WAKE_BUDGET_UAH, always
+ *         true outside duty-cycle mode
+ */
+static inline bool energy_close(energy_meter_t* meter, energy_report_t* report,
+                                uint32_t now_ms, uint32_t sleep_ms) {
+  uint32_t ms[ENERGY_STATE_COUNT];
+  for (uint8_t s = 0; s < ENERGY_STATE_COUNT; s++) {
+    ms[s] = meter->elapsed_ms[s];
+    if (meter->running & (1U << s)) {
+      ms[s] += now_ms - meter->since_ms[s];
+    }
+  }
+  ms[ENERGY_CPU] = now_ms - meter->start_ms;
+  ms[ENERGY_SLEEP] = sleep_ms;
+
+  // µA * ms / 3.6e6 = µAh; summed unrounded so the parts need not add up
+  uint64_t total_uams = 0;
+  for (uint8_t s = 0; s < ENERGY_STATE_COUNT; s++) {
+    const uint64_t uams = (uint64_t)ms[s] * ENERGY_STATE_UA[s];
+    report->charge_uah[s] = energy_saturate_u32((uams + 1800000ULL) / 3600000ULL);
+    total_uams += uams;
+  }
+  report->total_uah = energy_saturate_u32((total_uams + 1800000ULL) / 3600000ULL);
+
+  // life = capacity / average current, with average current = charge / period
+  const uint64_t period_ms = (uint64_t)ms[ENERGY_CPU] + sleep_ms;
+  const uint64_t capacity_uams = (uint64_t)ENERGY_BATTERY_MAH * 1000ULL * 3600000ULL;
+  const uint64_t periods = (total_uams == 0) ? UINT64_MAX : capacity_uams / total_uams;
+  report->life_days = (period_ms != 0 && periods > UINT64_MAX / period_ms) ? 0xFFFF
+      : energy_saturate_u16(periods * period_ms / 86400000ULL);
+
+  // An overrun stays flagged until a report carrying it has been sent
+  const bool withinBudget = !DUTY_CYCLE_MODE || total_uams <= (uint64_t)ENERGY_WAKE_BUDGET_UAH * 3600000ULL;
+  const uint8_t unsentOverrun = (report->flags & ENERGY_FLAG_UNSENT) ? (report->flags & ENERGY_FLAG_OVER_BUDGET) : 0;
+  report->flags = ENERGY_FLAG_UNSENT | unsentOverrun | (withinBudget ? 0 : ENERGY_FLAG_OVER_BUDGET);
+
+  const uint8_t running = meter->running;
+  energy_meter_init(meter, now_ms);
+  for (uint8_t s = 0; s < ENERGY_STATE_COUNT; s++) {
+    if (running & (1U << s)) {
+      energy_begin(meter, (energy_state_t)s, now_ms);
+    }
+  }
+  return withinBudget;
+}
@@ -0,0 +1,292 @@
+/**
+ * Fleet mode: leaves report over ESP-NOW to one WiFi-connected gateway.
+ *
+ * Associating with an AP (scan or not, plus DHCP or ARP) is most of what a
+ * wake costs. A leaf (NODE_ROLE_LEAF) never associates. It brings the
+ * radio up on ESPNOW_CHANNEL, sends each pending record as one keyframe
+ * to ESPNOW_GATEWAY_MAC, and is done in a few milliseconds. Unicast sends
+ * are ACKed and retried by the MAC layer; a record stays queued in the
+ * telemetry log until its send is confirmed. Every frame is a keyframe, so
+ * a lost packet never breaks the decoding of the next one.
+ *
+ * The gateway (NODE_ROLE_GATEWAY) is an always-on node that also listens
+ * for ESP-NOW. Received frames are queued from the receive callback. The
+ * loop republishes them over MQTT under the leaf's node id, once
+ * ESPNOW_GATEWAY_BATCH have queued or the oldest is ESPNOW_GATEWAY_FLUSH_MS
+ * old. Each frame is answered with the gateway's time, which leaves use
+ * in place of SNTP. The SDK holds at most 20 peers, so the gateway adds a
+ * leaf as a peer only for its reply and removes it again once the send is
+ * done. One reply is in flight at a time.
+ *
+ * ESP-NOW only works between radios on the same channel. The gateway
+ * follows its AP, so ESPNOW_CHANNEL must match the AP's channel. The
+ * gateway prints it on boot.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <espnow.h>
+extern "C" {
+#include <user_interface.h>
+}
+#include "config.h"
+#include "telemetry_frame.h"
+#include "timesync.h"
+
+
+#define ESPNOW_PACKET_MAX       (250)
+#define ESPNOW_TIME_MAGIC       (0x54)            //! "T", gateway -> leaf time reply
+#define ESPNOW_TIME_BYTES       (9)               //! magic + epoch ms, little endian
+
+static_assert(TFRAME_MAX_BYTES <= ESPNOW_PACKET_MAX, "frame does not fit in an ESP-NOW packet");
+static_assert(NODE_ROLE != NODE_ROLE_GATEWAY || !DUTY_CYCLE_MODE, "an ESP-NOW gateway has to stay awake to listen");
+static_assert(NODE_ROLE != NODE_ROLE_LEAF || !TELEMETRY_TEXT_FORMAT, "the gateway decodes binary frames only");
+static_assert((ESPNOW_GATEWAY_QUEUE & (ESPNOW_GATEWAY_QUEUE - 1)) == 0, "queue size must be a power of two");
+
+#define ESPNOW_SEND_PENDING     (0xFF)
+
+
+// ---------------------------------------------------------------------------
+// Leaf
+// ---------------------------------------------------------------------------
+
+static uint8_t espnowGateway[6] = ESPNOW_GATEWAY_MAC;
+
+// Written by the SDK callbacks, read by loop()
+static volatile uint8_t espnowSendStatus = 0;
+static volatile bool espnowTimeReceived = false;
+static uint64_t espnowTime_ms;
+static uint32_t espnowTimeAt_ms;
+
+typedef struct espnow_leaf {
+  bool up;
+  uint32_t timeWaitStart_ms;                    //! Waiting for a time reply since, 0 for not
+} espnow_leaf_t;
+
+
+static void espnow_leaf_sent(uint8_t*, uint8_t status) {
+  espnowSendStatus = status;
+}
+
+static void espnow_leaf_received(uint8_t* mac, uint8_t* data, uint8_t length) {
+  if (length != ESPNOW_TIME_BYTES || data[0] != ESPNOW_TIME_MAGIC || memcmp(mac, espnowGateway, 6) != 0) {
+    return;
+  }
+  uint64_t time_ms = 0;
+  for (uint8_t i = 8; i > 0; i--) {
+    time_ms = (time_ms << 8) | data[i];
+  }
+  espnowTime_ms = time_ms;
+  espnowTimeAt_ms = millis();
+  espnowTimeReceived = true;
+}
+
+/**
+ * Bring the radio up for ESP-NOW only. No association, no IP.
+ */
+static inline bool espnow_leaf_begin(espnow_leaf_t* leaf) {
+  if (leaf->up) {
+    return true;
+  }
+  WiFi.persistent(false);
+  WiFi.mode(WIFI_STA);
+  WiFi.disconnect();
+  wifi_set_channel(ESPNOW_CHANNEL);
+  if (esp_now_init() != 0) {
+    return false;
+  }
+  esp_now_set_self_role(ESP_NOW_ROLE_COMBO);
+  esp_now_register_send_cb(espnow_leaf_sent);
+  esp_now_register_recv_cb(espnow_leaf_received);
+  esp_now_add_peer(espnowGateway, ESP_NOW_ROLE_COMBO, ESPNOW_CHANNEL, nullptr, 0);
+  leaf->up = true;
+  return true;
+}
+
+/**
+ * Send one frame and wait for the MAC-level ACK
+ *
+ * @return true once the gateway has acknowledged it
+ */
+static inline bool espnow_leaf_send(espnow_leaf_t* leaf, const uint8_t* frame, size_t length) {
+  if (!leaf->up) {
+    return false;
+  }
+  espnowSendStatus = ESPNOW_SEND_PENDING;
+  if (esp_now_send(espnowGateway, (uint8_t*)frame, length) != 0) {
+    return false;
+  }
+  // The callback runs from the SDK task, so yield until it has
+  const uint32_t start = millis();
+  while (espnowSendStatus == ESPNOW_SEND_PENDING && (uint32_t)(millis() - start) < ESPNOW_ACK_TIMEOUT_MS) {
+    yield();
+  }
+  return espnowSendStatus == 0;
+}
+
+/**
+ * After the uploads: hold the node up for up to ESPNOW_TIME_WAIT_MS if the
+ * clock wants a sync, and take the gateway's time if it arrives.
+ *
+ * @return true while still waiting
+ */
+static inline bool espnow_leaf_service(espnow_leaf_t* leaf, timesync_t* ts, bool wantTime) {
+  if (espnowTimeReceived) {
+    espnowTimeReceived = false;
+    timesync_set(ts, espnowTime_ms + (millis() - espnowTimeAt_ms));
+    leaf->timeWaitStart_ms = 0;
+    return false;
+  }
+  if (!leaf->up || !wantTime) {
+    return false;
+  }
+  if (leaf->timeWaitStart_ms == 0) {
+    const uint32_t now = millis();
+    leaf->timeWaitStart_ms = now ? now : 1;
+  }
+  return (uint32_t)(millis() - leaf->timeWaitStart_ms) < ESPNOW_TIME_WAIT_MS;
+}
+
+
+// ---------------------------------------------------------------------------
+// Gateway
+// ---------------------------------------------------------------------------
+
+typedef struct espnow_packet {
+  uint8_t mac[6];
+  uint8_t length;
+  uint8_t frame[TFRAME_MAX_BYTES];
+  uint32_t received_ms;
+} espnow_packet_t;
+
+// Packet ring: head written by the receive callback, tail by loop()
+static espnow_packet_t espnowQueue[ESPNOW_GATEWAY_QUEUE];
+static volatile uint8_t espnowHead = 0;
+static volatile uint32_t espnowDropped = 0;
+
+typedef struct espnow_gateway {
+  uint8_t tail;                                 //! Oldest packet not yet forwarded
+  uint8_t replied;                              //! Oldest packet not yet answered with the time
+  bool peerAdded;                               //! peer is registered for a reply in flight
+  uint8_t peer[6];
+  uint32_t replyStart_ms;
+} espnow_gateway_t;
+
+static espnow_gateway_t* espnowGatewayState = nullptr;
+
+
+static void espnow_gateway_received(uint8_t* mac, uint8_t* data, uint8_t length) {
+  const uint8_t head = espnowHead;
+  const uint8_t next = (head + 1) & (ESPNOW_GATEWAY_QUEUE - 1);
+  // A slot is free once it is both forwarded and answered, whichever comes last
+  if (length == 0 || length > TFRAME_MAX_BYTES || data[0] != TFRAME_SYNC || espnowGatewayState == nullptr
+      || next == espnowGatewayState->tail || next == espnowGatewayState->replied) {
+    espnowDropped++;
+    return;
+  }
+  espnow_packet_t* packet = &espnowQueue[head];
+  memcpy(packet->mac, mac, sizeof(packet->mac));
+  memcpy(packet->frame, data, length);
+  packet->length = length;
+  packet->received_ms = millis();
+  espnowHead = next;
+}
+
+/**
+ * Start listening. Call once the station is up, so the radio is
+ * already on the AP's channel.
+ */
+static inline bool espnow_gateway_begin(espnow_gateway_t* gw) {
+  memset(gw, 0, sizeof(*gw));
+  WiFi.setSleepMode(WIFI_NONE_SLEEP);           // modem sleep would miss packets
+  if (esp_now_init() != 0) {
+    return false;
+  }
+  esp_now_set_self_role(ESP_NOW_ROLE_COMBO);
+  espnowGatewayState = gw;
+  esp_now_register_send_cb(espnow_leaf_sent);   // same status flag as a leaf
+  esp_now_register_recv_cb(espnow_gateway_received);
+  uint8_t mac[6];
+  WiFi.macAddress(mac);
+  Serial.printf("espnow gateway %02x:%02x:%02x:%02x:%02x:%02x on channel %d\n",
+                mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], WiFi.channel());
+  return true;
+}
+
+/**
+ * Send the time to the leaf a packet came from. A leaf that is not a peer
+ * yet is added until the reply is done, see espnow_gateway_release().
+ */
+static inline void espnow_gateway_reply(espnow_gateway_t* gw, uint8_t* mac, const timesync_t* ts) {
+  uint8_t reply[ESPNOW_TIME_BYTES];
+  uint64_t time_ms = ts->bootEpoch_ms + millis();
+  reply[0] = ESPNOW_TIME_MAGIC;
+  for (uint8_t i = 1; i < ESPNOW_TIME_BYTES; i++, time_ms >>= 8) {
+    reply[i] = (uint8_t)time_ms;
+  }
+  if (!esp_now_is_peer_exist(mac)) {
+    if (esp_now_add_peer(mac, ESP_NOW_ROLE_COMBO, WiFi.channel(), nullptr, 0) != 0) {
+      return;
+    }
+    memcpy(gw->peer, mac, sizeof(gw->peer));
+    gw->peerAdded = true;
+    gw->replyStart_ms = millis();
+  }
+  espnowSendStatus = ESPNOW_SEND_PENDING;
+  esp_now_send(mac, reply, sizeof(reply));
+}
+
+/**
+ * Remove the reply's peer once its send has completed or timed out
+ *
+ * @return false while the reply is still in flight
+ */
+static inline bool espnow_gateway_release(espnow_gateway_t* gw) {
+  if (!gw->peerAdded) {
+    return true;
+  }
+  if (espnowSendStatus == ESPNOW_SEND_PENDING && (uint32_t)(millis() - gw->replyStart_ms) < ESPNOW_ACK_TIMEOUT_MS) {
+    return false;
+  }
+  esp_now_del_peer(gw->peer);
+  gw->peerAdded = false;
+  return true;
+}
+
+/**
+ * Answer new packets with the time, then forward a batch if one is due
+ *
+ * @param forward  publishes one decoded record, false to keep it queued
+ */
+static inline void espnow_gateway_service(espnow_gateway_t* gw, const timesync_t* ts,
+                                          bool (*forward)(uint32_t nodeId, const tlog_record_t* record,
+                                                          const uint8_t* frame, size_t length)) {
+  const uint8_t head = espnowHead;
+
+  while (gw->replied != head && espnow_gateway_release(gw)) {
+    if (timesync_valid(ts)) {
+      espnow_gateway_reply(gw, espnowQueue[gw->replied].mac, ts);
+    }
+    gw->replied = (gw->replied + 1) & (ESPNOW_GATEWAY_QUEUE - 1);
+  }
+  espnow_gateway_release(gw);
+
+  const uint8_t queued = (head - gw->tail) & (ESPNOW_GATEWAY_QUEUE - 1);
+  if (queued == 0 || (queued < ESPNOW_GATEWAY_BATCH
+                      && (uint32_t)(millis() - espnowQueue[gw->tail].received_ms) < ESPNOW_GATEWAY_FLUSH_MS)) {
+    return;
+  }
+
+  while (gw->tail != head) {
+    const espnow_packet_t* packet = &espnowQueue[gw->tail];
+    tlog_record_t record;
+    uint32_t nodeId;
+    if (tframe_decode(packet->frame, packet->length, &record, &nodeId)
+        && !forward(nodeId, &record, packet->frame, packet->length)) {
+      return;                                   // uplink down, retry later
+    }
+    gw->tail = (gw->tail + 1) & (ESPNOW_GATEWAY_QUEUE - 1);
+  }
+}
@@ -0,0 +1,186 @@
+/**
+ * Hardware abstraction for the sampling and encoding pipeline.
+ *
+ * The scanner, ADC filter, calibration math, frame encoder and stats only
+ * talk to the chip through the hal_*() calls below. On the ESP8266 each one
+ * is an inline wrapper around the Arduino core call or GPIO register it
+ * replaces, so the generated code is unchanged.
+ *
+ * Without ARDUINO defined (a plain native compiler) the same headers build
+ * against a host backend instead, for profiling and trace replay off the
+ * device:
+ *
+ *   - GPIO writes land in halHost.gpio, one bit per GPIO, so a harness can
+ *     tell which mux channel is selected.
+ *   - ADC reads come from halHost.adc, typically a recorded trace indexed by
+ *     that channel. Unset, every read returns 0.
+ *   - Time is the host's steady clock. With halHost.simulated set it comes
+ *     from halHost.now_us instead, and every read advances it by
+ *     halHost.step_us, so scanner waits finish without real sleeping.
+ *   - The "cycle counter" counts nanoseconds at a nominal 1000 MHz, which
+ *     keeps cycles / hal_cpu_mhz() in microseconds like on the device.
+ *
+ * Flash, WiFi and the portal stay behind #if !HAL_HOST in the modules that
+ * use them.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#if defined(ARDUINO)
+
+#define HAL_HOST            (0)
+
+#include <Arduino.h>
+
+static inline uint16_t hal_adc_read(uint8_t pin) {
+  return analogRead(pin);
+}
+
+static inline uint32_t hal_millis(void) {
+  return millis();
+}
+
+static inline uint32_t hal_micros(void) {
+  return micros();
+}
+
+static inline uint32_t hal_cycles(void) {
+  return ESP.getCycleCount();
+}
+
+static inline uint32_t hal_cpu_mhz(void) {
+  return ESP.getCpuFreqMHz();
+}
+
+static inline void hal_pin_output(uint8_t pin) {
+  pinMode(pin, OUTPUT);
+}
+
+/**
+ * Set / clear GPIO0-15 outputs by mask in one register write
+ */
+static inline void hal_gpio_set(uint32_t mask) {
+  GPOS = mask;
+}
+
+static inline void hal_gpio_clear(uint32_t mask) {
+  GPOC = mask;
+}
+
+static inline void hal_gpio16_write(bool high) {
+  GP16O = high ? 1 : 0;
+}
+
+static inline uint32_t hal_heap_free(void) {
+  return ESP.getFreeHeap();
+}
+
+static inline uint32_t hal_heap_max_block(void) {
+  return ESP.getMaxFreeBlockSize();
+}
+
+static inline uint8_t hal_heap_fragmentation(void) {
+  return ESP.getHeapFragmentation();
+}
+
+#else
+
+#define HAL_HOST            (1)
+
+#include <algorithm>
+#include <chrono>
+
+// As the ESP8266 core does
+using std::min;
+using std::max;
+
+// NodeMCU pin names, numbered as on the ESP8266 core
+static constexpr uint8_t D0 = 16;
+static constexpr uint8_t D1 = 5;
+static constexpr uint8_t D2 = 4;
+static constexpr uint8_t D3 = 0;
+static constexpr uint8_t D4 = 2;
+static constexpr uint8_t D5 = 14;
+static constexpr uint8_t D6 = 12;
+static constexpr uint8_t D7 = 13;
+static constexpr uint8_t D8 = 15;
+static constexpr uint8_t A0 = 17;
+
+typedef uint16_t (*hal_adc_source_t)(uint8_t pin);
+
+typedef struct hal_host {
+  uint32_t gpio;                                //! Output latch, bit n is GPIOn (16 included)
+  hal_adc_source_t adc;                         //! Source for hal_adc_read(), nullptr reads 0
+  bool simulated;                               //! Use now_us instead of the steady clock
+  uint64_t now_us;
+  uint32_t step_us;                             //! Simulated time added per clock read
+} hal_host_t;
+
+static hal_host_t halHost;
+
+static inline uint64_t hal_host_ns(void) {
+  if (halHost.simulated) {
+    halHost.now_us += halHost.step_us;
+    return halHost.now_us * 1000ULL;
+  }
+  return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static inline uint16_t hal_adc_read(uint8_t pin) {
+  return halHost.adc ? halHost.adc(pin) : 0;
+}
+
+static inline uint32_t hal_millis(void) {
+  return (uint32_t)(hal_host_ns() / 1000000ULL);
+}
+
+static inline uint32_t hal_micros(void) {
+  return (uint32_t)(hal_host_ns() / 1000ULL);
+}
+
+static inline uint32_t hal_cycles(void) {
+  return (uint32_t)hal_host_ns();
+}
+
+static inline uint32_t hal_cpu_mhz(void) {
+  return 1000;
+}
+
+static inline void hal_pin_output(uint8_t pin) {
+  (void)pin;
+}
+
+static inline void hal_gpio_set(uint32_t mask) {
+  halHost.gpio |= mask;
+}
+
+static inline void hal_gpio_clear(uint32_t mask) {
+  halHost.gpio &= ~mask;
+}
+
+static inline void hal_gpio16_write(bool high) {
+  hal_gpio_clear(1UL << 16);
+  hal_gpio_set(high ? (1UL << 16) : 0);
+}
+
+static inline uint32_t hal_heap_free(void) {
+  return 0;
+}
+
+static inline uint32_t hal_heap_max_block(void) {
+  return 0;
+}
+
+static inline uint8_t hal_heap_fragmentation(void) {
+  return 0;
+}
+
+#endif
@@ -0,0 +1,206 @@
+/**
+ * On-device moisture history at several resolutions.
+ *
+ * The most recent sweeps are kept as-is. Every sweep is also folded into
+ * the open minute, hour and day buckets (running min / max / sum). When a
+ * sweep lands in a new bucket, the previous bucket is closed into that
+ * tier's ring as a min / max / mean rollup. Nothing is recomputed from old
+ * samples.
+ *
+ * All capacities are template parameters, so the full footprint is fixed at
+ * compile time (see sizeof(history_t)) and nothing is ever allocated. The
+ * rings live in RAM, so in duty-cycle mode they only cover the current wake.
+ * History is meant for the always-on node.
+ *
+ * Values are moisture in 0.1 % (at most 1000), so a rollup packs min, max
+ * and mean of a channel into one 32-bit word. That keeps a row at 4 bytes
+ * a channel, which is what lets the hour tier hold a full day at 32 and
+ * 64 channels (see HISTORY_HOURS).
+ */
+
+#pragma once
+
+#include "hal.h"
+#include "config.h"
+
+
+#define HISTORY_CHANNELS        (MUX_CHANNEL_COUNT)
+#define HISTORY_VALUE_BITS      (10)
+#define HISTORY_VALUE_MAX       ((1U << HISTORY_VALUE_BITS) - 1)
+#define HISTORY_MIN_SHIFT       (0)
+#define HISTORY_MAX_SHIFT       (HISTORY_VALUE_BITS)
+#define HISTORY_MEAN_SHIFT      (2 * HISTORY_VALUE_BITS)
+
+static_assert(HISTORY_HOURS >= 24, "the hour tier must cover at least a day");
+
+/**
+ * Fixed-capacity ring that overwrites its oldest entry when full.
+ *
+ * Entries also have an absolute index (number of pushes before them), so a
+ * reader that walks the ring across several calls, such as a chunked HTTP
+ * response, can tell whether its position was overwritten while it was
+ * away.
+ */
+template <typename T, size_t Capacity>
+class history_ring {
+public:
+  static_assert(Capacity > 0, "ring needs at least one slot");
+
+  void push(const T& item) {
+    items_[head_] = item;
+    head_ = (head_ + 1) % Capacity;
+    if (count_ < Capacity) {
+      count_++;
+    }
+    total_++;
+  }
+
+  /**
+   * Entry by age, 0 being the oldest still held
+   */
+  const T& at(size_t index) const {
+    return items_[(head_ + Capacity - count_ + index) % Capacity];
+  }
+
+  const T& newest(void) const {
+    return at(count_ - 1);
+  }
+
+  /**
+   * Absolute index of the oldest entry still held; entries run up to total()
+   */
+  uint32_t first(void) const { return total_ - count_; }
+  uint32_t total(void) const { return total_; }
+
+  /**
+   * Entry by absolute index, which must be in [first(), total())
+   */
+  const T& at_absolute(uint32_t index) const {
+    return at(index - first());
+  }
+
+  size_t size(void) const { return count_; }
+  bool empty(void) const { return count_ == 0; }
+  static constexpr size_t capacity(void) { return Capacity; }
+
+private:
+  T items_[Capacity] = {};
+  size_t head_ = 0;
+  size_t count_ = 0;
+  uint32_t total_ = 0;
+};
+
+typedef struct history_sample {
+  uint32_t time_s;
+  uint16_t value[HISTORY_CHANNELS];
+} history_sample_t;
+
+typedef struct history_rollup {
+  uint32_t start_s;                             //! Start of the bucket
+  uint16_t count;                               //! Sweeps folded in
+  uint32_t value[HISTORY_CHANNELS];             //! min, max and mean, see HISTORY_*_SHIFT
+} history_rollup_t;
+
+/**
+ * One field of a channel's rollup
+ *
+ * @param shift  HISTORY_MIN_SHIFT, HISTORY_MAX_SHIFT or HISTORY_MEAN_SHIFT
+ */
+static inline uint16_t history_rollup_get(const history_rollup_t& r, uint8_t ch, uint8_t shift) {
+  return (uint16_t)((r.value[ch] >> shift) & HISTORY_VALUE_MAX);
+}
+
+/**
+ * One resolution: a ring of closed rollups plus the bucket being filled
+ */
+template <size_t Capacity, uint32_t Period_s>
+class history_tier {
+public:
+  static constexpr uint32_t PERIOD_S = Period_s;
+
+  void add(uint32_t time_s, const uint16_t* value) {
+    const uint32_t start = time_s - time_s % Period_s;
+
+    if (count_ > 0 && start != start_s_) {
+      close();
+    }
+    if (count_ == 0) {
+      start_s_ = start;
+      for (uint8_t ch = 0; ch < HISTORY_CHANNELS; ch++) {
+        min_[ch] = max_[ch] = value[ch];
+        sum_[ch] = 0;
+      }
+    }
+    for (uint8_t ch = 0; ch < HISTORY_CHANNELS; ch++) {
+      min_[ch] = (value[ch] < min_[ch]) ? value[ch] : min_[ch];
+      max_[ch] = (value[ch] > max_[ch]) ? value[ch] : max_[ch];
+      sum_[ch] += value[ch];
+    }
+    count_++;
+  }
+
+  /**
+   * Rollup of the bucket still being filled, for "so far" queries
+   *
+   * @return false if the bucket is empty
+   */
+  bool current(history_rollup_t* out) const {
+    if (count_ == 0) {
+      return false;
+    }
+    fill(out);
+    return true;
+  }
+
+  const history_ring<history_rollup_t, Capacity>& closed(void) const {
+    return closed_;
+  }
+
+private:
+  void fill(history_rollup_t* out) const {
+    out->start_s = start_s_;
+    out->count = count_;
+    for (uint8_t ch = 0; ch < HISTORY_CHANNELS; ch++) {
+      const uint32_t mean = (sum_[ch] + count_ / 2) / count_;
+      out->value[ch] = ((uint32_t)min(min_[ch], (uint16_t)HISTORY_VALUE_MAX) << HISTORY_MIN_SHIFT)
+                     | ((uint32_t)min(max_[ch], (uint16_t)HISTORY_VALUE_MAX) << HISTORY_MAX_SHIFT)
+                     | (min(mean, (uint32_t)HISTORY_VALUE_MAX) << HISTORY_MEAN_SHIFT);
+    }
+  }
+
+  void close(void) {
+    history_rollup_t rollup;
+    fill(&rollup);
+    closed_.push(rollup);
+    count_ = 0;
+  }
+
+  history_ring<history_rollup_t, Capacity> closed_;
+  uint32_t start_s_ = 0;
+  uint16_t count_ = 0;
+  uint16_t min_[HISTORY_CHANNELS] = {};
+  uint16_t max_[HISTORY_CHANNELS] = {};
+  uint32_t sum_[HISTORY_CHANNELS] = {};
+};
+
+template <size_t RawN, size_t MinuteN, size_t HourN, size_t DayN>
+class history_store {
+public:
+  void add(uint32_t time_s, const uint16_t* value) {
+    history_sample_t sample;
+    sample.time_s = time_s;
+    memcpy(sample.value, value, sizeof(sample.value));
+    raw.push(sample);
+
+    minute.add(time_s, value);
+    hour.add(time_s, value);
+    day.add(time_s, value);
+  }
+
+  history_ring<history_sample_t, RawN> raw;
+  history_tier<MinuteN, 60UL> minute;
+  history_tier<HourN, 3600UL> hour;
+  history_tier<DayN, 86400UL> day;
+};
+
+typedef history_store<HISTORY_RAW_SAMPLES, HISTORY_MINUTES, HISTORY_HOURS, HISTORY_DAYS> history_t;
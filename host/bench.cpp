@@ -0,0 +1,178 @@
+/**
+ * Micro-benchmarks for the sampling and encoding pipeline on the host
+ * backend (Google Benchmark).
+ *
+ * The numbers are host CPU time, not ESP8266 time. They are for comparing
+ * variants of the same code: the CMakeLists.txt builds one binary per
+ * filter configuration, so e.g. host_bench and host_bench_burst64 run the
+ * same cases with a different ADC_BURST_SAMPLES. The full sweep case runs
+ * the scanner on the simulated clock, so its waits cost nothing and only
+ * the state machine and the filter are measured.
+ */
+
+#include "../hal.h"
+#include "../config.h"
+#include "../crc.h"
+#include "../adc_filter.h"
+#include "../mux_scan.h"
+#include "../adaptive_rate.h"
+#include "../channel_health.h"
+#include "../calibration.h"
+#include "../telemetry_record.h"
+#include "../telemetry_frame.h"
+
+#include <benchmark/benchmark.h>
+
+
+static_assert(HAL_HOST, "the benchmarks build against the host backend only");
+
+static uint32_t benchNoise = 1;
+
+/**
+ * A few counts of noise around mid scale, like a probe in damp soil
+ */
+static uint16_t bench_adc(uint8_t pin) {
+  (void)pin;
+  benchNoise = benchNoise * 1103515245UL + 12345UL;
+  return (uint16_t)(512 + ((benchNoise >> 16) & 7) - 4);
+}
+
+static void bench_record(tlog_record_t* record, uint32_t sequence) {
+  memset(record, 0, sizeof(*record));
+  record->timestamp = 1700000000UL + sequence * 60;
+  record->sequence = sequence;
+  record->channelMask = CHMASK_ALL;
+  record->flags = TLOG_FLAG_CALIBRATED | TLOG_FLAG_EPOCH;
+  record->batteryMv = 3700;
+  for (uint8_t ch = 0; ch < TLOG_CHANNELS; ch++) {
+    record->readings[ch] = (uint16_t)(400 + 37 * ch + (sequence & 3));
+  }
+  record->crc = tlog_record_crc(record);
+}
+
+
+static void BM_adcfilter_decimate(benchmark::State& state) {
+  uint16_t raw[ADC_BURST_SAMPLES];
+  uint16_t buf[ADC_BURST_SAMPLES];
+  for (uint8_t i = 0; i < ADC_BURST_SAMPLES; i++) {
+    raw[i] = bench_adc(0);
+  }
+  for (auto _ : state) {
+    memcpy(buf, raw, sizeof(buf));
+    benchmark::DoNotOptimize(adcfilter_decimate(buf));
+  }
+}
+BENCHMARK(BM_adcfilter_decimate);
+
+static void BM_muxscan_sweep(benchmark::State& state) {
+  static muxscan_t scan;
+  halHost.adc = bench_adc;
+  halHost.simulated = true;
+  halHost.step_us = 1000;
+  muxscan_init(&scan);
+  for (auto _ : state) {
+    muxscan_start(&scan, 0);
+    while (!muxscan_service(&scan)) {
+    }
+    benchmark::DoNotOptimize(scan.readings);
+  }
+  halHost.simulated = false;
+  state.SetItemsProcessed(state.iterations() * MUX_CHANNEL_COUNT);
+}
+BENCHMARK(BM_muxscan_sweep);
+
+static void BM_cal_to_permille(benchmark::State& state) {
+  static cal_table_t cal;
+  uint16_t readings[MUX_CHANNEL_COUNT];
+  cal_defaults(&cal);
+  for (uint8_t ch = 0; ch < MUX_CHANNEL_COUNT; ch++) {
+    cal_channel_set(&cal.channel[ch], (uint16_t)(ADC_RESULT_MAX - ch), ch);
+    readings[ch] = (uint16_t)(ADC_RESULT_MAX / 2 + ch);
+  }
+  for (auto _ : state) {
+    for (uint8_t ch = 0; ch < MUX_CHANNEL_COUNT; ch++) {
+      benchmark::DoNotOptimize(cal_to_permille(&cal.channel[ch], readings[ch]));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * MUX_CHANNEL_COUNT);
+}
+BENCHMARK(BM_cal_to_permille);
+
+static void BM_tframe_encode_keyframe(benchmark::State& state) {
+  tframe_ctx_t ctx;
+  tlog_record_t record;
+  uint8_t frame[TFRAME_MAX_BYTES];
+  bench_record(&record, 1);
+  for (auto _ : state) {
+    tframe_reset(&ctx);
+    benchmark::DoNotOptimize(tframe_encode(frame, &ctx, &record, 0x1234, nullptr, nullptr));
+  }
+}
+BENCHMARK(BM_tframe_encode_keyframe);
+
+static void BM_tframe_encode_delta(benchmark::State& state) {
+  tframe_ctx_t ctx;
+  tlog_record_t records[2];
+  uint8_t frame[TFRAME_MAX_BYTES];
+  bench_record(&records[0], 1);
+  bench_record(&records[1], 2);
+  tframe_reset(&ctx);
+  tframe_encode(frame, &ctx, &records[0], 0x1234, nullptr, nullptr);
+  for (auto _ : state) {
+    // Rewind the reference so every pass encodes the same delta
+    ctx.sequence = records[0].sequence;
+    memcpy(ctx.readings, records[0].readings, sizeof(ctx.readings));
+    benchmark::DoNotOptimize(tframe_encode(frame, &ctx, &records[1], 0x1234, nullptr, nullptr));
+  }
+}
+BENCHMARK(BM_tframe_encode_delta);
+
+static void BM_tframe_decode(benchmark::State& state) {
+  tframe_ctx_t ctx;
+  tlog_record_t record;
+  tlog_record_t decoded;
+  uint32_t nodeId;
+  uint8_t frame[TFRAME_MAX_BYTES];
+  bench_record(&record, 1);
+  tframe_reset(&ctx);
+  const size_t length = tframe_encode(frame, &ctx, &record, 0x1234, nullptr, nullptr);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(tframe_decode(frame, length, &decoded, &nodeId));
+  }
+}
+BENCHMARK(BM_tframe_decode);
+
+static void BM_health_adaptive_update(benchmark::State& state) {
+  static adaptive_t ad;
+  static health_t health;
+  uint16_t readings[MUX_CHANNEL_COUNT];
+  uint16_t previous[MUX_CHANNEL_COUNT];
+  for (uint8_t ch = 0; ch < MUX_CHANNEL_COUNT; ch++) {
+    previous[ch] = (uint16_t)(ADC_RESULT_MAX / 2 + 16 * ch);
+  }
+  adaptive_init(&ad, 60);
+  health_init(&health);
+  uint32_t now_s = 0;
+  for (auto _ : state) {
+    for (uint8_t ch = 0; ch < MUX_CHANNEL_COUNT; ch++) {
+      readings[ch] = (uint16_t)(ADC_RESULT_MAX / 2 + 16 * ch + ((now_s / 60 + ch) & 3));
+    }
+    benchmark::DoNotOptimize(health_update(&health, &ad, readings, previous, 0));
+    benchmark::DoNotOptimize(adaptive_update(&ad, readings, 0, now_s));
+    memcpy(previous, readings, sizeof(previous));
+    now_s += 60;
+  }
+}
+BENCHMARK(BM_health_adaptive_update);
+
+static void BM_tlog_record_crc(benchmark::State& state) {
+  tlog_record_t record;
+  bench_record(&record, 1);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(tlog_record_crc(&record));
+  }
+  state.SetBytesProcessed(state.iterations() * offsetof(tlog_record_t, crc));
+}
+BENCHMARK(BM_tlog_record_crc);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,306 @@
+/**
+ * Trace replay for the sampling pipeline, built natively against the host
+ * backend in hal.h.
+ *
+ *   host_replay [-n sweeps] [-q] trace...
+ *
+ * Runs the firmware's own scanner, filter, health checks, adaptive rate,
+ * calibration and frame encoder over recorded ADC data, on a simulated
+ * clock, and prints one CSV line per sweep:
+ *
+ *   sweep,t_s,interval_s,reported,faults,frame_bytes,ch0,ch1,...
+ *
+ * t_s is node time; each sweep moves it on by the adaptive interval that
+ * was in force, as the deep sleep would. -q leaves the per-sweep lines out.
+ * The stage timings (in simulated µs) and the host CPU time for the run
+ * follow as '#' lines.
+ *
+ * A trace is either
+ *
+ *   - text: one line per raw read, with one comma separated 10-bit value
+ *     per channel in channel order. Missing columns read 0, '#' starts a
+ *     comment.
+ *   - a binary capture of the "stream" command (adc_stream.h), recognised
+ *     by its sync bytes. Each good packet adds its samples to its channel.
+ *
+ * Every channel consumes its own samples in order each time the scanner
+ * reads it, ADC_BURST_SAMPLES per sweep, and wraps at the end. Without -n
+ * the run stops once the longest channel has been used up.
+ *
+ * Build with the CMakeLists.txt next to this file; config.h overrides
+ * (-DADC_BURST_SAMPLES=32, -DBOARD_REVISION=3 ...) work as for the sketch.
+ */
+
+#include "../hal.h"
+#include "../config.h"
+#include "../board.h"
+#include "../crc.h"
+#include "../mux_scan.h"
+#include "../battery.h"
+#include "../adaptive_rate.h"
+#include "../channel_health.h"
+#include "../calibration.h"
+#include "../telemetry_frame.h"
+#include "../stats.h"
+
+#include <chrono>
+#include <vector>
+
+
+static_assert(HAL_HOST, "the replay driver builds against the host backend only");
+
+// Packet layout from adc_stream.h, which needs the Arduino core itself
+#define ADCSTREAM_SYNC0         (0x5A)
+#define ADCSTREAM_SYNC1         (0xA5)
+#define ADCSTREAM_HEADER_BYTES  (12)
+
+static std::vector<uint16_t> traceSamples[MUX_CHANNEL_COUNT];
+static size_t tracePosition[MUX_CHANNEL_COUNT];
+static muxscan_t scanner;
+
+
+static bool pin_high(uint8_t pin) {
+  return pin != PIN_NONE && (halHost.gpio & (1UL << pin)) != 0;
+}
+
+/**
+ * Channel the select and bank lines currently address
+ */
+static uint8_t selected_channel(void) {
+  uint8_t bank = 0;
+  if (muxbank<Board, MUX_COUNT>::LINES == 0) {
+    bank = 0;
+  } else if (Board::muxBankEnable) {
+    bank = !pin_high(Board::muxBank0) ? 0 : !pin_high(Board::muxBank1) ? 1 : 2;
+  } else {
+    bank = (pin_high(Board::muxBank0) ? 1 : 0) | (pin_high(Board::muxBank1) ? 2 : 0)
+         | (pin_high(Board::muxBank2) ? 4 : 0);
+  }
+  const uint8_t select = (pin_high(Board::muxSelect0) ? 1 : 0) | (pin_high(Board::muxSelect1) ? 2 : 0)
+                       | (pin_high(Board::muxSelect2) ? 4 : 0);
+  return (uint8_t)((bank * MUX_CHANNELS_PER_MUX + select % MUX_CHANNELS_PER_MUX) % MUX_CHANNEL_COUNT);
+}
+
+static uint16_t trace_adc(uint8_t pin) {
+  (void)pin;
+  const uint8_t ch = selected_channel();
+  const std::vector<uint16_t>& samples = traceSamples[ch];
+  if (samples.empty()) {
+    return 0;
+  }
+  const uint16_t raw = samples[tracePosition[ch]++ % samples.size()];
+  // The trace was taken with normal polarity, so swap it back for reversed sweeps
+  const bool mirror = scanner.reversed && ch != Board::batteryMuxChannel;
+  return mirror ? (uint16_t)(((1U << ADC_RAW_BITS) - 1) - raw) : raw;
+}
+
+static bool load_stream(FILE* f) {
+  uint8_t packet[ADCSTREAM_HEADER_BYTES + 2 * 255 + 2];
+  int c;
+  while ((c = fgetc(f)) != EOF) {
+    if (c != ADCSTREAM_SYNC0) {
+      continue;
+    }
+    if ((c = fgetc(f)) != ADCSTREAM_SYNC1) {
+      if (c != EOF) {
+        ungetc(c, f);
+      }
+      continue;
+    }
+    packet[0] = ADCSTREAM_SYNC0;
+    packet[1] = ADCSTREAM_SYNC1;
+    if (fread(packet + 2, 1, ADCSTREAM_HEADER_BYTES - 2, f) != ADCSTREAM_HEADER_BYTES - 2) {
+      break;
+    }
+    const uint8_t channel = packet[4];
+    const size_t length = ADCSTREAM_HEADER_BYTES + 2 * packet[5] + 2;
+    if (fread(packet + ADCSTREAM_HEADER_BYTES, 1, length - ADCSTREAM_HEADER_BYTES, f)
+        != length - ADCSTREAM_HEADER_BYTES) {
+      break;
+    }
+    // Console text between packets can look like a sync marker, the CRC sorts it out
+    if (channel >= MUX_CHANNEL_COUNT
+        || crc16_compute(packet, length - 2) != tframe_get_u16(packet + length - 2)) {
+      continue;
+    }
+    for (uint8_t i = 0; i < packet[5]; i++) {
+      traceSamples[channel].push_back(tframe_get_u16(packet + ADCSTREAM_HEADER_BYTES + 2 * i));
+    }
+  }
+  return true;
+}
+
+static bool load_text(FILE* f) {
+  char line[1024];
+  while (fgets(line, sizeof(line), f)) {
+    char* comment = strchr(line, '#');
+    if (comment) {
+      *comment = '\0';
+    }
+    char* p = line;
+    while (*p == ' ' || *p == '\t') {
+      p++;
+    }
+    if (*p == '\0' || *p == '\n' || *p == '\r') {
+      continue;
+    }
+    for (uint8_t ch = 0; ch < MUX_CHANNEL_COUNT; ch++) {
+      char* end = p;
+      const unsigned long value = strtoul(p, &end, 10);
+      traceSamples[ch].push_back(end == p ? 0 : (uint16_t)min(value, (unsigned long)(1U << ADC_RAW_BITS) - 1));
+      p = end;
+      while (*p == ' ' || *p == '\t' || *p == ',') {
+        p++;
+      }
+    }
+  }
+  return true;
+}
+
+static bool load_trace(const char* path) {
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    fprintf(stderr, "host_replay: cannot open %s\n", path);
+    return false;
+  }
+  const int first = fgetc(f);
+  const int second = fgetc(f);
+  rewind(f);
+  const bool ok = (first == ADCSTREAM_SYNC0 && second == ADCSTREAM_SYNC1) ? load_stream(f) : load_text(f);
+  fclose(f);
+  return ok;
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: host_replay [-n sweeps] [-q] trace...\n");
+}
+
+int main(int argc, char** argv) {
+  uint32_t sweeps = 0;
+  bool quiet = false;
+  int arg = 1;
+  for (; arg < argc && argv[arg][0] == '-'; arg++) {
+    if (!strcmp(argv[arg], "-n") && arg + 1 < argc) {
+      sweeps = (uint32_t)strtoul(argv[++arg], nullptr, 10);
+    } else if (!strcmp(argv[arg], "-q")) {
+      quiet = true;
+    } else {
+      usage();
+      return 2;
+    }
+  }
+  if (arg == argc) {
+    usage();
+    return 2;
+  }
+  for (; arg < argc; arg++) {
+    if (!load_trace(argv[arg])) {
+      return 1;
+    }
+  }
+
+  size_t longest = 0;
+  for (uint8_t ch = 0; ch < MUX_CHANNEL_COUNT; ch++) {
+    longest = max(longest, traceSamples[ch].size());
+  }
+  if (longest == 0) {
+    fprintf(stderr, "host_replay: no samples in the trace\n");
+    return 1;
+  }
+  if (sweeps == 0) {
+    sweeps = (uint32_t)((longest + ADC_BURST_SAMPLES - 1) / ADC_BURST_SAMPLES);
+  }
+
+  halHost.adc = trace_adc;
+  halHost.simulated = true;
+  halHost.step_us = 10;
+
+  static adaptive_t adaptive;
+  static health_t health;
+  static cal_table_t cal;
+  static battery_t battery;
+  static tframe_ctx_t frameCtx;
+  uint16_t previous[MUX_CHANNEL_COUNT] = {};
+  uint8_t frame[TFRAME_MAX_BYTES];
+  uint32_t node_s = 0;
+  uint32_t sequence = 0;
+  uint32_t reports = 0;
+  uint64_t frameBytes = 0;
+
+  adaptive_init(&adaptive, DUTY_CYCLE_MODE ? DUTY_CYCLE_PERIOD_S : SCAN_INTERVAL_MS / 1000);
+  health_init(&health);
+  cal_defaults(&cal);
+  memset(&battery, 0, sizeof(battery));
+  tframe_reset(&frameCtx);
+  muxscan_init(&scanner);
+  stats_reset();
+
+  if (!quiet) {
+    printf("sweep,t_s,interval_s,reported,faults,frame_bytes");
+    for (uint8_t ch = 0; ch < MUX_CHANNEL_COUNT; ch++) {
+      printf(",ch%u", ch);
+    }
+    printf("\n");
+  }
+
+  const auto cpuStart = std::chrono::steady_clock::now();
+  for (uint32_t sweep = 0; sweep < sweeps; sweep++) {
+    muxscan_start(&scanner, battery_skip_mask(scanner.sweepCount));
+    while (!muxscan_service(&scanner)) {
+    }
+
+    const chmask_t faults = health_update(&health, &adaptive, scanner.readings, previous, BATTERY_CHANNEL_MASK);
+    memcpy(previous, scanner.readings, sizeof(previous));
+    if (scanner.sampledMask & BATTERY_CHANNEL_MASK) {
+      battery_update(&battery, scanner.readings[Board::batteryMuxChannel]);
+    }
+
+    const uint32_t interval_s = adaptive.interval_s;
+    const bool report = adaptive_update(&adaptive, scanner.readings, BATTERY_CHANNEL_MASK | faults, node_s);
+    size_t length = 0;
+    if (report) {
+      tlog_record_t record;
+      memset(&record, 0, sizeof(record));
+      record.timestamp = node_s;
+      record.sequence = sequence++;
+      record.channelMask = CHMASK_ALL & ~(BATTERY_CHANNEL_MASK | faults);
+      record.flags = TLOG_FLAG_CALIBRATED | (faults ? TLOG_FLAG_FAULTS : 0);
+      record.batteryMv = battery.mv;
+      for (uint8_t ch = 0; ch < TLOG_CHANNELS; ch++) {
+        record.readings[ch] = (faults & chmask_bit(ch)) ? health_channel_faults(&health, ch, scanner.readings[ch])
+                            : (BATTERY_CHANNEL_MASK & chmask_bit(ch)) ? 0
+                            : cal_to_permille(&cal.channel[ch], scanner.readings[ch]);
+      }
+      record.crc = tlog_record_crc(&record);
+
+      const uint32_t encodeStart = stats_cycles_begin();
+      length = tframe_encode(frame, &frameCtx, &record, 0, nullptr, nullptr);
+      stats_cycles_end(STAGE_FRAME_ENCODE, encodeStart);
+      reports++;
+      frameBytes += length;
+    }
+
+    if (!quiet) {
+      printf("%u,%u,%u,%u,0x%llx,%u", sweep, node_s, interval_s, report ? 1 : 0,
+             (unsigned long long)faults, (unsigned)length);
+      for (uint8_t ch = 0; ch < MUX_CHANNEL_COUNT; ch++) {
+        printf(",%u", scanner.readings[ch]);
+      }
+      printf("\n");
+    }
+    node_s += interval_s;
+  }
+  const double cpu_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - cpuStart).count();
+
+  char line[160];
+  printf("# sweeps=%u reports=%u frame_bytes=%llu node_s=%u\n",
+         sweeps, reports, (unsigned long long)frameBytes, node_s);
+  for (uint8_t i = 0; i < STAGE_COUNT; i++) {
+    if (statsTable[i].count) {
+      stats_format_stage(line, sizeof(line), (stats_stage_t)i);
+      printf("# %s\n", line);
+    }
+  }
+  printf("# host_cpu_us=%.0f per_sweep_us=%.2f\n", cpu_us, cpu_us / sweeps);
+  return 0;
+}
@@ -0,0 +1,332 @@
+/**
+ * Local HTTP API on ESPAsyncWebServer.
+ *
+ *   GET /readings          latest sweep, raw counts and moisture (0.1 %)
+ *   GET /history           hourly rollups (same as /history/hour)
+ *   GET /history/raw       recent sweeps
+ *   GET /history/minute    per-minute rollups
+ *   GET /history/hour      per-hour rollups
+ *   GET /history/day       per-day rollups
+ *   GET /stats             stage timings and heap figures
+ *   GET /settle            per-channel settle times (µs)
+ *   POST /settle/tune      measure them again; answers 202 right away
+ *
+ * Responses are chunked and produced straight from the history rings one
+ * JSON row at a time, as the TCP send window opens up. No response is ever
+ * assembled in a String. Per-response state lives in a small static pool
+ * (HTTP_API_STREAMS); when it is exhausted the request gets 503 rather
+ * than allocating.
+ *
+ * A stream walks the ring by absolute index. If a row is overwritten while
+ * the response is in flight, the stream skips ahead to the oldest surviving
+ * row instead of sending a stale one.
+ */
+
+#pragma once
+
+#include <ESPAsyncWebServer.h>
+#include "config.h"
+#include "history.h"
+#include "mux_scan.h"
+#include "stats.h"
+
+
+#define HTTP_ROW_ROLLUP_MAX     (48 + 18 * HISTORY_CHANNELS)  //! Worst-case rollup row
+#define HTTP_ROW_STATS_MAX      (STATS_ROW_MAX + 2)           //! A stats line with its separator and closing brace
+#define HTTP_ROW_MAX            (HTTP_ROW_ROLLUP_MAX > HTTP_ROW_STATS_MAX ? HTTP_ROW_ROLLUP_MAX : HTTP_ROW_STATS_MAX)
+
+typedef enum httpapi_kind {
+  HTTPAPI_READINGS = 0,
+  HTTPAPI_RAW,
+  HTTPAPI_MINUTE,
+  HTTPAPI_HOUR,
+  HTTPAPI_DAY,
+  HTTPAPI_STATS,
+  HTTPAPI_SETTLE
+} httpapi_kind_t;
+
+typedef enum httpapi_phase {
+  HTTPAPI_HEAD = 0,
+  HTTPAPI_ROWS,
+  HTTPAPI_TAIL,
+  HTTPAPI_END
+} httpapi_phase_t;
+
+typedef struct httpapi_stream {
+  bool busy;
+  uint16_t generation;                          //! Bumped on every reuse of the slot
+  httpapi_kind_t kind;
+  httpapi_phase_t phase;
+  uint32_t next;                                //! Absolute ring index of the next row
+  bool firstRow;
+  uint16_t rowLength;
+  uint16_t rowOffset;
+  char row[HTTP_ROW_MAX];
+} httpapi_stream_t;
+
+typedef struct httpapi {
+  AsyncWebServer* server;
+  const history_t* history;
+  const muxscan_t* scanner;
+  volatile bool settleTuneRequested;            //! Set from the server task, taken by loop()
+  httpapi_stream_t streams[HTTP_API_STREAMS];
+} httpapi_t;
+
+
+// ---------------------------------------------------------------------------
+// Row rendering
+// ---------------------------------------------------------------------------
+
+static inline int httpapi_put_array(char* out, size_t size, const uint16_t* values, uint8_t count) {
+  int n = 0;
+  for (uint8_t i = 0; i < count && (size_t)n < size; i++) {
+    n += snprintf(out + n, size - n, i ? ",%u" : "[%u", values[i]);
+  }
+  if ((size_t)n < size) {
+    n += snprintf(out + n, size - n, "]");
+  }
+  return n;
+}
+
+/**
+ * One field of every channel in a rollup, as a JSON array
+ */
+static inline int httpapi_put_rollup(char* out, size_t size, const history_rollup_t& r, uint8_t shift) {
+  int n = 0;
+  for (uint8_t ch = 0; ch < HISTORY_CHANNELS && (size_t)n < size; ch++) {
+    n += snprintf(out + n, size - n, ch ? ",%u" : "[%u", history_rollup_get(r, ch, shift));
+  }
+  if ((size_t)n < size) {
+    n += snprintf(out + n, size - n, "]");
+  }
+  return n;
+}
+
+static inline uint16_t httpapi_render_readings(const httpapi_t* api, char* out) {
+  const history_t* h = api->history;
+  int n = snprintf(out, HTTP_ROW_MAX, "{\"sweep\":%u,\"t\":%u,\"raw\":",
+                   api->scanner->sweepCount, h->raw.empty() ? 0 : h->raw.newest().time_s);
+  n += httpapi_put_array(out + n, HTTP_ROW_MAX - n, api->scanner->readings, MUX_CHANNEL_COUNT);
+  if (!h->raw.empty()) {
+    n += snprintf(out + n, HTTP_ROW_MAX - n, ",\"moisture\":");
+    n += httpapi_put_array(out + n, HTTP_ROW_MAX - n, h->raw.newest().value, HISTORY_CHANNELS);
+  }
+  n += snprintf(out + n, HTTP_ROW_MAX - n, "}");
+  return (uint16_t)min(n, HTTP_ROW_MAX - 1);
+}
+
+static inline uint16_t httpapi_render_sample(const history_sample_t& s, char* out, bool first) {
+  int n = snprintf(out, HTTP_ROW_MAX, first ? "{\"t\":%u,\"v\":" : ",{\"t\":%u,\"v\":", s.time_s);
+  n += httpapi_put_array(out + n, HTTP_ROW_MAX - n, s.value, HISTORY_CHANNELS);
+  n += snprintf(out + n, HTTP_ROW_MAX - n, "}");
+  return (uint16_t)min(n, HTTP_ROW_MAX - 1);
+}
+
+static inline uint16_t httpapi_render_rollup(const history_rollup_t& r, char* out, bool first) {
+  int n = snprintf(out, HTTP_ROW_MAX, first ? "{\"t\":%u,\"n\":%u,\"min\":" : ",{\"t\":%u,\"n\":%u,\"min\":",
+                   r.start_s, r.count);
+  n += httpapi_put_rollup(out + n, HTTP_ROW_MAX - n, r, HISTORY_MIN_SHIFT);
+  n += snprintf(out + n, HTTP_ROW_MAX - n, ",\"max\":");
+  n += httpapi_put_rollup(out + n, HTTP_ROW_MAX - n, r, HISTORY_MAX_SHIFT);
+  n += snprintf(out + n, HTTP_ROW_MAX - n, ",\"mean\":");
+  n += httpapi_put_rollup(out + n, HTTP_ROW_MAX - n, r, HISTORY_MEAN_SHIFT);
+  n += snprintf(out + n, HTTP_ROW_MAX - n, "}");
+  return (uint16_t)min(n, HTTP_ROW_MAX - 1);
+}
+
+/**
+ * Render the next row of a ring into the stream, skipping anything that
+ * was overwritten since the last chunk
+ *
+ * @return false once the ring is exhausted
+ */
+template <typename Ring, typename Render>
+static inline bool httpapi_next_ring_row(httpapi_stream_t* s, const Ring& ring, Render render) {
+  if ((int32_t)(s->next - ring.first()) < 0) {
+    s->next = ring.first();
+  }
+  if (s->next >= ring.total()) {
+    return false;
+  }
+  s->rowLength = render(ring.at_absolute(s->next), s->row, s->firstRow);
+  s->firstRow = false;
+  s->next++;
+  return true;
+}
+
+static inline const char* httpapi_kind_name(httpapi_kind_t kind) {
+  switch (kind) {
+    case HTTPAPI_RAW:    return "raw";
+    case HTTPAPI_MINUTE: return "minute";
+    case HTTPAPI_HOUR:   return "hour";
+    case HTTPAPI_DAY:    return "day";
+    default:             return "";
+  }
+}
+
+/**
+ * Put the next piece of the response in s->row
+ *
+ * @return false when the response is complete
+ */
+static inline bool httpapi_next_row(const httpapi_t* api, httpapi_stream_t* s) {
+  const history_t* h = api->history;
+  s->rowOffset = 0;
+  s->rowLength = 0;
+
+  if (s->kind == HTTPAPI_STATS) {
+    // One row per stage, then heap figures
+    if (s->phase == HTTPAPI_END) {
+      return false;
+    }
+    if (s->phase == HTTPAPI_HEAD) {
+      s->phase = HTTPAPI_ROWS;
+      s->next = 0;
+    }
+    int n = snprintf(s->row, HTTP_ROW_MAX, s->next == 0 ? "{" : ",");
+    if (s->next < STAGE_COUNT) {
+      n += stats_format_stage(s->row + n, HTTP_ROW_MAX - n, (stats_stage_t)s->next);
+      s->next++;
+    } else {
+      n += stats_format_heap(s->row + n, HTTP_ROW_MAX - n);
+      n = min(n, HTTP_ROW_MAX - 1);
+      n += snprintf(s->row + n, HTTP_ROW_MAX - n, "}");
+      s->phase = HTTPAPI_END;
+    }
+    s->rowLength = (uint16_t)min(n, HTTP_ROW_MAX - 1);
+    return true;
+  }
+
+  if (s->kind == HTTPAPI_READINGS || s->kind == HTTPAPI_SETTLE) {
+    if (s->phase != HTTPAPI_HEAD) {
+      return false;
+    }
+    if (s->kind == HTTPAPI_READINGS) {
+      s->rowLength = httpapi_render_readings(api, s->row);
+    } else {
+      int n = snprintf(s->row, HTTP_ROW_MAX, "{\"settle_us\":");
+      n += httpapi_put_array(s->row + n, HTTP_ROW_MAX - n, api->scanner->settle_us, MUX_CHANNEL_COUNT);
+      n += snprintf(s->row + n, HTTP_ROW_MAX - n, "}");
+      s->rowLength = (uint16_t)min(n, HTTP_ROW_MAX - 1);
+    }
+    s->phase = HTTPAPI_END;
+    return true;
+  }
+
+  switch (s->phase) {
+    case HTTPAPI_HEAD:
+      s->rowLength = snprintf(s->row, HTTP_ROW_MAX, "{\"tier\":\"%s\",\"rows\":[", httpapi_kind_name(s->kind));
+      s->phase = HTTPAPI_ROWS;
+      s->firstRow = true;
+      s->next = 0;
+      return true;
+
+    case HTTPAPI_ROWS: {
+      bool more = false;
+      switch (s->kind) {
+        case HTTPAPI_RAW:    more = httpapi_next_ring_row(s, h->raw, httpapi_render_sample); break;
+        case HTTPAPI_MINUTE: more = httpapi_next_ring_row(s, h->minute.closed(), httpapi_render_rollup); break;
+        case HTTPAPI_HOUR:   more = httpapi_next_ring_row(s, h->hour.closed(), httpapi_render_rollup); break;
+        case HTTPAPI_DAY:    more = httpapi_next_ring_row(s, h->day.closed(), httpapi_render_rollup); break;
+        default: break;
+      }
+      if (more) {
+        return true;
+      }
+      s->phase = HTTPAPI_TAIL;
+    }
+    // fall through
+
+    case HTTPAPI_TAIL:
+      s->rowLength = snprintf(s->row, HTTP_ROW_MAX, "]}");
+      s->phase = HTTPAPI_END;
+      return true;
+
+    case HTTPAPI_END:
+    default:
+      return false;
+  }
+}
+
+
+// ---------------------------------------------------------------------------
+// Request handling
+// ---------------------------------------------------------------------------
+
+static inline httpapi_stream_t* httpapi_acquire(httpapi_t* api, httpapi_kind_t kind) {
+  for (uint8_t i = 0; i < HTTP_API_STREAMS; i++) {
+    httpapi_stream_t* s = &api->streams[i];
+    if (!s->busy) {
+      s->busy = true;
+      s->generation++;
+      s->kind = kind;
+      s->phase = HTTPAPI_HEAD;
+      s->rowLength = 0;
+      s->rowOffset = 0;
+      return s;
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * Copy as much of the response as fits into the TCP buffer
+ */
+static inline size_t httpapi_fill(const httpapi_t* api, httpapi_stream_t* s, uint8_t* buffer, size_t maxLen) {
+  size_t written = 0;
+  while (written < maxLen) {
+    if (s->rowOffset == s->rowLength && !httpapi_next_row(api, s)) {
+      break;
+    }
+    const size_t n = min((size_t)(s->rowLength - s->rowOffset), maxLen - written);
+    memcpy(buffer + written, s->row + s->rowOffset, n);
+    s->rowOffset += n;
+    written += n;
+  }
+  if (written == 0) {
+    s->busy = false;
+  }
+  return written;
+}
+
+static inline void httpapi_serve(httpapi_t* api, AsyncWebServerRequest* request, httpapi_kind_t kind) {
+  httpapi_stream_t* s = httpapi_acquire(api, kind);
+  if (s == nullptr) {
+    request->send(503);
+    return;
+  }
+
+  const uint16_t generation = s->generation;
+  request->onDisconnect([s, generation]() {
+    if (s->generation == generation) {
+      s->busy = false;
+    }
+  });
+  request->send(request->beginChunkedResponse("application/json",
+    [api, s](uint8_t* buffer, size_t maxLen, size_t) -> size_t {
+      return httpapi_fill(api, s, buffer, maxLen);
+    }));
+}
+
+static inline void httpapi_init(httpapi_t* api, AsyncWebServer* server,
+                                const history_t* history, const muxscan_t* scanner) {
+  memset(api->streams, 0, sizeof(api->streams));
+  api->server = server;
+  api->history = history;
+  api->scanner = scanner;
+  api->settleTuneRequested = false;
+
+  server->on("/readings", HTTP_GET, [api](AsyncWebServerRequest* r) { httpapi_serve(api, r, HTTPAPI_READINGS); });
+  server->on("/history/raw", HTTP_GET, [api](AsyncWebServerRequest* r) { httpapi_serve(api, r, HTTPAPI_RAW); });
+  server->on("/history/minute", HTTP_GET, [api](AsyncWebServerRequest* r) { httpapi_serve(api, r, HTTPAPI_MINUTE); });
+  server->on("/history/hour", HTTP_GET, [api](AsyncWebServerRequest* r) { httpapi_serve(api, r, HTTPAPI_HOUR); });
+  server->on("/history/day", HTTP_GET, [api](AsyncWebServerRequest* r) { httpapi_serve(api, r, HTTPAPI_DAY); });
+  server->on("/stats", HTTP_GET, [api](AsyncWebServerRequest* r) { httpapi_serve(api, r, HTTPAPI_STATS); });
+  server->on("/settle", HTTP_GET, [api](AsyncWebServerRequest* r) { httpapi_serve(api, r, HTTPAPI_SETTLE); });
+  server->on("/settle/tune", HTTP_POST, [api](AsyncWebServerRequest* r) {
+    api->settleTuneRequested = true;
+    r->send(202);
+  });
+  server->on("/history", HTTP_GET, [api](AsyncWebServerRequest* r) { httpapi_serve(api, r, HTTPAPI_HOUR); });
+  server->begin();
+}
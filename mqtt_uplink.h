@@ -0,0 +1,371 @@
+/**
+ * MQTT uplink for sweep records.
+ *
+ * Holds one long-lived broker connection over an ESPAsyncTCP client. A
+ * sweep goes out as a set of QoS-0 PUBLISH packets: the encoded frame on
+ * <prefix>/<node>/frame plus one decimal value per channel on
+ * <prefix>/<node>/ch/<n> (percent with one decimal when calibrated). The
+ * packets are built back to back in a buffer from the network arena and
+ * handed to the socket in a single write, so a whole sweep costs one TCP
+ * segment instead of one per topic. A sweep too wide to ever fit the TCP
+ * send buffer goes out as its frame alone, which carries every channel.
+ *
+ * Nothing on the way to a connection blocks. The DNS lookup and the TCP
+ * handshake run in lwIP, CONNECT is sent from the connect callback and
+ * CONNACK is picked up in the data callback. mqttuplink_service() only
+ * starts an attempt, times it out after MQTT_CONNECT_TIMEOUT_MS and sends
+ * PINGREQ for the keepalive. Reconnects are rate limited with exponential
+ * backoff, so a broker outage never stalls the scan loop.
+ *
+ * Broker, port and topic prefix are WiFiManager custom parameters and are
+ * kept in /mqtt.cfg.
+ */
+
+#pragma once
+
+#include <ESP8266WiFi.h>
+#include <ESPAsyncTCP.h>
+#include <LittleFS.h>
+#include <WiFiManager.h>
+#include <lwip/tcp.h>
+#include "config.h"
+#include "crc.h"
+#include "arena.h"
+#include "telemetry_log.h"
+#include "telemetry_frame.h"
+
+
+#define MQTT_CONFIG_PATH        "/mqtt.cfg"
+#define MQTT_HOST_MAX           (64)
+
+// The frame or text payload is held in the arena next to the pipeline
+static_assert(NET_ARENA_MQTT_BYTES <= NET_ARENA_BYTES, "NET_ARENA_BYTES is too small for one MQTT sweep");
+
+typedef enum mqttuplink_state {
+  MQTT_DOWN = 0,          //! Not connected, next attempt after the backoff
+  MQTT_CONNECTING,        //! DNS lookup and TCP handshake under way
+  MQTT_HANDSHAKE,         //! CONNECT sent, waiting for CONNACK
+  MQTT_UP                 //! Session accepted by the broker
+} mqttuplink_state_t;
+
+typedef struct mqttcfg {
+  char host[MQTT_HOST_MAX];                     //! Empty disables the uplink
+  char prefix[MQTT_PREFIX_MAX];
+  uint16_t port;
+  uint16_t reserved;
+  uint32_t crc;
+} mqttcfg_t;
+
+typedef struct mqttuplink {
+  mqttcfg_t config;
+  AsyncClient client;
+  char clientId[16];
+  volatile uint8_t state;                       //! mqttuplink_state_t, also moved by the TCP callbacks
+  volatile bool dropped;                        //! Lost or refused in a callback, back off
+  uint32_t stateStart_ms;                       //! millis() the current attempt started
+  uint32_t lastSend_ms;                         //! Last packet to the broker, for the keepalive
+  uint32_t nextAttempt_ms;
+  uint32_t backoff_ms;
+} mqttuplink_t;
+
+
+static inline uint32_t mqttcfg_crc(const mqttcfg_t* cfg) {
+  return crc32_compute(cfg, offsetof(mqttcfg_t, crc));
+}
+
+static inline void mqttcfg_defaults(mqttcfg_t* cfg) {
+  memset(cfg, 0, sizeof(*cfg));
+  strncpy(cfg->prefix, MQTT_DEFAULT_PREFIX, sizeof(cfg->prefix) - 1);
+  cfg->port = MQTT_DEFAULT_PORT;
+}
+
+static inline void mqttcfg_load(mqttcfg_t* cfg) {
+  File f = LittleFS.open(MQTT_CONFIG_PATH, "r");
+  const bool ok = f && f.read((uint8_t*)cfg, sizeof(*cfg)) == sizeof(*cfg)
+               && cfg->crc == mqttcfg_crc(cfg);
+  if (f) {
+    f.close();
+  }
+  if (!ok) {
+    mqttcfg_defaults(cfg);
+  }
+  cfg->host[sizeof(cfg->host) - 1] = '\0';
+  cfg->prefix[sizeof(cfg->prefix) - 1] = '\0';
+}
+
+static inline bool mqttcfg_save(mqttcfg_t* cfg) {
+  cfg->crc = mqttcfg_crc(cfg);
+  File f = LittleFS.open(MQTT_CONFIG_PATH, "w");
+  if (!f) {
+    return false;
+  }
+  const bool ok = f.write((const uint8_t*)cfg, sizeof(*cfg)) == sizeof(*cfg);
+  f.close();
+  return ok;
+}
+
+
+// ---------------------------------------------------------------------------
+// Raw QoS-0 PUBLISH packets for pipelining
+// ---------------------------------------------------------------------------
+
+/**
+ * Append one PUBLISH packet (QoS 0, not retained) to the pipeline buffer.
+ *
+ * @return new write position, or nullptr if it does not fit
+ */
+static inline uint8_t* mqtt_put_publish(uint8_t* p, const uint8_t* end, const char* topic,
+                                        const uint8_t* payload, size_t length) {
+  const size_t topicLength = strlen(topic);
+  uint32_t remaining = 2 + topicLength + length;
+
+  if (p == nullptr || (size_t)(end - p) < 1 + 4 + remaining) {
+    return nullptr;
+  }
+
+  *p++ = 0x30;                                  // PUBLISH, QoS 0
+  do {
+    uint8_t digit = remaining & 0x7F;
+    remaining >>= 7;
+    *p++ = remaining ? (digit | 0x80) : digit;
+  } while (remaining);
+
+  *p++ = (uint8_t)(topicLength >> 8);
+  *p++ = (uint8_t)topicLength;
+  memcpy(p, topic, topicLength);
+  p += topicLength;
+  memcpy(p, payload, length);
+  return p + length;
+}
+
+
+/**
+ * Write a CONNECT packet (MQTT 3.1.1, clean session, no credentials)
+ *
+ * @param p  at least 14 bytes plus the client id
+ * @return packet length
+ */
+static inline size_t mqtt_put_connect(uint8_t* p, const char* clientId, uint16_t keepalive_s) {
+  static const uint8_t header[] = { 0x00, 0x04, 'M', 'Q', 'T', 'T', 0x04, 0x02 };
+  const size_t idLength = strlen(clientId);
+  uint8_t* start = p;
+
+  *p++ = 0x10;                                  // CONNECT
+  *p++ = (uint8_t)(sizeof(header) + 4 + idLength);
+  memcpy(p, header, sizeof(header));
+  p += sizeof(header);
+  *p++ = (uint8_t)(keepalive_s >> 8);
+  *p++ = (uint8_t)keepalive_s;
+  *p++ = (uint8_t)(idLength >> 8);
+  *p++ = (uint8_t)idLength;
+  memcpy(p, clientId, idLength);
+  return p + idLength - start;
+}
+
+
+// ---------------------------------------------------------------------------
+// Connection
+// ---------------------------------------------------------------------------
+
+static inline void mqttuplink_backoff(mqttuplink_t* up, uint32_t now_ms) {
+  up->nextAttempt_ms = now_ms + up->backoff_ms;
+  up->backoff_ms = (up->backoff_ms >= MQTT_BACKOFF_MAX_MS / 2) ? MQTT_BACKOFF_MAX_MS : up->backoff_ms * 2;
+}
+
+/**
+ * TCP is up: start the MQTT session
+ */
+static inline void mqttuplink_on_connect(mqttuplink_t* up) {
+  uint8_t packet[14 + sizeof(up->clientId)];
+  const size_t length = mqtt_put_connect(packet, up->clientId, MQTT_KEEPALIVE_S);
+  up->client.setNoDelay(true);
+  if (up->client.add((const char*)packet, length) != length || !up->client.send()) {
+    up->client.close(true);
+    return;
+  }
+  up->state = MQTT_HANDSHAKE;
+  up->lastSend_ms = millis();
+}
+
+static inline void mqttuplink_on_data(mqttuplink_t* up, const uint8_t* data, size_t length) {
+  if (up->state != MQTT_HANDSHAKE) {
+    return;                                     // PINGRESP, nothing else is subscribed
+  }
+  // CONNACK with return code 0; anything else is a refusal
+  if (length >= 4 && data[0] == 0x20 && data[1] == 0x02 && data[3] == 0x00) {
+    up->state = MQTT_UP;
+    up->backoff_ms = MQTT_BACKOFF_MIN_MS;
+  } else {
+    up->client.close(true);
+  }
+}
+
+static inline void mqttuplink_on_drop(mqttuplink_t* up) {
+  if (up->state != MQTT_DOWN) {
+    up->state = MQTT_DOWN;
+    up->dropped = true;
+  }
+}
+
+static inline void mqttuplink_init(mqttuplink_t* up) {
+  mqttcfg_load(&up->config);
+  snprintf(up->clientId, sizeof(up->clientId), "plant-%08x", ESP.getChipId());
+  up->client.onConnect([](void* arg, AsyncClient*) { mqttuplink_on_connect((mqttuplink_t*)arg); }, up);
+  up->client.onData([](void* arg, AsyncClient*, void* data, size_t length) {
+    mqttuplink_on_data((mqttuplink_t*)arg, (const uint8_t*)data, length);
+  }, up);
+  up->client.onDisconnect([](void* arg, AsyncClient*) { mqttuplink_on_drop((mqttuplink_t*)arg); }, up);
+  up->client.onError([](void* arg, AsyncClient*, int8_t) { mqttuplink_on_drop((mqttuplink_t*)arg); }, up);
+  up->state = MQTT_DOWN;
+  up->dropped = false;
+  up->nextAttempt_ms = millis();
+  up->backoff_ms = MQTT_BACKOFF_MIN_MS;
+}
+
+static inline bool mqttuplink_connected(mqttuplink_t* up) {
+  return up->state == MQTT_UP;
+}
+
+/**
+ * Keep the broker connection alive; start a reconnect when the backoff
+ * allows. Returns right away in every state.
+ */
+static inline void mqttuplink_service(mqttuplink_t* up) {
+  const uint32_t now = millis();
+  if (up->dropped) {
+    up->dropped = false;
+    mqttuplink_backoff(up, now);
+  }
+
+  switch (up->state) {
+    case MQTT_UP:
+      if (now - up->lastSend_ms >= MQTT_KEEPALIVE_S * 1000UL / 2 && up->client.space() >= 2) {
+        static const char pingreq[] = { (char)0xC0, 0x00 };
+        up->client.add(pingreq, sizeof(pingreq));
+        up->client.send();
+        up->lastSend_ms = now;
+      }
+      break;
+
+    case MQTT_CONNECTING:
+    case MQTT_HANDSHAKE:
+      if (now - up->stateStart_ms >= MQTT_CONNECT_TIMEOUT_MS) {
+        up->state = MQTT_DOWN;
+        up->client.close(true);
+        mqttuplink_backoff(up, now);
+      }
+      break;
+
+    default:
+      if (up->config.host[0] == '\0' || WiFi.status() != WL_CONNECTED
+          || (int32_t)(now - up->nextAttempt_ms) < 0) {
+        break;
+      }
+      // Returns once the lookup or SYN is under way; the callbacks take it from there
+      up->state = MQTT_CONNECTING;
+      up->stateStart_ms = now;
+      if (!up->client.connect(up->config.host, up->config.port)) {
+        up->state = MQTT_DOWN;
+        mqttuplink_backoff(up, now);
+      }
+      break;
+  }
+}
+
+/**
+ * Publish one sweep - its encoded frame plus a value per channel, or the
+ * fault bits under ch/<n>/fault for a faulty one - in a single socket
+ * write. Topics are under nodeId, which on an ESP-NOW gateway is the leaf
+ * the sweep came from.
+ *
+ * @return false if nothing was sent; the record should stay queued
+ */
+static inline bool mqttuplink_publish(mqttuplink_t* up, uint32_t nodeId, const tlog_record_t* record,
+                                      const uint8_t* frame, size_t frameLength) {
+  char topic[MQTT_TOPIC_MAX];
+  char value[MQTT_VALUE_MAX];
+
+  if (up->state != MQTT_UP) {
+    return false;
+  }
+  const size_t mark = arena_mark(&netArena);
+  uint8_t* pipeline = (uint8_t*)arena_alloc(&netArena, MQTT_PIPELINE_BYTES);
+  if (pipeline == nullptr) {
+    return false;
+  }
+  const uint8_t* end = pipeline + MQTT_PIPELINE_BYTES;
+
+  snprintf(topic, sizeof(topic), "%s/%08x/frame", up->config.prefix, nodeId);
+  uint8_t* p = mqtt_put_publish(pipeline, end, topic, frame, frameLength);
+  const size_t frameBytes = p ? p - pipeline : 0;
+
+  for (uint8_t ch = 0; ch < TLOG_CHANNELS; ch++) {
+    if (record->channelMask & chmask_bit(ch)) {
+      snprintf(topic, sizeof(topic), "%s/%08x/ch/%u", up->config.prefix, nodeId, ch);
+      const uint16_t v = record->readings[ch];
+      const int n = (record->flags & TLOG_FLAG_CALIBRATED)
+                  ? snprintf(value, sizeof(value), "%u.%u", v / 10, v % 10)
+                  : snprintf(value, sizeof(value), "%u", v);
+      p = mqtt_put_publish(p, end, topic, (const uint8_t*)value, n);
+    }
+  }
+  const chmask_t faults = tlog_record_faults(record);
+  for (uint8_t ch = 0; ch < TLOG_CHANNELS; ch++) {
+    if (faults & chmask_bit(ch)) {
+      snprintf(topic, sizeof(topic), "%s/%08x/ch/%u/fault", up->config.prefix, nodeId, ch);
+      const int n = snprintf(value, sizeof(value), "%u", record->readings[ch]);
+      p = mqtt_put_publish(p, end, topic, (const uint8_t*)value, n);
+    }
+  }
+
+  // A sweep that fits the send buffer waits for room rather than going out
+  // split; one that never fits goes as its frame alone
+  const size_t length = (p && (size_t)(p - pipeline) <= TCP_SND_BUF) ? p - pipeline : frameBytes;
+  const bool sent = length > 0 && length <= up->client.space()
+                 && up->client.add((const char*)pipeline, length) == length && up->client.send();
+  arena_release(&netArena, mark);
+  if (sent) {
+    up->lastSend_ms = millis();
+  }
+  return sent;
+}
+
+
+// ---------------------------------------------------------------------------
+// WiFiManager parameters
+// ---------------------------------------------------------------------------
+
+static char mqttPortText[6];
+static WiFiManagerParameter mqttHostParam("mqtt_host", "MQTT broker", "", MQTT_HOST_MAX - 1);
+static WiFiManagerParameter mqttPortParam("mqtt_port", "MQTT port", "", 5);
+static WiFiManagerParameter mqttPrefixParam("mqtt_prefix", "MQTT topic prefix", "", MQTT_PREFIX_MAX - 1);
+
+/**
+ * Register the broker settings on the portal, prefilled with current values
+ */
+static inline void mqttuplink_add_params(mqttuplink_t* up, WiFiManager* wm) {
+  snprintf(mqttPortText, sizeof(mqttPortText), "%u", up->config.port);
+  mqttHostParam.setValue(up->config.host, MQTT_HOST_MAX - 1);
+  mqttPortParam.setValue(mqttPortText, 5);
+  mqttPrefixParam.setValue(up->config.prefix, MQTT_PREFIX_MAX - 1);
+  wm->addParameter(&mqttHostParam);
+  wm->addParameter(&mqttPortParam);
+  wm->addParameter(&mqttPrefixParam);
+}
+
+/**
+ * Pull the portal values back in, persist them and reconnect
+ */
+static inline void mqttuplink_params_saved(mqttuplink_t* up) {
+  strncpy(up->config.host, mqttHostParam.getValue(), sizeof(up->config.host) - 1);
+  strncpy(up->config.prefix, mqttPrefixParam.getValue(), sizeof(up->config.prefix) - 1);
+  const long port = strtol(mqttPortParam.getValue(), nullptr, 10);
+  up->config.port = (port > 0 && port <= 65535) ? (uint16_t)port : MQTT_DEFAULT_PORT;
+  mqttcfg_save(&up->config);
+
+  up->state = MQTT_DOWN;
+  up->client.close(true);
+  up->dropped = false;
+  up->nextAttempt_ms = millis();
+  up->backoff_ms = MQTT_BACKOFF_MIN_MS;
+}
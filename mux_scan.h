@@ -0,0 +1,335 @@
+/**
+ * Cooperative scanner for one or more CD74HC4051 analog multiplexers.
+ *
+ * A sweep walks all MUX_CHANNEL_COUNT channels as a small state machine:
+ *
+ *   WARMUP -> SELECT -> SETTLE -> SAMPLE -> (next channel) ... -> DONE
+ *
+ * Each call to muxscan_service() advances at most one step and returns right
+ * away, so the WiFi stack, WiFiManager and button handling keep running
+ * between channels. Nothing in here calls delay().
+ *
+ * Channels are visited in Gray-code order so only one select line toggles
+ * per step (including the wrap from the last channel back to the first).
+ * The 4051 therefore never passes through an unrelated channel on the way,
+ * which keeps the settle time short. Select lines are written through the
+ * GPIO set/clear registers in one go rather than three digitalWrite() calls.
+ *
+ * With several muxes (MUX_COUNT banks of MUX_CHANNELS_PER_MUX channels on
+ * shared select lines, see muxarray) every other bank is walked with the
+ * Gray sequence reversed. The step into the next bank then only changes
+ * the bank lines, and the select lines stay where they are. Channel n is
+ * channel n % MUX_CHANNELS_PER_MUX of mux n / MUX_CHANNELS_PER_MUX. The
+ * scan order, buffers and masks (chmask_t) are all sized at compile time,
+ * and a sweep costs the same per channel at any size.
+ *
+ * The sensor rail is switched on at the start of a sweep, given
+ * SENSOR_WARMUP_MS before the first sample, and switched off as soon as
+ * the last channel is read.
+ *
+ * The settle wait is per channel (settle_us[]). It starts at MUX_SETTLE_US
+ * and is normally replaced by measured values, see settle_tune.h.
+ *
+ * A sweep can leave channels out (see muxscan_start()). Channels that are
+ * left out keep their previous reading. The battery channel is never
+ * mirrored for probe polarity, because its divider does not reverse.
+ *
+ * Pins come from the selected Board in board.h.
+ */
+
+#pragma once
+
+#include "hal.h"
+#include "config.h"
+#include "board.h"
+#include "adc_filter.h"
+#include "sensor_power.h"
+#include "stats.h"
+#include "channel_mask.h"
+
+
+typedef enum muxscan_state {
+  MUXSCAN_IDLE = 0,       //! No sweep in progress
+  MUXSCAN_WARMUP,         //! Sensor rail up, waiting for it to settle
+  MUXSCAN_SELECT,         //! Drive select lines for the current channel
+  MUXSCAN_SETTLE,         //! Waiting for the mux / buffer to settle
+  MUXSCAN_SAMPLE,         //! Take an oversampled ADC burst for the current channel
+  MUXSCAN_DONE            //! Sweep finished, readings are valid
+} muxscan_state_t;
+
+typedef struct muxscan {
+  muxscan_state_t state;
+  uint8_t step;                                 //! Index into MUXSCAN_ORDER being handled
+  bool reversed;                                //! Excitation polarity of the current sweep
+  uint32_t warmupStart_ms;                      //! millis() when the sensor rail came up
+  uint32_t sweepStart_us;
+  uint32_t settleStart_us;                      //! micros() when the select lines last changed
+  chmask_t skipMask;                            //! Channels left out of this sweep
+  chmask_t sampledMask;                         //! Channels read by the last completed sweep
+  uint32_t sweepCount;                          //! Completed sweeps since boot
+  uint16_t readings[MUX_CHANNEL_COUNT];         //! Last completed value per channel (ADC_RESULT_BITS)
+  uint16_t settle_us[MUX_CHANNEL_COUNT];        //! Wait after selecting each channel
+} muxscan_t;
+
+
+/**
+ * Select-line driver for a board. All masks are compile-time constants.
+ */
+template <class B>
+struct muxselect {
+  static_assert(B::muxSelect0 < 16 && B::muxSelect1 < 16 && B::muxSelect2 < 16,
+                "mux select lines must be on GPIO0-15 to be driven through GPOS/GPOC");
+
+  static constexpr uint32_t S0 = 1UL << B::muxSelect0;
+  static constexpr uint32_t S1 = 1UL << B::muxSelect1;
+  static constexpr uint32_t S2 = 1UL << B::muxSelect2;
+  static constexpr uint32_t MASK = S0 | S1 | S2;
+
+  /**
+   * GPIO output bits that must be high to address a mux channel
+   */
+  static constexpr uint32_t set_mask(uint8_t channel) {
+    return ((channel & 0x01) ? S0 : 0) | ((channel & 0x02) ? S1 : 0) | ((channel & 0x04) ? S2 : 0);
+  }
+
+  static inline void init(void) {
+    hal_pin_output(B::muxSelect0);
+    hal_pin_output(B::muxSelect1);
+    hal_pin_output(B::muxSelect2);
+    write(0);
+  }
+
+  /**
+   * Drive the three select lines to address a mux channel.
+   *
+   * Clear goes first; when stepping in Gray order only one of the two
+   * registers actually changes a pin, so there is no intermediate address.
+   */
+  static inline void write(uint8_t channel) {
+    const uint32_t set = set_mask(channel);
+    hal_gpio_clear(MASK & ~set);
+    hal_gpio_set(set);
+  }
+};
+
+/**
+ * Bank-line driver: picks one mux out of Muxes. Compiles to nothing for a
+ * single mux.
+ */
+template <class B, uint8_t Muxes>
+struct muxbank {
+  static constexpr uint8_t LINES = (Muxes == 1) ? 0 : B::muxBankEnable ? Muxes
+                                 : (Muxes > 4) ? 3 : (Muxes > 2) ? 2 : 1;
+
+  static_assert(Muxes >= 1 && Muxes <= 8, "1 to 8 muxes are supported");
+  static_assert(LINES <= 3, "enable mode has one bank line per mux, and there are three");
+  static_assert(LINES < 1 || B::muxBank0 != PIN_NONE, "board has no bank line 0 for this many muxes");
+  static_assert(LINES < 2 || B::muxBank1 != PIN_NONE, "board has no bank line 1 for this many muxes");
+  static_assert(LINES < 3 || B::muxBank2 != PIN_NONE, "board has no bank line 2 for this many muxes");
+
+  template <uint8_t Pin>
+  static inline void line_init(void) {
+    if constexpr (Pin != PIN_NONE) {
+      gpio_out<Pin>::init(B::muxBankEnable);    // INH high keeps every mux off
+    }
+  }
+
+  template <uint8_t Pin>
+  static inline void line_write(bool high) {
+    if constexpr (Pin != PIN_NONE) {
+      gpio_out<Pin>::write(high);
+    }
+  }
+
+  template <uint8_t Pin>
+  static inline void line_inhibit(bool inhibit) {
+    if (inhibit) {
+      line_write<Pin>(true);
+    }
+  }
+
+  static inline void init(void) {
+    if constexpr (LINES > 0) {
+      line_init<B::muxBank0>();
+      line_init<B::muxBank1>();
+      line_init<B::muxBank2>();
+      write(0);
+    }
+  }
+
+  /**
+   * Enable one mux. In enable mode the old one is inhibited before the
+   * new one comes on, so two outputs never drive A0 at once.
+   */
+  static inline void write(uint8_t bank) {
+    if constexpr (LINES == 0) {
+      (void)bank;
+    } else if constexpr (B::muxBankEnable) {
+      line_inhibit<B::muxBank0>(bank != 0);
+      line_inhibit<B::muxBank1>(bank != 1);
+      line_inhibit<B::muxBank2>(bank != 2);
+      line_write<B::muxBank0>(bank != 0);
+      line_write<B::muxBank1>(bank != 1);
+      line_write<B::muxBank2>(bank != 2);
+    } else {
+      line_write<B::muxBank0>(bank & 0x01);
+      line_write<B::muxBank1>(bank & 0x02);
+      line_write<B::muxBank2>(bank & 0x04);
+    }
+  }
+};
+
+/**
+ * Gray-code sweep order over Muxes banks of PerMux channels, reversed on
+ * every other bank. Built at compile time.
+ */
+template <uint8_t Muxes, uint8_t PerMux>
+struct muxscan_order {
+  uint8_t channel[Muxes * PerMux];
+
+  constexpr muxscan_order() : channel() {
+    for (uint8_t step = 0; step < Muxes * PerMux; step++) {
+      const uint8_t bank = step / PerMux;
+      const uint8_t pos = (bank & 1) ? PerMux - 1 - step % PerMux : step % PerMux;
+      channel[step] = (uint8_t)(bank * PerMux + (pos ^ (pos >> 1)));
+    }
+  }
+};
+
+/**
+ * All muxes on the board as one channel space
+ */
+template <class B, uint8_t Muxes, uint8_t PerMux>
+struct muxarray {
+  static_assert(PerMux == 1 || PerMux == 2 || PerMux == 4 || PerMux == 8,
+                "channels per mux must be a power of two for the Gray order");
+
+  static constexpr uint8_t CHANNELS = Muxes * PerMux;
+  static constexpr muxscan_order<Muxes, PerMux> ORDER = {};
+
+  static inline void init(void) {
+    muxselect<B>::init();
+    muxbank<B, Muxes>::init();
+  }
+
+  /**
+   * Address a channel: bank lines first, then the select lines
+   */
+  static inline void write(uint8_t channel) {
+    muxbank<B, Muxes>::write(channel / PerMux);
+    muxselect<B>::write(channel % PerMux);
+  }
+};
+
+typedef muxarray<Board, MUX_COUNT, MUX_CHANNELS_PER_MUX> MuxArray;
+
+/**
+ * Sweep order, indexed by step. Within a bank consecutive entries differ
+ * in one select bit; between banks only the bank lines change.
+ */
+#define MUXSCAN_ORDER           (MuxArray::ORDER.channel)
+
+/**
+ * Configure the select lines and reset scanner state
+ */
+static inline void muxscan_init(muxscan_t* scan) {
+  sensorpower<Board>::init();
+  MuxArray::init();
+
+  memset(scan, 0, sizeof(*scan));
+  for (uint8_t ch = 0; ch < MUX_CHANNEL_COUNT; ch++) {
+    scan->settle_us[ch] = MUX_SETTLE_US;
+  }
+  scan->state = MUXSCAN_IDLE;
+}
+
+/**
+ * Begin a new sweep. Ignored if one is already running.
+ *
+ * @param skipMask  bit n set to leave channel n out of this sweep
+ */
+static inline void muxscan_start(muxscan_t* scan, chmask_t skipMask) {
+  if (scan->state != MUXSCAN_IDLE && scan->state != MUXSCAN_DONE) {
+    return;
+  }
+  scan->step = 0;
+  scan->skipMask = skipMask;
+  scan->reversed = sensorpower<Board>::reversed_for(scan->sweepCount);
+  sensorpower<Board>::on(scan->reversed);
+  scan->warmupStart_ms = hal_millis();
+  scan->sweepStart_us = hal_micros();
+  scan->state = MUXSCAN_WARMUP;
+}
+
+/**
+ * True while a sweep is in progress
+ */
+static inline bool muxscan_busy(const muxscan_t* scan) {
+  return scan->state != MUXSCAN_IDLE && scan->state != MUXSCAN_DONE;
+}
+
+/**
+ * Move step past channels left out of the sweep
+ *
+ * @return false once there is nothing left to read
+ */
+static inline bool muxscan_skip(muxscan_t* scan) {
+  while (scan->step < MUX_CHANNEL_COUNT && (scan->skipMask & chmask_bit(MUXSCAN_ORDER[scan->step]))) {
+    scan->step++;
+  }
+  return scan->step < MUX_CHANNEL_COUNT;
+}
+
+/**
+ * Advance the sweep by one step.
+ *
+ * @return true exactly once per sweep, on the call that completes it
+ */
+static inline bool muxscan_service(muxscan_t* scan) {
+  switch (scan->state) {
+    case MUXSCAN_WARMUP:
+      if ((uint32_t)(hal_millis() - scan->warmupStart_ms) >= SENSOR_WARMUP_MS) {
+        scan->state = MUXSCAN_SELECT;
+      }
+      break;
+
+    case MUXSCAN_SELECT:
+      if (!muxscan_skip(scan)) {
+        sensorpower<Board>::off();
+        stats_record_us(STAGE_SWEEP, hal_micros() - scan->sweepStart_us);
+        scan->sampledMask = (chmask_t)(CHMASK_ALL & ~scan->skipMask);
+        scan->sweepCount++;
+        scan->state = MUXSCAN_DONE;
+        return true;
+      }
+      MuxArray::write(MUXSCAN_ORDER[scan->step]);
+      scan->settleStart_us = hal_micros();
+      scan->state = MUXSCAN_SETTLE;
+      break;
+
+    case MUXSCAN_SETTLE:
+      if ((uint32_t)(hal_micros() - scan->settleStart_us) >= scan->settle_us[MUXSCAN_ORDER[scan->step]]) {
+        scan->state = MUXSCAN_SAMPLE;
+      }
+      break;
+
+    case MUXSCAN_SAMPLE: {
+      stats_record_us(STAGE_MUX_SETTLE, hal_micros() - scan->settleStart_us);
+      const uint8_t ch = MUXSCAN_ORDER[scan->step];
+      const uint32_t burstStart = stats_cycles_begin();
+      scan->readings[ch] = sensorpower<Board>::correct(adcfilter_burst(Board::moistureAdc),
+                                                       scan->reversed && ch != Board::batteryMuxChannel);
+      stats_cycles_end(STAGE_ADC_BURST, burstStart);
+
+      scan->step++;
+      scan->state = MUXSCAN_SELECT;
+      break;
+    }
+
+    case MUXSCAN_IDLE:
+    case MUXSCAN_DONE:
+    default:
+      break;
+  }
+  return false;
+}
@@ -0,0 +1,343 @@
+/**
+ * Over-the-air firmware updates.
+ *
+ * Two routes, both ending in the core's Updater and eboot:
+ *
+ *   LAN   ArduinoOTA, for pushing an image from the IDE / espota.py. Only
+ *         in always-on mode, since a duty-cycled node is asleep almost all
+ *         the time.
+ *   Pull  an HTTP GET to OTA_UPDATE_HOST once per radio session (and every
+ *         OTA_CHECK_INTERVAL_S while always on). The request carries the
+ *         same x-ESP8266-* headers as ESP8266httpUpdate, so existing update
+ *         servers work unchanged: 304 means up to date, 200 carries the
+ *         image with its MD5 in x-MD5.
+ *
+ * The pull never blocks the loop. It runs on an ESPAsyncTCP client, so the
+ * DNS lookup and the TCP handshake happen in lwIP and ota_service() only
+ * sends the request once the connect callback has fired. Received data is
+ * copied into a buffer the size of the TCP window and acknowledged only
+ * as it is used, which keeps the server from sending more than fits.
+ * Response headers are parsed a byte at a time, and the body is written to
+ * flash at most OTA_CHUNK_BYTES per ota_service() call, so sweeps keep
+ * running while it downloads. An image without an MD5 header is refused.
+ * The Updater checks the hash over the bytes written before the image is
+ * marked for eboot.
+ *
+ * The server may send the image gzip-compressed (.bin.gz). The Updater
+ * recognises the gzip header and eboot inflates it while copying, which
+ * roughly halves the time on air.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <ESPAsyncTCP.h>
+#include <Updater.h>
+#include <lwip/tcp.h>
+#if !DUTY_CYCLE_MODE
+#include <ArduinoOTA.h>
+#endif
+#include "config.h"
+#include "arena.h"
+
+
+#define OTA_LINE_MAX            (96)
+#define OTA_MD5_CHARS           (32)
+#define OTA_RX_BYTES            (TCP_WND)         //! Unacknowledged data never exceeds the window
+
+static_assert(OTA_REQUEST_MAX <= NET_ARENA_BYTES, "NET_ARENA_BYTES is too small for the OTA request");
+
+typedef enum ota_state {
+  OTA_IDLE = 0,                                 //! Nothing in flight
+  OTA_CONNECTING,                               //! DNS lookup and TCP handshake under way
+  OTA_HEADERS,                                  //! Request sent, reading response headers
+  OTA_DOWNLOAD,                                 //! Streaming the image to flash
+  OTA_DONE,                                     //! Image verified, restart to apply
+  OTA_FAILED                                    //! Gave up; cleared by the next check
+} ota_state_t;
+
+typedef struct ota {
+  ota_state_t state;
+  AsyncClient client;
+  volatile bool connected;                      //! Set by the connect callback
+  volatile bool closed;                         //! Set on disconnect or error
+  volatile bool overrun;                        //! Server sent past the window
+  volatile uint16_t rxLength;                   //! Bytes waiting in rx
+  uint8_t rx[OTA_RX_BYTES];
+  uint16_t status;                              //! HTTP status of the response
+  uint32_t size;                                //! Content-Length
+  uint32_t received;
+  uint32_t lastActivity_ms;
+  uint32_t lastCheck_ms;
+  char md5[OTA_MD5_CHARS + 1];
+  char line[OTA_LINE_MAX + 1];
+  uint8_t lineLength;
+} ota_t;
+
+
+static inline bool ota_enabled(void) {
+  return OTA_UPDATE_HOST[0] != '\0';
+}
+
+/**
+ * True while a pull is in progress (the node must not sleep)
+ */
+static inline bool ota_busy(const ota_t* ota) {
+  return ota->state == OTA_CONNECTING || ota->state == OTA_HEADERS || ota->state == OTA_DOWNLOAD;
+}
+
+static inline void ota_close(ota_t* ota) {
+  ota->client.close(true);
+  ota->rxLength = 0;
+}
+
+static inline void ota_fail(ota_t* ota) {
+  if (ota->state == OTA_DOWNLOAD) {
+    Update.end(false);
+  }
+  ota_close(ota);
+  ota->state = OTA_FAILED;
+}
+
+/**
+ * Data callback. Runs in the lwIP context between loop passes, never in
+ * the middle of one. The window is only reopened by ota_consume().
+ */
+static inline void ota_on_data(ota_t* ota, const uint8_t* data, size_t length) {
+  ota->client.ackLater();
+  const size_t room = OTA_RX_BYTES - ota->rxLength;
+  if (length > room) {
+    ota->overrun = true;
+    length = room;
+  }
+  memcpy(ota->rx + ota->rxLength, data, length);
+  ota->rxLength += length;
+}
+
+/**
+ * Drop used bytes from the front of rx and let the server send as many more
+ */
+static inline void ota_consume(ota_t* ota, size_t used) {
+  if (used == 0) {
+    return;
+  }
+  memmove(ota->rx, ota->rx + used, ota->rxLength - used);
+  ota->rxLength -= used;
+  ota->client.ack(used);
+  ota->lastActivity_ms = millis();
+}
+
+static inline void ota_init(ota_t* ota) {
+  ota->client.onConnect([](void* arg, AsyncClient*) { ((ota_t*)arg)->connected = true; }, ota);
+  ota->client.onData([](void* arg, AsyncClient*, void* data, size_t length) {
+    ota_on_data((ota_t*)arg, (const uint8_t*)data, length);
+  }, ota);
+  ota->client.onDisconnect([](void* arg, AsyncClient*) { ((ota_t*)arg)->closed = true; }, ota);
+  ota->client.onError([](void* arg, AsyncClient*, int8_t) { ((ota_t*)arg)->closed = true; }, ota);
+  ota->state = OTA_IDLE;
+}
+
+/**
+ * Ask the update server for a newer image. Needs the link up. Only starts
+ * the connection; ota_service() sends the request once it is up.
+ */
+static inline void ota_check(ota_t* ota) {
+  if (!ota_enabled() || ota_busy(ota) || WiFi.status() != WL_CONNECTED) {
+    return;
+  }
+  ota->lastCheck_ms = millis();
+  ota->lastActivity_ms = ota->lastCheck_ms;
+  ota->connected = false;
+  ota->closed = false;
+  ota->overrun = false;
+  ota->rxLength = 0;
+  if (!ota->client.connect(OTA_UPDATE_HOST, OTA_UPDATE_PORT)) {
+    ota->state = OTA_FAILED;
+    return;
+  }
+  ota->state = OTA_CONNECTING;
+}
+
+/**
+ * Connected: send the GET
+ */
+static inline void ota_request(ota_t* ota) {
+  // Print::printf() would malloc a request this long; build it in the
+  // arena instead. The sketch MD5 only exists as a String, so it is
+  // copied out once.
+  static char sketchMd5[OTA_MD5_CHARS + 1];
+  if (sketchMd5[0] == '\0') {
+    strncpy(sketchMd5, ESP.getSketchMD5().c_str(), OTA_MD5_CHARS);
+  }
+  uint8_t mac[6];
+  WiFi.macAddress(mac);
+
+  const size_t mark = arena_mark(&netArena);
+  char* request = (char*)arena_alloc(&netArena, OTA_REQUEST_MAX);
+  const int length = request == nullptr ? 0 : snprintf(request, OTA_REQUEST_MAX,
+                     "GET %s HTTP/1.0\r\n"
+                     "Host: %s\r\n"
+                     "User-Agent: ESP8266-http-Update\r\n"
+                     "x-ESP8266-mode: sketch\r\n"
+                     "x-ESP8266-version: %s\r\n"
+                     "x-ESP8266-STA-MAC: %02X:%02X:%02X:%02X:%02X:%02X\r\n"
+                     "x-ESP8266-sketch-md5: %s\r\n"
+                     "x-ESP8266-free-space: %u\r\n"
+                     "\r\n",
+                     OTA_UPDATE_PATH, OTA_UPDATE_HOST, FIRMWARE_VERSION,
+                     mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], sketchMd5, ESP.getFreeSketchSpace());
+  const bool sent = length > 0 && length < OTA_REQUEST_MAX && ota->client.space() >= (size_t)length
+                 && ota->client.add(request, length) == (size_t)length && ota->client.send();
+  arena_release(&netArena, mark);
+  if (!sent) {
+    ota_close(ota);
+    ota->state = OTA_FAILED;
+    return;
+  }
+
+  ota->status = 0;
+  ota->size = 0;
+  ota->received = 0;
+  ota->md5[0] = '\0';
+  ota->lineLength = 0;
+  ota->lastActivity_ms = millis();
+  ota->state = OTA_HEADERS;
+}
+
+/**
+ * Handle one complete header line. An empty line ends the headers.
+ */
+static inline void ota_header(ota_t* ota, const char* line) {
+  if (ota->status == 0) {
+    // Status line, "HTTP/1.x nnn ..."
+    const char* code = strchr(line, ' ');
+    ota->status = code ? (uint16_t)atoi(code + 1) : 0;
+    if (ota->status == 0) {
+      ota_fail(ota);
+    }
+    return;
+  }
+
+  if (line[0] != '\0') {
+    if (strncasecmp(line, "Content-Length:", 15) == 0) {
+      ota->size = strtoul(line + 15, nullptr, 10);
+    } else if (strncasecmp(line, "x-MD5:", 6) == 0) {
+      const char* md5 = line + 6;
+      while (*md5 == ' ') {
+        md5++;
+      }
+      strncpy(ota->md5, md5, OTA_MD5_CHARS);
+      ota->md5[OTA_MD5_CHARS] = '\0';
+    }
+    return;
+  }
+
+  if (ota->status == 304) {
+    // Up to date
+    ota_close(ota);
+    ota->state = OTA_IDLE;
+    return;
+  }
+  if (ota->status != 200 || ota->size == 0 || strlen(ota->md5) != OTA_MD5_CHARS
+      || !Update.begin(ota->size) || !Update.setMD5(ota->md5)) {
+    Update.end(false);
+    ota_close(ota);
+    ota->state = OTA_FAILED;
+    return;
+  }
+  ota->state = OTA_DOWNLOAD;
+}
+
+/**
+ * Advance a pull by at most one chunk. Call from loop().
+ *
+ * @return true once the image is verified and the node should restart
+ */
+static inline bool ota_service(ota_t* ota) {
+#if !DUTY_CYCLE_MODE
+  ArduinoOTA.handle();
+#endif
+
+  if (!ota_busy(ota)) {
+    return ota->state == OTA_DONE;
+  }
+  if ((uint32_t)(millis() - ota->lastActivity_ms) >= OTA_STALL_TIMEOUT_MS || ota->overrun
+      || (ota->closed && ota->rxLength == 0)) {
+    ota_fail(ota);
+    return false;
+  }
+
+  if (ota->state == OTA_CONNECTING) {
+    if (ota->connected) {
+      ota_request(ota);
+    }
+    return false;
+  }
+
+  if (ota->state == OTA_HEADERS) {
+    size_t used = 0;
+    while (ota->state == OTA_HEADERS && used < ota->rxLength) {
+      const char c = (char)ota->rx[used++];
+      if (c == '\r') {
+        continue;
+      }
+      if (c != '\n') {
+        if (ota->lineLength < OTA_LINE_MAX) {
+          ota->line[ota->lineLength++] = c;
+        }
+        continue;
+      }
+      ota->line[ota->lineLength] = '\0';
+      ota->lineLength = 0;
+      ota_header(ota, ota->line);
+    }
+    // A failed or finished header block has already closed and emptied rx
+    if (ota->state == OTA_HEADERS || ota->state == OTA_DOWNLOAD) {
+      ota_consume(ota, used);
+    }
+    return false;
+  }
+
+  if (ota->rxLength == 0) {
+    return false;
+  }
+  const size_t want = min((size_t)ota->rxLength, min((size_t)OTA_CHUNK_BYTES, (size_t)(ota->size - ota->received)));
+  if (Update.write(ota->rx, want) != want) {
+    ota_fail(ota);
+    return false;
+  }
+  ota->received += want;
+  ota_consume(ota, want);
+
+  if (ota->received < ota->size) {
+    return false;
+  }
+  ota_close(ota);
+  // end() checks the MD5 and marks the image for eboot
+  ota->state = Update.end() ? OTA_DONE : OTA_FAILED;
+  return ota->state == OTA_DONE;
+}
+
+/**
+ * Pull check due in always-on mode
+ */
+static inline bool ota_check_due(const ota_t* ota) {
+  return !ota_busy(ota) && ota->state != OTA_DONE
+      && (ota->lastCheck_ms == 0 || (uint32_t)(millis() - ota->lastCheck_ms) >= OTA_CHECK_INTERVAL_S * 1000UL);
+}
+
+#if !DUTY_CYCLE_MODE
+/**
+ * Start the LAN listener. Call once the station is up.
+ */
+static inline void ota_lan_begin(void) {
+  char hostname[24];
+  snprintf(hostname, sizeof(hostname), "plant-%08x", ESP.getChipId());
+  ArduinoOTA.setHostname(hostname);
+  if (OTA_LAN_PASSWORD[0] != '\0') {
+    ArduinoOTA.setPassword(OTA_LAN_PASSWORD);
+  }
+  ArduinoOTA.begin();
+}
+#endif
@@ -0,0 +1,67 @@
+/**
+ * Non-blocking WiFiManager config portal.
+ *
+ * The portal runs with setConfigPortalBlocking(false) and is pumped from
+ * loop() through portal_service(), so sweeps, logging and the LED keep
+ * going while it is open. It is only opened on demand: a long press of
+ * the reset button, a node with no saved credentials, or
+ * WIFI_PORTAL_AFTER_FAILURES wakes in a row that could not associate.
+ * Without that last condition a node would open its access point every
+ * time the AP is briefly down.
+ *
+ * An open portal gives up after WIFI_PORTAL_TIMEOUT_S. A duty-cycled node
+ * then goes back to sleep instead of sitting in the portal on battery.
+ */
+
+#pragma once
+
+#include <WiFiManager.h>
+#include "config.h"
+
+
+typedef enum portal_event {
+  PORTAL_NONE = 0,
+  PORTAL_CONNECTED,                             //! Credentials saved and the station is up
+  PORTAL_TIMEOUT                                //! Closed without being configured
+} portal_event_t;
+
+typedef struct portal {
+  bool open;
+  uint32_t start_ms;
+} portal_t;
+
+
+static inline void portal_open(portal_t* portal, WiFiManager* wm) {
+  if (portal->open) {
+    return;
+  }
+  wm->setConfigPortalBlocking(false);
+  wm->startConfigPortal();
+  portal->open = true;
+  portal->start_ms = millis();
+}
+
+static inline void portal_close(portal_t* portal, WiFiManager* wm) {
+  if (portal->open) {
+    wm->stopConfigPortal();
+    portal->open = false;
+  }
+}
+
+/**
+ * Let WiFiManager serve the portal for one loop pass
+ */
+static inline portal_event_t portal_service(portal_t* portal, WiFiManager* wm) {
+  if (!portal->open) {
+    return PORTAL_NONE;
+  }
+  if (wm->process()) {
+    portal->open = false;
+    return PORTAL_CONNECTED;
+  }
+  if ((uint32_t)(millis() - portal->start_ms) >= WIFI_PORTAL_TIMEOUT_S * 1000UL) {
+    portal_close(portal, wm);
+    return PORTAL_TIMEOUT;
+  }
+  return PORTAL_NONE;
+}
@@ -0,0 +1,115 @@
+/**
+ * State carried across deep sleep in RTC user memory.
+ *
+ * The ESP8266 keeps 512 bytes of RTC user memory powered while in deep
+ * sleep. The first 128 bytes are used by eboot to pass OTA commands, so this
+ * block starts after them. A CRC over the whole block tells a warm wake with
+ * good state apart from a power-on (where RTC memory holds noise) or a
+ * firmware update that changed the layout.
+ *
+ * The block grows with the channel count, and past one mux it no longer
+ * fits. It then lives in RAM only (RTC_STATE_PERSISTENT is false, load and
+ * save do nothing), which an always-on node can live with: it loses the
+ * staged records and the session on a reset, as it would on a power cut.
+ * Duty-cycle mode needs the state to survive deep sleep and refuses to
+ * build without it.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include "crc.h"
+#include "mux_scan.h"
+#include "telemetry_log.h"
+#include "energy.h"
+#include "battery.h"
+#include "timesync.h"
+#include "adaptive_rate.h"
+#include "channel_health.h"
+
+
+#define RTC_STATE_MAGIC         (0x504C4E54UL)    //! "PLNT"
+#define RTC_STATE_VERSION       (11)
+#define RTC_STATE_OFFSET        (32)              //! In 4-byte blocks, past the eboot area
+#define RTC_USER_MEMORY_BYTES   (512)
+
+/**
+ * Last good association, used to skip the scan and DHCP on the next wake
+ */
+typedef struct rtcwifi {
+  uint8_t valid;
+  uint8_t channel;
+  uint8_t bssid[6];
+  uint8_t failures;                             //! Wakes in a row that could not associate
+  uint8_t reserved[3];
+  uint32_t ip;                                  //! Lease from the last DHCP, reused as a static IP
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+} rtcwifi_t;
+
+typedef struct rtcstate {
+  uint32_t crc;                                 //! CRC32 over everything after this field
+  uint32_t magic;
+  uint16_t version;
+  uint16_t length;                              //! sizeof(rtcstate_t) when written
+  uint32_t sequence;                            //! Reports sent since power-on
+  uint32_t sweepCount;                          //! Mux sweeps completed since power-on
+  uint16_t readings[MUX_CHANNEL_COUNT];         //! Last completed sweep
+  rtcwifi_t wifi;
+  tlog_t log;
+  adaptive_t adaptive;
+  health_t health;                              //! Probe fault detectors, run on the adaptive EMA
+  energy_report_t energy;                       //! Last closed accounting period
+  battery_t battery;
+  timesync_t time;
+} rtcstate_t;
+
+#define RTC_STATE_PERSISTENT    (RTC_STATE_OFFSET * 4 + sizeof(rtcstate_t) <= RTC_USER_MEMORY_BYTES)
+
+static_assert(sizeof(rtcstate_t) % 4 == 0, "RTC memory is accessed in 4-byte blocks");
+static_assert(!DUTY_CYCLE_MODE || RTC_STATE_PERSISTENT,
+              "RTC state does not fit in RTC user memory, DUTY_CYCLE_MODE needs fewer channels");
+
+
+static inline uint32_t rtcstate_crc(const rtcstate_t* state) {
+  return crc32_compute((const uint8_t*)state + sizeof(state->crc), sizeof(*state) - sizeof(state->crc));
+}
+
+/**
+ * Start over with empty state
+ */
+static inline void rtcstate_clear(rtcstate_t* state) {
+  memset(state, 0, sizeof(*state));
+  state->magic = RTC_STATE_MAGIC;
+  state->version = RTC_STATE_VERSION;
+  state->length = sizeof(*state);
+}
+
+/**
+ * Read state back from RTC memory.
+ *
+ * @return true if the block was intact. On false the state is cleared.
+ */
+static inline bool rtcstate_load(rtcstate_t* state) {
+  if (RTC_STATE_PERSISTENT && ESP.rtcUserMemoryRead(RTC_STATE_OFFSET, (uint32_t*)state, sizeof(*state))
+      && state->magic == RTC_STATE_MAGIC
+      && state->version == RTC_STATE_VERSION
+      && state->length == sizeof(*state)
+      && state->crc == rtcstate_crc(state)) {
+    return true;
+  }
+  rtcstate_clear(state);
+  return false;
+}
+
+/**
+ * Seal and write state to RTC memory
+ */
+static inline bool rtcstate_save(rtcstate_t* state) {
+  if (!RTC_STATE_PERSISTENT) {
+    return false;
+  }
+  state->crc = rtcstate_crc(state);
+  return ESP.rtcUserMemoryWrite(RTC_STATE_OFFSET, (uint32_t*)state, sizeof(*state));
+}
@@ -0,0 +1,67 @@
+/**
+ * Switched excitation for the OP282 buffer and the moisture probes.
+ *
+ * The board's sensorPower pin gates the sensor rail, which is only up for
+ * the duration of a sweep. That saves the buffer's quiescent current and the
+ * probe current between sweeps, and keeps DC off the resistive probes,
+ * which slows their electrolysis.
+ *
+ * On boards with a sensorPowerAlt pin the probes are driven from two pins
+ * and the polarity is swapped on alternate sweeps, so there is no net DC
+ * across the probe at all. In reversed polarity the divider output is
+ * mirrored, and correct() maps it back.
+ */
+
+#pragma once
+
+#include "hal.h"
+#include "config.h"
+#include "board.h"
+#include "adc_filter.h"
+
+
+template <class B>
+struct sensorpower {
+  static constexpr bool REVERSIBLE = B::sensorPowerAlt != PIN_NONE;
+
+  static inline void init(void) {
+    gpio_out<B::sensorPower>::init(false);
+    if constexpr (REVERSIBLE) {
+      gpio_out<B::sensorPowerAlt>::init(false);
+    }
+  }
+
+  /**
+   * Bring the rail up. On non-reversible boards, reversed is ignored.
+   */
+  static inline void on(bool reversed) {
+    if constexpr (REVERSIBLE) {
+      gpio_out<B::sensorPowerAlt>::write(reversed);
+      gpio_out<B::sensorPower>::write(!reversed);
+    } else {
+      (void)reversed;
+      gpio_out<B::sensorPower>::write(true);
+    }
+  }
+
+  static inline void off(void) {
+    gpio_out<B::sensorPower>::write(false);
+    if constexpr (REVERSIBLE) {
+      gpio_out<B::sensorPowerAlt>::write(false);
+    }
+  }
+
+  /**
+   * True if the sweep with this count should run with swapped polarity
+   */
+  static constexpr bool reversed_for(uint32_t sweepCount) {
+    return REVERSIBLE && (sweepCount & 1) != 0;
+  }
+
+  /**
+   * Map a reading taken with the given polarity back to normal polarity
+   */
+  static constexpr uint16_t correct(uint16_t value, bool reversed) {
+    return reversed ? (uint16_t)(ADC_RESULT_MAX - value) : value;
+  }
+};
@@ -0,0 +1,80 @@
+/**
+ * Line-oriented serial command interface.
+ *
+ * Bytes are pulled from Serial without blocking. Once a full line is in,
+ * it is split on spaces and dispatched through a table of named handlers.
+ * "help" lists the table.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+
+#define SERIALCMD_LINE_MAX      (80)
+#define SERIALCMD_ARGS_MAX      (8)
+
+typedef void (*serialcmd_handler_t)(uint8_t argc, char** argv);
+
+typedef struct serialcmd_entry {
+  const char* name;
+  serialcmd_handler_t handler;
+  const char* help;
+} serialcmd_entry_t;
+
+typedef struct serialcmd {
+  char line[SERIALCMD_LINE_MAX];
+  uint8_t length;
+  bool overflow;                                //! Line too long; dropped at the next newline
+} serialcmd_t;
+
+
+static inline void serialcmd_dispatch(char* line, const serialcmd_entry_t* table, size_t count) {
+  char* argv[SERIALCMD_ARGS_MAX];
+  uint8_t argc = 0;
+  char* save = nullptr;
+
+  for (char* tok = strtok_r(line, " \t", &save); tok && argc < SERIALCMD_ARGS_MAX;
+       tok = strtok_r(nullptr, " \t", &save)) {
+    argv[argc++] = tok;
+  }
+  if (argc == 0) {
+    return;
+  }
+
+  if (strcmp(argv[0], "help") == 0) {
+    for (size_t i = 0; i < count; i++) {
+      Serial.printf("%-8s %s\n", table[i].name, table[i].help);
+    }
+    return;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (strcmp(argv[0], table[i].name) == 0) {
+      table[i].handler(argc, argv);
+      return;
+    }
+  }
+  Serial.printf("unknown command '%s', try help\n", argv[0]);
+}
+
+/**
+ * Consume whatever input is waiting and run any completed line
+ */
+static inline void serialcmd_service(serialcmd_t* cli, const serialcmd_entry_t* table, size_t count) {
+  while (Serial.available() > 0) {
+    const char c = (char)Serial.read();
+
+    if (c == '\r' || c == '\n') {
+      if (!cli->overflow && cli->length > 0) {
+        cli->line[cli->length] = '\0';
+        serialcmd_dispatch(cli->line, table, count);
+      }
+      cli->length = 0;
+      cli->overflow = false;
+    } else if (cli->length < SERIALCMD_LINE_MAX - 1) {
+      cli->line[cli->length++] = c;
+    } else {
+      cli->overflow = true;
+    }
+  }
+}
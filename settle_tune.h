@@ -0,0 +1,241 @@
+/**
+ * Per-channel mux settle time, measured on the board itself.
+ *
+ * How long A0 needs after a select-line change depends on the channel. The
+ * OP282 buffer drives a different probe cable on each one. A tuning run
+ * measures every channel the way the scanner reaches it: from its
+ * predecessor in the Gray-code sweep order.
+ *
+ *   1. Select the predecessor and hold it for MUX_SETTLE_TUNE_WINDOW_US,
+ *      so A0 starts from a settled value.
+ *   2. Select the channel and read raw A0 back to back for the same window.
+ *   3. The final value is the mean of the last SETTLETUNE_TAIL reads. The
+ *      channel has settled at the first read after the last one that was
+ *      more than MUX_SETTLE_TUNE_TOLERANCE counts away from it.
+ *
+ * Each channel is measured MUX_SETTLE_TUNE_REPEATS times. The median is
+ * taken so a single noise spike cannot stretch it. MUX_SETTLE_TUNE_MARGIN_US
+ * is added and the result clamped to [MUX_SETTLE_MIN_US, window]. A channel
+ * that never settles inside the window gets the whole window.
+ *
+ * Like the scanner, a run is a state machine advanced by
+ * settletune_service(). The only busy wait is the capture itself, one
+ * window per call. The result goes to the scanner's settle_us[] and is
+ * stored in /settle.bin. A cold boot without that file runs a tuning
+ * before the first sweep; otherwise it only runs on request (serial
+ * "settle tune", POST /settle/tune).
+ *
+ * A sweep that skips a channel (the battery, mostly) reaches the next one
+ * from a different predecessor than the one measured. Two select lines
+ * change there instead of one, which the margin has to cover.
+ */
+
+#pragma once
+
+#include "hal.h"
+#if !HAL_HOST
+#include <LittleFS.h>
+#endif
+#include "config.h"
+#include "board.h"
+#include "crc.h"
+#include "mux_scan.h"
+#include "sensor_power.h"
+
+
+#define SETTLETUNE_SAMPLES      (128)             //! Raw reads kept per capture
+#define SETTLETUNE_TAIL         (8)               //! Reads averaged for the final value
+#define SETTLE_FILE_PATH        "/settle.bin"
+
+static_assert(MUX_SETTLE_TUNE_REPEATS >= 1 && MUX_SETTLE_TUNE_REPEATS <= 15, "repeats out of range");
+static_assert(MUX_SETTLE_MIN_US <= MUX_SETTLE_TUNE_WINDOW_US, "minimum settle longer than the window");
+
+typedef enum settletune_state {
+  SETTLETUNE_IDLE = 0,    //! No run in progress
+  SETTLETUNE_WARMUP,      //! Sensor rail up, waiting for it to settle
+  SETTLETUNE_PRESELECT,   //! Select the predecessor of the current channel
+  SETTLETUNE_HOLD,        //! Letting the predecessor settle
+  SETTLETUNE_CAPTURE,     //! Switch to the channel and record the step
+  SETTLETUNE_DONE         //! Run finished, result is valid
+} settletune_state_t;
+
+typedef struct settletune {
+  settletune_state_t state;
+  uint8_t step;                                 //! Index into MUXSCAN_ORDER being measured
+  uint8_t repeat;
+  uint32_t warmupStart_ms;
+  uint32_t holdStart_us;
+  uint16_t runs[MUX_SETTLE_TUNE_REPEATS];       //! Settle of each repeat, current channel
+  uint16_t result_us[MUX_CHANNEL_COUNT];
+} settletune_t;
+
+
+/**
+ * Settle time of one capture, in µs after the select-line write
+ */
+static inline uint16_t settletune_measure(const uint16_t* value, const uint16_t* at_us, uint8_t count) {
+  if (count <= SETTLETUNE_TAIL) {
+    return MUX_SETTLE_TUNE_WINDOW_US;
+  }
+  uint32_t sum = 0;
+  for (uint8_t i = count - SETTLETUNE_TAIL; i < count; i++) {
+    sum += value[i];
+  }
+  const int32_t final = (int32_t)((sum + SETTLETUNE_TAIL / 2) / SETTLETUNE_TAIL);
+
+  for (uint8_t i = count; i > 0; i--) {
+    const int32_t error = (int32_t)value[i - 1] - final;
+    if (error > MUX_SETTLE_TUNE_TOLERANCE || error < -MUX_SETTLE_TUNE_TOLERANCE) {
+      // Still moving at the very end: never settled inside the window
+      return (i > count - SETTLETUNE_TAIL) ? MUX_SETTLE_TUNE_WINDOW_US : at_us[i];
+    }
+  }
+  return at_us[0];
+}
+
+/**
+ * Select the channel and read A0 until the window has passed. Blocks for
+ * at most MUX_SETTLE_TUNE_WINDOW_US.
+ */
+static inline uint16_t settletune_capture(uint8_t channel) {
+  static uint16_t value[SETTLETUNE_SAMPLES];
+  static uint16_t at_us[SETTLETUNE_SAMPLES];
+  uint8_t count = 0;
+
+  MuxArray::write(channel);
+  const uint32_t start = hal_micros();
+  uint32_t elapsed = 0;
+  while (count < SETTLETUNE_SAMPLES && elapsed < MUX_SETTLE_TUNE_WINDOW_US) {
+    value[count] = hal_adc_read(Board::moistureAdc);
+    elapsed = hal_micros() - start;
+    at_us[count++] = (uint16_t)elapsed;
+  }
+  return settletune_measure(value, at_us, count);
+}
+
+/**
+ * Median of the repeats, plus the margin, clamped
+ */
+static inline uint16_t settletune_finish_channel(settletune_t* tune) {
+  uint16_t* r = tune->runs;
+  for (uint8_t i = 1; i < MUX_SETTLE_TUNE_REPEATS; i++) {
+    const uint16_t v = r[i];
+    uint8_t j = i;
+    for (; j > 0 && r[j - 1] > v; j--) {
+      r[j] = r[j - 1];
+    }
+    r[j] = v;
+  }
+  uint32_t us = (uint32_t)r[MUX_SETTLE_TUNE_REPEATS / 2] + MUX_SETTLE_TUNE_MARGIN_US;
+  if (us < MUX_SETTLE_MIN_US) {
+    us = MUX_SETTLE_MIN_US;
+  }
+  return (uint16_t)((us > MUX_SETTLE_TUNE_WINDOW_US) ? MUX_SETTLE_TUNE_WINDOW_US : us);
+}
+
+/**
+ * Begin a run. The caller makes sure no sweep is in progress: both drive
+ * the select lines and the sensor rail.
+ */
+static inline void settletune_start(settletune_t* tune) {
+  if (tune->state != SETTLETUNE_IDLE && tune->state != SETTLETUNE_DONE) {
+    return;
+  }
+  tune->step = 0;
+  tune->repeat = 0;
+  sensorpower<Board>::on(false);
+  tune->warmupStart_ms = hal_millis();
+  tune->state = SETTLETUNE_WARMUP;
+}
+
+static inline bool settletune_busy(const settletune_t* tune) {
+  return tune->state != SETTLETUNE_IDLE && tune->state != SETTLETUNE_DONE;
+}
+
+/**
+ * Advance the run by one step
+ *
+ * @return true exactly once per run, on the call that completes it
+ */
+static inline bool settletune_service(settletune_t* tune) {
+  switch (tune->state) {
+    case SETTLETUNE_WARMUP:
+      if ((uint32_t)(hal_millis() - tune->warmupStart_ms) >= SENSOR_WARMUP_MS) {
+        tune->state = SETTLETUNE_PRESELECT;
+      }
+      break;
+
+    case SETTLETUNE_PRESELECT:
+      if (tune->step >= MUX_CHANNEL_COUNT) {
+        sensorpower<Board>::off();
+        tune->state = SETTLETUNE_DONE;
+        return true;
+      }
+      MuxArray::write(MUXSCAN_ORDER[(tune->step + MUX_CHANNEL_COUNT - 1) % MUX_CHANNEL_COUNT]);
+      tune->holdStart_us = hal_micros();
+      tune->state = SETTLETUNE_HOLD;
+      break;
+
+    case SETTLETUNE_HOLD:
+      if ((uint32_t)(hal_micros() - tune->holdStart_us) >= MUX_SETTLE_TUNE_WINDOW_US) {
+        tune->state = SETTLETUNE_CAPTURE;
+      }
+      break;
+
+    case SETTLETUNE_CAPTURE:
+      tune->runs[tune->repeat++] = settletune_capture(MUXSCAN_ORDER[tune->step]);
+      if (tune->repeat == MUX_SETTLE_TUNE_REPEATS) {
+        tune->result_us[MUXSCAN_ORDER[tune->step]] = settletune_finish_channel(tune);
+        tune->repeat = 0;
+        tune->step++;
+      }
+      tune->state = SETTLETUNE_PRESELECT;
+      break;
+
+    case SETTLETUNE_IDLE:
+    case SETTLETUNE_DONE:
+    default:
+      break;
+  }
+  return false;
+}
+
+
+// ---------------------------------------------------------------------------
+// Persistence
+// ---------------------------------------------------------------------------
+
+#if !HAL_HOST
+/**
+ * Read the stored settle times into settle_us. Left untouched, and false
+ * returned, if there are none.
+ */
+static inline bool settle_load(uint16_t* settle_us) {
+  uint16_t stored[MUX_CHANNEL_COUNT];
+  uint32_t crc = 0;
+  File f = LittleFS.open(SETTLE_FILE_PATH, "r");
+  const bool ok = f && f.read((uint8_t*)stored, sizeof(stored)) == sizeof(stored)
+               && f.read((uint8_t*)&crc, sizeof(crc)) == sizeof(crc)
+               && crc == crc32_compute(stored, sizeof(stored));
+  if (f) {
+    f.close();
+  }
+  if (ok) {
+    memcpy(settle_us, stored, sizeof(stored));
+  }
+  return ok;
+}
+
+static inline bool settle_save(const uint16_t* settle_us) {
+  const size_t size = MUX_CHANNEL_COUNT * sizeof(uint16_t);
+  const uint32_t crc = crc32_compute(settle_us, size);
+  File f = LittleFS.open(SETTLE_FILE_PATH, "w");
+  if (!f) {
+    return false;
+  }
+  const bool ok = f.write((const uint8_t*)settle_us, size) == size
+               && f.write((const uint8_t*)&crc, sizeof(crc)) == sizeof(crc);
+  f.close();
+  return ok;
+}
+#endif
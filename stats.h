@@ -0,0 +1,152 @@
+/**
+ * Hot-path timing and heap statistics.
+ *
+ * Short stages are timed with the CPU cycle counter, longer ones with
+ * micros() / millis(). Either way, each sample lands in a static per-stage
+ * table of count / min / max / total microseconds. Recording is a handful
+ * of compares and adds, so it can stay enabled in the field.
+ *
+ * The cycle counter wraps after 2^32 cycles (~53 s at 80 MHz). Anything
+ * that can take that long has to use stats_record_us().
+ *
+ * The heap watermark is taken after every upload cycle. Once the network
+ * stack has warmed up, the largest free block should not keep getting
+ * smaller. If it drops by more than HEAP_WATCH_SLACK_BYTES from one cycle
+ * to the next, stats_heap_cycle() says so, and the lowest value seen is
+ * kept for "stats" and GET /stats.
+ */
+
+#pragma once
+
+#include "hal.h"
+#include "config.h"
+#include "arena.h"
+
+
+#define STATS_ROW_MAX           (144)             //! Longest stats_format_stage() / stats_format_heap() line and its terminator
+
+typedef enum stats_stage {
+  STAGE_MUX_SETTLE = 0,                         //! Select-line change to sample start
+  STAGE_ADC_BURST,                              //! One oversampled channel read
+  STAGE_SWEEP,                                  //! Sweep start to last channel read
+  STAGE_FRAME_ENCODE,
+  STAGE_WIFI_CONNECT,                           //! wififast_begin() to link up
+  STAGE_UPLOAD,                                 //! One tlog_drain() batch
+  STAGE_COUNT
+} stats_stage_t;
+
+typedef struct stats_entry {
+  uint32_t count;
+  uint32_t min_us;
+  uint32_t max_us;
+  uint64_t total_us;
+} stats_entry_t;
+
+static const char* const STATS_STAGE_NAMES[STAGE_COUNT] = {
+  "mux_settle", "adc_burst", "sweep", "frame_encode", "wifi_connect", "upload"
+};
+
+static stats_entry_t statsTable[STAGE_COUNT];
+
+
+static inline void stats_reset(void) {
+  memset(statsTable, 0, sizeof(statsTable));
+}
+
+static inline void stats_record_us(stats_stage_t stage, uint32_t us) {
+  stats_entry_t* e = &statsTable[stage];
+  if (e->count == 0 || us < e->min_us) {
+    e->min_us = us;
+  }
+  if (us > e->max_us) {
+    e->max_us = us;
+  }
+  e->total_us += us;
+  e->count++;
+}
+
+static inline uint32_t stats_cycles_begin(void) {
+  return hal_cycles();
+}
+
+static inline void stats_cycles_end(stats_stage_t stage, uint32_t start) {
+  stats_record_us(stage, (hal_cycles() - start) / hal_cpu_mhz());
+}
+
+static inline uint32_t stats_avg_us(const stats_entry_t* e) {
+  return e->count ? (uint32_t)(e->total_us / e->count) : 0;
+}
+
+typedef struct stats_heap {
+  uint32_t free;
+  uint32_t maxBlock;
+  uint8_t fragmentation;                        //! Percent
+} stats_heap_t;
+
+static inline void stats_heap_read(stats_heap_t* heap) {
+  heap->free = hal_heap_free();
+  heap->maxBlock = hal_heap_max_block();
+  heap->fragmentation = hal_heap_fragmentation();
+}
+
+typedef struct stats_heapwatch {
+  uint32_t lastMaxBlock;                        //! After the previous upload cycle, 0 before the first
+  uint32_t lowMaxBlock;                         //! Lowest seen after any cycle
+  uint32_t shrinks;                             //! Cycles that lost more than the slack
+} stats_heapwatch_t;
+
+static stats_heapwatch_t statsHeapWatch;
+
+/**
+ * Take the watermark at the end of an upload cycle
+ *
+ * @return the previous cycle's largest free block if it has shrunk
+ *         noticeably since, 0 otherwise
+ */
+static inline uint32_t stats_heap_cycle(void) {
+  const uint32_t maxBlock = hal_heap_max_block();
+  const uint32_t previous = statsHeapWatch.lastMaxBlock;
+  const bool shrank = previous != 0 && maxBlock + HEAP_WATCH_SLACK_BYTES < previous;
+  if (statsHeapWatch.lowMaxBlock == 0 || maxBlock < statsHeapWatch.lowMaxBlock) {
+    statsHeapWatch.lowMaxBlock = maxBlock;
+  }
+  if (shrank) {
+    statsHeapWatch.shrinks++;
+  }
+  statsHeapWatch.lastMaxBlock = maxBlock;
+  return shrank ? previous : 0;
+}
+
+/**
+ * One stage as a JSON object
+ */
+static inline int stats_format_stage(char* out, size_t size, stats_stage_t stage) {
+  const stats_entry_t* e = &statsTable[stage];
+  return snprintf(out, size, "\"%s\":{\"n\":%u,\"min\":%u,\"max\":%u,\"avg\":%u}",
+                  STATS_STAGE_NAMES[stage], e->count, e->min_us, e->max_us, stats_avg_us(e));
+}
+
+static inline int stats_format_heap(char* out, size_t size) {
+  stats_heap_t heap;
+  stats_heap_read(&heap);
+  return snprintf(out, size, "\"heap\":{\"free\":%u,\"max_block\":%u,\"max_block_low\":%u,\"frag\":%u,"
+                  "\"arena_peak\":%u,\"arena_size\":%u}",
+                  heap.free, heap.maxBlock, statsHeapWatch.lowMaxBlock, heap.fragmentation,
+                  (unsigned)netArena.peak, (unsigned)sizeof(netArena.storage));
+}
+
+#if !HAL_HOST
+static inline void stats_print(Print* out) {
+  out->printf("%-14s %8s %8s %8s %8s\n", "stage", "n", "min_us", "max_us", "avg_us");
+  for (uint8_t i = 0; i < STAGE_COUNT; i++) {
+    const stats_entry_t* e = &statsTable[i];
+    out->printf("%-14s %8u %8u %8u %8u\n", STATS_STAGE_NAMES[i], e->count, e->min_us, e->max_us, stats_avg_us(e));
+  }
+  stats_heap_t heap;
+  stats_heap_read(&heap);
+  out->printf("heap free=%u max_block=%u (low %u) frag=%u%%\n",
+              heap.free, heap.maxBlock, statsHeapWatch.lowMaxBlock, heap.fragmentation);
+  out->printf("arena peak=%u/%u failures=%u\n",
+              (unsigned)netArena.peak, (unsigned)sizeof(netArena.storage), netArena.failures);
+}
+#endif
@@ -0,0 +1,96 @@
+/**
+ * Status LED driver and blink pattern engine.
+ *
+ * Each node state maps to a pattern: a list of durations that alternate
+ * LED on / LED off, starting with on, and repeat. statusled_tick() is
+ * called from loop() and only touches the pin when a step has expired, so
+ * there is no delay() and nothing runs from a timer interrupt.
+ */
+
+#pragma once
+
+#include "hal.h"
+#include "board.h"
+
+
+template <class B>
+struct statusled {
+  static inline void init(void) {
+    gpio_out<B::statusLed>::init(B::statusLedActiveLow);
+  }
+
+  static inline void set(bool on) {
+    gpio_out<B::statusLed>::write(on != B::statusLedActiveLow);
+  }
+};
+
+
+typedef enum led_state {
+  LED_IDLE = 0,                                 //! Off
+  LED_SAMPLING,                                 //! Sweep in progress
+  LED_CONNECTING,                               //! Associating / broker connect
+  LED_PORTAL,                                   //! Config portal is open
+  LED_UPLOAD_FAILED,                            //! Last upload left records queued
+  LED_LOW_BATTERY,
+  LED_STATE_COUNT
+} led_state_t;
+
+#define LED_PATTERN_MAX_STEPS   (6)
+
+typedef struct led_pattern {
+  uint8_t steps;                                //! 0 keeps the LED off
+  uint16_t duration_ms[LED_PATTERN_MAX_STEPS];  //! on, off, on, off, ...
+} led_pattern_t;
+
+static const led_pattern_t LED_PATTERNS[LED_STATE_COUNT] = {
+  /* LED_IDLE          */ { 0, { 0 } },
+  /* LED_SAMPLING      */ { 2, { 50, 200 } },
+  /* LED_CONNECTING    */ { 2, { 100, 400 } },
+  /* LED_PORTAL        */ { 2, { 1000, 1000 } },
+  /* LED_UPLOAD_FAILED */ { 6, { 100, 150, 100, 150, 100, 1500 } },
+  /* LED_LOW_BATTERY   */ { 2, { 50, 4950 } },
+};
+
+typedef struct statusled_engine {
+  led_state_t state;
+  uint8_t step;
+  uint32_t stepStart_ms;
+} statusled_engine_t;
+
+
+static inline void statusled_engine_init(statusled_engine_t* led) {
+  led->state = LED_IDLE;
+  led->step = 0;
+  led->stepStart_ms = hal_millis();
+  statusled<Board>::init();
+}
+
+/**
+ * Switch to another pattern. Restarts from its first step only if the
+ * state actually changes, so this can be called every loop.
+ */
+static inline void statusled_set_state(statusled_engine_t* led, led_state_t state) {
+  if (state == led->state) {
+    return;
+  }
+  led->state = state;
+  led->step = 0;
+  led->stepStart_ms = hal_millis();
+  statusled<Board>::set(LED_PATTERNS[state].steps > 0);
+}
+
+static inline void statusled_tick(statusled_engine_t* led) {
+  const led_pattern_t* pattern = &LED_PATTERNS[led->state];
+  if (pattern->steps == 0) {
+    return;
+  }
+
+  const uint32_t now = hal_millis();
+  if ((uint32_t)(now - led->stepStart_ms) < pattern->duration_ms[led->step]) {
+    return;
+  }
+
+  led->stepStart_ms = now;
+  led->step = (led->step + 1) % pattern->steps;
+  statusled<Board>::set((led->step & 1) == 0);
+}
@@ -0,0 +1,226 @@
+/**
+ * Pipeline supervision and crash capture.
+ *
+ * The loop reports which pipeline stage the node is in (supervisor_enter()).
+ * A change of stage feeds the watchdog and writes the stage and its node
+ * time to a small block at the top of RTC user memory. That block is
+ * separate from rtcstate_t, which is only written before deep sleep, so
+ * the marker is current whenever a reset hits. Stages change a few times
+ * per wake, never per channel, so the scan itself costs nothing extra.
+ *
+ * Two things turn into a crash record:
+ *
+ *   - A reset by the hardware or soft watchdog, or by an exception. The
+ *     next boot reads the reason, EXCCAUSE and EPC1 from the SDK's reset
+ *     info and the stage from the marker.
+ *   - A stage that outlives its budget in SUP_STAGE_BUDGET_MS, i.e. a
+ *     state machine that got stuck without blocking. supervisor_service()
+ *     marks the stage as timed out and restarts.
+ *
+ * The record rides on the next telemetry frame (TFRAME_FLAG_CRASH) and
+ * stays marked unsent until a frame with it has gone out. After
+ * SUP_SAFE_MODE_CRASHES crashes without a good upload in between, the
+ * node enters safe mode: it keeps sweeping and logging, but leaves the
+ * radio, the portal, OTA and the HTTP API alone. Safe mode is left with a
+ * power cycle or reset pin, or after SUP_SAFE_MODE_RETRY_S. The retry gets
+ * one crash of grace before safe mode comes back.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include "config.h"
+#include "crc.h"
+#include "rtc_state.h"
+
+
+typedef enum sup_stage {
+  SUP_BOOT = 0,                                 //! setup()
+  SUP_IDLE,
+  SUP_SWEEP,                                    //! Mux sweep in progress
+  SUP_COMMIT,                                   //! Logging a finished sweep
+  SUP_CONNECT,                                  //! Associating with the AP
+  SUP_UPLOAD,                                   //! Draining the telemetry log
+  SUP_OTA,                                      //! Pulling a firmware image
+  SUP_PORTAL,                                   //! Config portal open
+  SUP_SLEEP,                                    //! Going into deep sleep
+  SUP_STAGE_COUNT
+} sup_stage_t;
+
+static const char* const SUP_STAGE_NAMES[SUP_STAGE_COUNT] = {
+  "boot", "idle", "sweep", "commit", "connect", "upload", "ota", "portal", "sleep"
+};
+
+/**
+ * Longest a stage may last before it counts as a hang, 0 for unbounded.
+ * Single-call stages are covered by the watchdog instead.
+ */
+static constexpr uint32_t SUP_STAGE_BUDGET_MS[SUP_STAGE_COUNT] = {
+  0, 0, SUP_STAGE_TIMEOUT_MS, 0, SUP_STAGE_TIMEOUT_MS, 0,
+  SUP_OTA_TIMEOUT_MS, (WIFI_PORTAL_TIMEOUT_S + 60UL) * 1000UL, 0
+};
+
+#define SUP_REASON_STAGE_TIMEOUT (0x80)           //! Crash reason for a stage over budget
+#define SUP_FLAG_UNSENT         (0x01)            //! Not yet reported in a frame
+#define SUP_FLAG_SAFE_MODE      (0x02)
+
+#define SUP_MAGIC               (0x53555056UL)    //! "SUPV"
+#define SUP_MARKER              (0x5E000000UL)    //! High byte of a valid stage marker
+#define SUP_MARKER_TIMEOUT      (0x00010000UL)    //! Stage ran over budget, restart was ours
+
+typedef struct sup_crash {
+  uint8_t reason;                               //! rst_reason, or SUP_REASON_STAGE_TIMEOUT
+  uint8_t stage;                                //! sup_stage_t the pipeline was in
+  uint8_t count;                                //! Crashes since the last good upload
+  uint8_t flags;                                //! SUP_FLAG_*
+  uint32_t exccause;
+  uint32_t epc1;
+  uint32_t stage_s;                             //! Node time the stage was entered
+} sup_crash_t;
+
+typedef struct sup_rtc {
+  uint32_t marker;                              //! SUP_MARKER | stage, rewritten on every change
+  uint32_t markerTime_s;
+  uint32_t magic;
+  sup_crash_t crash;
+  uint32_t safeSince_s;                         //! Node time safe mode was (re)entered
+  uint32_t crc;                                 //! Over magic .. safeSince_s
+} sup_rtc_t;
+
+// Top of RTC user memory, clear of rtcstate_t
+#define SUP_RTC_OFFSET          ((RTC_USER_MEMORY_BYTES - sizeof(sup_rtc_t)) / 4)
+
+static_assert(sizeof(sup_rtc_t) % 4 == 0, "RTC memory is accessed in 4-byte blocks");
+static_assert(!RTC_STATE_PERSISTENT || RTC_STATE_OFFSET * 4 + sizeof(rtcstate_t) <= SUP_RTC_OFFSET * 4,
+              "RTC state runs into the supervisor block");
+
+typedef struct supervisor {
+  sup_rtc_t rtc;
+  uint8_t stage;
+  uint32_t stageStart_ms;
+} supervisor_t;
+
+
+static inline uint32_t supervisor_crc(const sup_rtc_t* rtc) {
+  return crc32_compute(&rtc->magic, offsetof(sup_rtc_t, crc) - offsetof(sup_rtc_t, magic));
+}
+
+static inline void supervisor_save(supervisor_t* sup) {
+  sup->rtc.crc = supervisor_crc(&sup->rtc);
+  ESP.rtcUserMemoryWrite(SUP_RTC_OFFSET, (uint32_t*)&sup->rtc, sizeof(sup->rtc));
+}
+
+static inline void supervisor_write_marker(supervisor_t* sup) {
+  ESP.rtcUserMemoryWrite(SUP_RTC_OFFSET, &sup->rtc.marker, 2 * sizeof(uint32_t));
+}
+
+static inline bool supervisor_safe_mode(const supervisor_t* sup) {
+  return (sup->rtc.crash.flags & SUP_FLAG_SAFE_MODE) != 0;
+}
+
+/**
+ * Crash report still to go out, or nullptr
+ */
+static inline const sup_crash_t* supervisor_unsent(const supervisor_t* sup) {
+  return (sup->rtc.crash.flags & SUP_FLAG_UNSENT) ? &sup->rtc.crash : nullptr;
+}
+
+static inline void supervisor_sent(supervisor_t* sup) {
+  sup->rtc.crash.flags &= ~SUP_FLAG_UNSENT;
+  supervisor_save(sup);
+}
+
+/**
+ * Call once per boot, once node time is known
+ *
+ * @return true if this boot follows a crash
+ */
+static inline bool supervisor_boot(supervisor_t* sup, const rst_info* info, uint32_t now_s) {
+  sup_rtc_t* rtc = &sup->rtc;
+  const bool read = ESP.rtcUserMemoryRead(SUP_RTC_OFFSET, (uint32_t*)rtc, sizeof(*rtc));
+  if (!read || rtc->magic != SUP_MAGIC || rtc->crc != supervisor_crc(rtc)) {
+    memset(rtc, 0, sizeof(*rtc));
+    rtc->magic = SUP_MAGIC;
+  }
+  const bool markerValid = (rtc->marker & 0xFF000000UL) == SUP_MARKER;
+  const bool timedOut = markerValid && (rtc->marker & SUP_MARKER_TIMEOUT) && info->reason == REASON_SOFT_RESTART;
+  const bool crashed = timedOut || info->reason == REASON_WDT_RST
+                    || info->reason == REASON_EXCEPTION_RST || info->reason == REASON_SOFT_WDT_RST;
+  sup_crash_t* crash = &rtc->crash;
+
+  if (crashed) {
+    crash->reason = timedOut ? SUP_REASON_STAGE_TIMEOUT : (uint8_t)info->reason;
+    crash->stage = markerValid ? (uint8_t)rtc->marker : (uint8_t)SUP_STAGE_COUNT;
+    crash->exccause = timedOut ? 0 : info->exccause;
+    crash->epc1 = timedOut ? 0 : info->epc1;
+    crash->stage_s = markerValid ? rtc->markerTime_s : 0;
+    crash->flags |= SUP_FLAG_UNSENT;
+    if (crash->count < 0xFF) {
+      crash->count++;
+    }
+    if (crash->count >= SUP_SAFE_MODE_CRASHES) {
+      // Node time restarts after a crash, so the safe period does too
+      crash->flags |= SUP_FLAG_SAFE_MODE;
+      rtc->safeSince_s = now_s;
+    }
+  } else if (info->reason == REASON_DEFAULT_RST || info->reason == REASON_EXT_SYS_RST) {
+    // Someone power cycled or reset the node: start over
+    crash->count = 0;
+    crash->flags &= ~SUP_FLAG_SAFE_MODE;
+  }
+
+  sup->stage = SUP_BOOT;
+  sup->stageStart_ms = millis();
+  rtc->marker = SUP_MARKER | SUP_BOOT;
+  rtc->markerTime_s = now_s;
+  supervisor_save(sup);
+  return crashed;
+}
+
+/**
+ * The pipeline moved on to another stage
+ */
+static inline void supervisor_enter(supervisor_t* sup, sup_stage_t stage, uint32_t now_s) {
+  if (sup->stage == stage) {
+    return;
+  }
+  ESP.wdtFeed();
+  sup->stage = stage;
+  sup->stageStart_ms = millis();
+  sup->rtc.marker = SUP_MARKER | stage;
+  sup->rtc.markerTime_s = now_s;
+  supervisor_write_marker(sup);
+}
+
+/**
+ * A good upload ends a crash run
+ */
+static inline void supervisor_healthy(supervisor_t* sup) {
+  if (sup->rtc.crash.count != 0 && !supervisor_safe_mode(sup)) {
+    sup->rtc.crash.count = 0;
+    supervisor_save(sup);
+  }
+}
+
+/**
+ * Once per loop: restart out of a stage that is over budget
+ */
+static inline void supervisor_service(supervisor_t* sup) {
+  const uint32_t budget = SUP_STAGE_BUDGET_MS[sup->stage];
+  if (budget != 0 && (uint32_t)(millis() - sup->stageStart_ms) >= budget) {
+    sup->rtc.marker |= SUP_MARKER_TIMEOUT;
+    supervisor_write_marker(sup);
+    ESP.restart();
+  }
+}
+
+/**
+ * In safe mode: leave it once SUP_SAFE_MODE_RETRY_S have passed
+ */
+static inline void supervisor_retry(supervisor_t* sup, uint32_t now_s) {
+  if (supervisor_safe_mode(sup) && now_s - sup->rtc.safeSince_s >= SUP_SAFE_MODE_RETRY_S) {
+    sup->rtc.crash.flags &= ~SUP_FLAG_SAFE_MODE;
+    sup->rtc.crash.count = SUP_SAFE_MODE_CRASHES - 1;
+    supervisor_save(sup);
+  }
+}
@@ -0,0 +1,358 @@
+/**
+ * Wire format for one sweep.
+ *
+ * Binary frame, version 5, all multi-byte fields little endian:
+ *
+ *   off  size  field
+ *   0    1     sync (0xA5)
+ *   1    1     version
+ *   2    1     flags (TFRAME_FLAG_*)
+ *   3    1     channel mask, channels 0-7
+ *   4    4     node id (ESP chip id)
+ *   8    4     record sequence
+ *   12   4     timestamp (Unix time with TFRAME_FLAG_EPOCH, else uptime s)
+ *   16   2     battery mV
+ *   18   w     channel extension if TFRAME_FLAG_WIDE, else absent (w = 0):
+ *                1  channel count N, 9 to 64
+ *                m  rest of the channel mask, channels 8 and up
+ *   18+w n     one zigzag varint per channel set in the mask
+ *   ..   f     channel faults if TFRAME_FLAG_FAULTS, else absent (f = 0):
+ *                M  mask of faulty channels (left out of the channel mask)
+ *                k  HEALTH_FAULT_* bits, one byte per channel in that mask
+ *   ..   e     energy report if TFRAME_FLAG_ENERGY, else absent (e = 0):
+ *                4  charge of the last accounting period, µAh
+ *                2  projected battery life, days
+ *   ..   c     crash report if TFRAME_FLAG_CRASH, else absent (c = 0):
+ *                1  reset reason (rst_reason, 0x80 for a stage timeout)
+ *                1  pipeline stage at the time (see supervisor.h)
+ *                1  crashes since the last good upload
+ *                1  supervisor flags, 0x02 for safe mode
+ *                4  EPC1 of the exception
+ *   ..   2     CRC-16/CCITT-FALSE over everything before it
+ *
+ * A mask is M = ceil(N / 8) bytes, low channels first, with N = 8 unless
+ * TFRAME_FLAG_WIDE says otherwise, and m = M - 1. A node with a single
+ * mux never sets the flag and sends the same frame it always has; one
+ * with more sends the extension in every frame, so the size of a sweep
+ * grows with the channels it actually reads.
+ *
+ * With TFRAME_FLAG_CALIBRATED readings are moisture in 0.1 % units,
+ * otherwise filtered ADC counts.
+ *
+ * Readings are sent as the difference to the same channel in the previous
+ * frame of the session, which for slowly drying soil is almost always a
+ * single byte. A keyframe (TFRAME_FLAG_KEYFRAME) carries absolute values
+ * and is sent first in every session, after a gap in the sequence or when
+ * the channel mask changes, so the receiver never depends on a frame it
+ * missed.
+ *
+ * A channel the node found faulty (see channel_health.h) is taken out of
+ * the channel mask and listed in the fault section instead, so a pinned
+ * probe never shows up as a reading.
+ *
+ * The energy report (see energy.h) rides along on one frame after each
+ * accounting period. TFRAME_FLAG_OVER_BUDGET marks a duty-cycle wake that
+ * went over ENERGY_WAKE_BUDGET_UAH. A crash report is attached the same
+ * way, to the first frame after a watchdog reset, exception or hung stage.
+ *
+ * tframe_decode() turns a keyframe back into a record, which is what an
+ * ESP-NOW gateway needs to republish its leaves' readings.
+ * tframe_format_text() renders the same record as a JSON line for
+ * debugging. Everything is written into caller-provided buffers.
+ */
+
+#pragma once
+
+#include "hal.h"
+#include "crc.h"
+#include "telemetry_record.h"
+#include "channel_mask.h"
+#include "energy.h"
+
+
+#define TFRAME_SYNC             (0xA5)
+#define TFRAME_VERSION          (5)
+#define TFRAME_HEADER_BYTES     (18)
+#define TFRAME_CRC_BYTES        (2)
+#define TFRAME_VARINT_MAX       (3)               //! 16-bit zigzag value needs at most 3 bytes
+#define TFRAME_ENERGY_BYTES     (6)
+#define TFRAME_CRASH_BYTES      (8)
+#define TFRAME_MASK_BYTES       ((TLOG_CHANNELS + 7) / 8)
+#define TFRAME_WIDE_BYTES       (TLOG_CHANNELS > 8 ? TFRAME_MASK_BYTES : 0)
+#define TFRAME_MAX_BYTES        (TFRAME_HEADER_BYTES + TFRAME_WIDE_BYTES + TLOG_CHANNELS * TFRAME_VARINT_MAX \
+                                 + TFRAME_MASK_BYTES + TFRAME_ENERGY_BYTES + TFRAME_CRASH_BYTES + TFRAME_CRC_BYTES)
+#define TFRAME_TEXT_MAX_BYTES   (128 + 6 * TLOG_CHANNELS + 8 * TFRAME_MASK_BYTES)
+
+#define TFRAME_FLAG_KEYFRAME    (0x01)
+#define TFRAME_FLAG_CALIBRATED  (0x02)
+#define TFRAME_FLAG_ENERGY      (0x04)
+#define TFRAME_FLAG_OVER_BUDGET (0x08)
+#define TFRAME_FLAG_EPOCH       (0x10)
+#define TFRAME_FLAG_CRASH       (0x20)
+#define TFRAME_FLAG_FAULTS      (0x40)
+#define TFRAME_FLAG_WIDE        (0x80)
+
+/**
+ * Crash report as carried in a frame
+ */
+typedef struct tframe_crash {
+  uint8_t reason;
+  uint8_t stage;
+  uint8_t count;
+  uint8_t flags;
+  uint32_t epc1;
+} tframe_crash_t;
+
+/**
+ * Delta reference carried from one frame to the next within a session
+ */
+typedef struct tframe_ctx {
+  bool valid;
+  uint32_t sequence;                            //! Sequence of the frame the deltas are against
+  chmask_t channelMask;
+  uint16_t readings[TLOG_CHANNELS];
+} tframe_ctx_t;
+
+
+/**
+ * Forget the delta reference; the next frame will be a keyframe
+ */
+static inline void tframe_reset(tframe_ctx_t* ctx) {
+  ctx->valid = false;
+}
+
+static inline uint8_t* tframe_put_u16(uint8_t* p, uint16_t v) {
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+  return p + 2;
+}
+
+static inline uint8_t* tframe_put_u32(uint8_t* p, uint32_t v) {
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+  p[2] = (uint8_t)(v >> 16);
+  p[3] = (uint8_t)(v >> 24);
+  return p + 4;
+}
+
+static inline uint8_t* tframe_put_mask(uint8_t* p, chmask_t mask, uint8_t bytes) {
+  for (uint8_t i = 0; i < bytes; i++) {
+    *p++ = (uint8_t)((uint64_t)mask >> (8 * i));
+  }
+  return p;
+}
+
+static inline uint8_t* tframe_put_varint(uint8_t* p, uint32_t v) {
+  while (v >= 0x80) {
+    *p++ = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  *p++ = (uint8_t)v;
+  return p;
+}
+
+static inline uint32_t tframe_zigzag(int32_t v) {
+  return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+/**
+ * Encode a record as a binary frame and advance the delta reference.
+ *
+ * @param out     at least TFRAME_MAX_BYTES
+ * @param energy  report to attach, or nullptr
+ * @param crash   crash report to attach, or nullptr
+ * @return frame length in bytes
+ */
+static inline size_t tframe_encode(uint8_t* out, tframe_ctx_t* ctx,
+                                   const tlog_record_t* record, uint32_t nodeId,
+                                   const energy_report_t* energy, const tframe_crash_t* crash) {
+  const bool keyframe = !ctx->valid || record->sequence != ctx->sequence + 1
+                     || record->channelMask != ctx->channelMask;
+  const chmask_t faults = tlog_record_faults(record);
+
+  uint8_t* p = out;
+  *p++ = TFRAME_SYNC;
+  *p++ = TFRAME_VERSION;
+  *p++ = (keyframe ? TFRAME_FLAG_KEYFRAME : 0)
+       | ((record->flags & TLOG_FLAG_CALIBRATED) ? TFRAME_FLAG_CALIBRATED : 0)
+       | ((record->flags & TLOG_FLAG_EPOCH) ? TFRAME_FLAG_EPOCH : 0)
+       | (energy ? TFRAME_FLAG_ENERGY : 0)
+       | ((energy && (energy->flags & ENERGY_FLAG_OVER_BUDGET)) ? TFRAME_FLAG_OVER_BUDGET : 0)
+       | (crash ? TFRAME_FLAG_CRASH : 0)
+       | (faults ? TFRAME_FLAG_FAULTS : 0)
+       | (TFRAME_WIDE_BYTES ? TFRAME_FLAG_WIDE : 0);
+  *p++ = (uint8_t)record->channelMask;
+  p = tframe_put_u32(p, nodeId);
+  p = tframe_put_u32(p, record->sequence);
+  p = tframe_put_u32(p, record->timestamp);
+  p = tframe_put_u16(p, record->batteryMv);
+  if (TFRAME_WIDE_BYTES) {
+    *p++ = TLOG_CHANNELS;
+    p = tframe_put_mask(p, (chmask_t)((uint64_t)record->channelMask >> 8), TFRAME_MASK_BYTES - 1);
+  }
+
+  for (uint8_t ch = 0; ch < TLOG_CHANNELS; ch++) {
+    if (record->channelMask & chmask_bit(ch)) {
+      const int32_t base = keyframe ? 0 : ctx->readings[ch];
+      p = tframe_put_varint(p, tframe_zigzag((int32_t)record->readings[ch] - base));
+    }
+  }
+  if (faults) {
+    p = tframe_put_mask(p, faults, TFRAME_MASK_BYTES);
+    for (uint8_t ch = 0; ch < TLOG_CHANNELS; ch++) {
+      if (faults & chmask_bit(ch)) {
+        *p++ = (uint8_t)record->readings[ch];
+      }
+    }
+  }
+  if (energy) {
+    p = tframe_put_u32(p, energy->total_uah);
+    p = tframe_put_u16(p, energy->life_days);
+  }
+  if (crash) {
+    *p++ = crash->reason;
+    *p++ = crash->stage;
+    *p++ = crash->count;
+    *p++ = crash->flags;
+    p = tframe_put_u32(p, crash->epc1);
+  }
+
+  p = tframe_put_u16(p, crc16_compute(out, p - out));
+
+  ctx->valid = true;
+  ctx->sequence = record->sequence;
+  ctx->channelMask = record->channelMask;
+  memcpy(ctx->readings, record->readings, sizeof(ctx->readings));
+
+  return p - out;
+}
+
+static inline uint16_t tframe_get_u16(const uint8_t* p) {
+  return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t tframe_get_u32(const uint8_t* p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline chmask_t tframe_get_mask(const uint8_t* p, uint8_t bytes) {
+  uint64_t mask = 0;
+  for (uint8_t i = 0; i < bytes; i++) {
+    mask |= (uint64_t)p[i] << (8 * i);
+  }
+  return (chmask_t)mask;
+}
+
+/**
+ * Decode a keyframe. Delta frames are refused, since they need the
+ * sender's session context.
+ *
+ * @return false if the frame is malformed, corrupt or not a keyframe
+ */
+static inline bool tframe_decode(const uint8_t* frame, size_t length,
+                                 tlog_record_t* record, uint32_t* nodeId) {
+  if (length < TFRAME_HEADER_BYTES + TFRAME_CRC_BYTES || frame[0] != TFRAME_SYNC
+      || frame[1] != TFRAME_VERSION || !(frame[2] & TFRAME_FLAG_KEYFRAME)
+      || crc16_compute(frame, length - TFRAME_CRC_BYTES) != tframe_get_u16(frame + length - TFRAME_CRC_BYTES)) {
+    return false;
+  }
+
+  memset(record, 0, sizeof(*record));
+  const uint8_t flags = frame[2];
+  record->flags = ((flags & TFRAME_FLAG_CALIBRATED) ? TLOG_FLAG_CALIBRATED : 0)
+                | ((flags & TFRAME_FLAG_EPOCH) ? TLOG_FLAG_EPOCH : 0)
+                | ((flags & TFRAME_FLAG_FAULTS) ? TLOG_FLAG_FAULTS : 0);
+  *nodeId = tframe_get_u32(frame + 4);
+  record->sequence = tframe_get_u32(frame + 8);
+  record->timestamp = tframe_get_u32(frame + 12);
+  record->batteryMv = tframe_get_u16(frame + 16);
+
+  const uint8_t* p = frame + TFRAME_HEADER_BYTES;
+  const uint8_t* end = frame + length - TFRAME_CRC_BYTES - ((flags & TFRAME_FLAG_ENERGY) ? TFRAME_ENERGY_BYTES : 0)
+                                              - ((flags & TFRAME_FLAG_CRASH) ? TFRAME_CRASH_BYTES : 0);
+  uint8_t channels = 8;
+  if (flags & TFRAME_FLAG_WIDE) {
+    // A node with more channels than this build can hold is refused outright
+    if (p >= end || *p <= 8 || *p > TLOG_CHANNELS) {
+      return false;
+    }
+    channels = *p++;
+  }
+  const uint8_t maskBytes = (uint8_t)((channels + 7) / 8);
+  if (p + (maskBytes - 1) > end) {
+    return false;
+  }
+  record->channelMask = (chmask_t)(frame[3] | ((uint64_t)tframe_get_mask(p, maskBytes - 1) << 8));
+  p += maskBytes - 1;
+
+  for (uint8_t ch = 0; ch < channels; ch++) {
+    if (!(record->channelMask & chmask_bit(ch))) {
+      continue;
+    }
+    uint32_t v = 0;
+    uint8_t shift = 0;
+    do {
+      if (p >= end || shift > 14) {
+        return false;
+      }
+      v |= (uint32_t)(*p & 0x7F) << shift;
+      shift += 7;
+    } while (*p++ & 0x80);
+    record->readings[ch] = (uint16_t)((v >> 1) ^ (0U - (v & 1)));
+  }
+  if (flags & TFRAME_FLAG_FAULTS) {
+    if (p + maskBytes > end) {
+      return false;
+    }
+    const chmask_t faults = tframe_get_mask(p, maskBytes);
+    p += maskBytes;
+    if (faults & record->channelMask) {
+      return false;
+    }
+    for (uint8_t ch = 0; ch < channels; ch++) {
+      if (faults & chmask_bit(ch)) {
+        if (p >= end || *p == 0) {
+          return false;
+        }
+        record->readings[ch] = *p++;
+      }
+    }
+  }
+  return p == end;
+}
+
+/**
+ * A mask as a JSON value. Past 32 bits it goes out as a hex string, since
+ * a JSON number stops being exact before 64.
+ */
+static inline int tframe_format_mask(char* out, size_t size, chmask_t mask) {
+  if (CHMASK_BYTES > 4) {
+    return snprintf(out, size, "\"%08x%08x\"", (uint32_t)((uint64_t)mask >> 32), (uint32_t)mask);
+  }
+  return snprintf(out, size, "%u", (uint32_t)mask);
+}
+
+/**
+ * Render a record as a single JSON line (no trailing newline)
+ *
+ * @param out  at least TFRAME_TEXT_MAX_BYTES
+ * @return string length, excluding the terminator
+ */
+static inline size_t tframe_format_text(char* out, const tlog_record_t* record, uint32_t nodeId) {
+  int n = snprintf(out, TFRAME_TEXT_MAX_BYTES,
+                   "{\"v\":%u,\"node\":%u,\"seq\":%u,\"t\":%u,\"epoch\":%u,\"bat\":%u,\"mask\":",
+                   TFRAME_VERSION, nodeId, record->sequence, record->timestamp,
+                   (record->flags & TLOG_FLAG_EPOCH) ? 1 : 0, record->batteryMv);
+  n += tframe_format_mask(out + n, TFRAME_TEXT_MAX_BYTES - n, record->channelMask);
+  n += snprintf(out + n, TFRAME_TEXT_MAX_BYTES - n, ",\"faults\":");
+  n += tframe_format_mask(out + n, TFRAME_TEXT_MAX_BYTES - n, tlog_record_faults(record));
+  n += snprintf(out + n, TFRAME_TEXT_MAX_BYTES - n, ",\"cal\":%u,\"r\":[",
+                (record->flags & TLOG_FLAG_CALIBRATED) ? 1 : 0);
+  for (uint8_t ch = 0; ch < TLOG_CHANNELS && n < TFRAME_TEXT_MAX_BYTES; ch++) {
+    n += snprintf(out + n, TFRAME_TEXT_MAX_BYTES - n, ch ? ",%u" : "%u", record->readings[ch]);
+  }
+  if (n < TFRAME_TEXT_MAX_BYTES) {
+    n += snprintf(out + n, TFRAME_TEXT_MAX_BYTES - n, "]}");
+  }
+  return (n < TFRAME_TEXT_MAX_BYTES) ? (size_t)n : TFRAME_TEXT_MAX_BYTES - 1;
+}
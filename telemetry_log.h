@@ -0,0 +1,305 @@
+/**
+ * Store-and-forward telemetry log in LittleFS.
+ *
+ * Every sweep becomes one fixed-size binary record. Records are numbered by
+ * a free-running sequence and live in a preallocated ring at slot
+ * (sequence % TLOG_CAPACITY). The files never grow or shrink, but LittleFS
+ * is copy-on-write: overwriting part of a file writes the changed block
+ * somewhere else, copies the rest of the file after it and commits new
+ * metadata. The ring is therefore split into TLOG_SEGMENT_BYTES files, so
+ * a write copies at most one segment rather than the rest of the ring.
+ * Which physical blocks absorb that is left to LittleFS's wear levelling.
+ *
+ * New records collect in a small staging buffer that sits in RTC state and
+ * so survives deep sleep. Flash is only written once the stage is full, as a
+ * single block that never straddles two segments, so it costs one segment
+ * copy per TLOG_STAGE_RECORDS sweeps. Uploads drain the oldest records
+ * first, from flash and then from the stage. The tail only moves past a
+ * record once the sink has accepted it, so anything logged during an
+ * outage goes out in order once the link is back.
+ *
+ *   /tlog/<n>   TLOG_SEGMENTS segments of TLOG_SEGMENT_RECORDS records,
+ *               erased to 0xFF on creation
+ *   /tlog.meta  upload tail, rewritten after every drain that sent
+ *               anything: once per wake in duty-cycle mode, once per
+ *               upload when always on. At 8 bytes it is stored inline in
+ *               its directory, so each rewrite is a metadata commit and
+ *               no data block.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include "config.h"
+#include "crc.h"
+#include "telemetry_record.h"
+
+
+#define TLOG_DIR_PATH           "/tlog"
+#define TLOG_LEGACY_PATH        "/tlog.bin"       //! Single ring file of earlier builds
+#define TLOG_META_PATH          "/tlog.meta"
+#define TLOG_PATH_MAX           (16)
+#define TLOG_SEGMENT_BYTES      (4096)            //! One flash sector
+#define TLOG_SEGMENT_RECORDS    (TLOG_SEGMENT_BYTES / TLOG_RECORD_BYTES)
+#define TLOG_SEGMENTS           (TLOG_CAPACITY / TLOG_SEGMENT_RECORDS)
+#define TLOG_STAGE_BYTES        (TLOG_STAGE_RECORDS * TLOG_RECORD_BYTES)
+
+static_assert(TLOG_SEGMENT_BYTES % TLOG_STAGE_BYTES == 0,
+              "a staged block must not straddle two segments");
+static_assert(TLOG_CAPACITY % TLOG_SEGMENT_RECORDS == 0,
+              "ring capacity must be a whole number of segments");
+static_assert((TLOG_STAGE_RECORDS & (TLOG_STAGE_RECORDS - 1)) == 0,
+              "blocks are found again by rounding the sequence");
+
+/**
+ * Log indices and staged records, kept in RTC state
+ */
+typedef struct tlog {
+  uint32_t head;                                //! Next sequence to be assigned
+  uint32_t tail;                                //! Oldest sequence not yet uploaded
+  uint32_t flashed;                             //! Sequences below this are on flash
+  tlog_record_t stage[TLOG_STAGE_RECORDS];
+} tlog_t;
+
+typedef bool (*tlog_sink_t)(const tlog_record_t* record);
+
+
+static inline uint32_t tlog_pending(const tlog_t* log) {
+  return log->head - log->tail;
+}
+
+static inline void tlog_segment_path(char* path, uint32_t segment) {
+  snprintf(path, TLOG_PATH_MAX, TLOG_DIR_PATH "/%u", (unsigned)segment);
+}
+
+/**
+ * Open the segment holding a sequence, positioned at its slot
+ */
+static inline File tlog_open_slot(uint32_t sequence, const char* mode) {
+  char path[TLOG_PATH_MAX];
+  const uint32_t slot = sequence % TLOG_CAPACITY;
+  tlog_segment_path(path, slot / TLOG_SEGMENT_RECORDS);
+  File f = LittleFS.open(path, mode);
+  if (f && !f.seek((slot % TLOG_SEGMENT_RECORDS) * TLOG_RECORD_BYTES, SeekSet)) {
+    f.close();
+  }
+  return f;
+}
+
+/**
+ * Create the ring segments, erased, where they do not exist yet
+ */
+static inline bool tlog_create(void) {
+  // Segments are created in order, so the last one existing means all do
+  char last[TLOG_PATH_MAX];
+  tlog_segment_path(last, TLOG_SEGMENTS - 1);
+  if (LittleFS.exists(last)) {
+    return true;
+  }
+  if (LittleFS.exists(TLOG_LEGACY_PATH)) {
+    LittleFS.remove(TLOG_LEGACY_PATH);
+  }
+  LittleFS.mkdir(TLOG_DIR_PATH);
+
+  uint8_t buf[256];
+  memset(buf, 0xFF, sizeof(buf));
+  for (uint32_t segment = 0; segment < TLOG_SEGMENTS; segment++) {
+    char path[TLOG_PATH_MAX];
+    tlog_segment_path(path, segment);
+    if (LittleFS.exists(path)) {
+      continue;
+    }
+    File f = LittleFS.open(path, "w");
+    if (!f) {
+      return false;
+    }
+    for (uint32_t written = 0; written < TLOG_SEGMENT_BYTES; written += sizeof(buf)) {
+      f.write(buf, sizeof(buf));
+    }
+    f.close();
+  }
+  return true;
+}
+
+/**
+ * Rebuild head and tail from flash after a cold boot. Any staged records
+ * were lost with RTC memory, so head resumes after the newest flashed one.
+ */
+static inline void tlog_recover(tlog_t* log) {
+  memset(log, 0, sizeof(*log));
+
+  bool any = false;
+  for (uint32_t segment = 0; segment < TLOG_SEGMENTS; segment++) {
+    File f = tlog_open_slot(segment * TLOG_SEGMENT_RECORDS, "r");
+    if (!f) {
+      continue;
+    }
+    tlog_record_t record;
+    for (uint32_t slot = 0; slot < TLOG_SEGMENT_RECORDS; slot++) {
+      if (f.read((uint8_t*)&record, sizeof(record)) != sizeof(record)) {
+        break;
+      }
+      if (tlog_record_valid(&record) && (!any || (int32_t)(record.sequence - log->head) >= 0)) {
+        log->head = record.sequence + 1;
+        any = true;
+      }
+    }
+    f.close();
+  }
+  // After tlog_flush() the newest block may be partial; start on the next one
+  log->head = (log->head + TLOG_STAGE_RECORDS - 1) & ~(uint32_t)(TLOG_STAGE_RECORDS - 1);
+  log->flashed = log->head;
+
+  uint32_t meta[2];
+  File m = LittleFS.open(TLOG_META_PATH, "r");
+  if (m && m.read((uint8_t*)meta, sizeof(meta)) == sizeof(meta)
+      && meta[1] == crc32_compute(&meta[0], sizeof(meta[0]))) {
+    log->tail = meta[0];
+  }
+  if (m) {
+    m.close();
+  }
+
+  // Clamp in case the ring wrapped past an old tail or the meta is newer
+  if ((int32_t)(log->head - log->tail) < 0) {
+    log->tail = log->head;
+  } else if (log->head - log->tail > TLOG_CAPACITY) {
+    log->tail = log->head - TLOG_CAPACITY;
+  }
+}
+
+/**
+ * Mount the filesystem and make sure the ring exists.
+ *
+ * @param warm true when the indices in log came back intact from RTC memory
+ */
+static inline bool tlog_mount(tlog_t* log, bool warm) {
+  if (!LittleFS.begin() || !tlog_create()) {
+    return false;
+  }
+  if (!warm) {
+    tlog_recover(log);
+  }
+  return true;
+}
+
+/**
+ * Write the full stage block to its slots in one write. LittleFS commits
+ * it on close() by rewriting the segment from that block on.
+ */
+static inline bool tlog_flush_stage(tlog_t* log) {
+  File f = tlog_open_slot(log->flashed, "r+");
+  if (!f) {
+    return false;
+  }
+  const bool ok = f.write((const uint8_t*)log->stage, TLOG_STAGE_BYTES) == TLOG_STAGE_BYTES;
+  f.close();
+  if (ok) {
+    log->flashed += TLOG_STAGE_RECORDS;
+  }
+  return ok;
+}
+
+/**
+ * Write a partly filled stage to flash now, e.g. before a restart that
+ * may not keep RTC state. The unused slots of the block are written
+ * blank, and head moves on to the next block so the stage stays aligned;
+ * those sequence numbers are never used.
+ */
+static inline bool tlog_flush(tlog_t* log) {
+  const uint32_t staged = log->head - log->flashed;
+  if (staged == 0) {
+    return true;
+  }
+  memset(&log->stage[staged], 0, (TLOG_STAGE_RECORDS - staged) * sizeof(log->stage[0]));
+  if (!tlog_flush_stage(log)) {
+    return false;
+  }
+  log->head = log->flashed;
+  return true;
+}
+
+/**
+ * Append a record. Sequence and CRC are filled in here.
+ */
+static inline void tlog_append(tlog_t* log, tlog_record_t* record) {
+  record->sequence = log->head;
+  record->crc = tlog_record_crc(record);
+  log->stage[log->head - log->flashed] = *record;
+  log->head++;
+
+  if (log->head - log->flashed == TLOG_STAGE_RECORDS && !tlog_flush_stage(log)) {
+    // Drop the block rather than stall the scan loop on a broken filesystem.
+    // Its slots fail the sequence check and are skipped by tlog_drain().
+    log->flashed += TLOG_STAGE_RECORDS;
+  }
+
+  // Oldest records are overwritten once the ring is full
+  if (tlog_pending(log) > TLOG_CAPACITY) {
+    log->tail = log->head - TLOG_CAPACITY;
+  }
+}
+
+/**
+ * Persist the upload tail so a cold boot does not resend everything
+ */
+static inline void tlog_save_tail(const tlog_t* log) {
+  uint32_t meta[2] = { log->tail, crc32_compute(&log->tail, sizeof(log->tail)) };
+  File m = LittleFS.open(TLOG_META_PATH, "w");
+  if (m) {
+    m.write((const uint8_t*)meta, sizeof(meta));
+    m.close();
+  }
+}
+
+/**
+ * Hand up to maxRecords of the oldest pending records to the sink, in
+ * order. Stops at the first record the sink refuses.
+ *
+ * @return number of records the sink accepted
+ */
+static inline uint16_t tlog_drain(tlog_t* log, uint16_t maxRecords, tlog_sink_t sink) {
+  uint16_t sent = 0;
+  File f;
+
+  while (sent < maxRecords && tlog_pending(log) > 0) {
+    tlog_record_t record;
+    const uint32_t seq = log->tail;
+
+    if ((int32_t)(seq - log->flashed) >= 0) {
+      record = log->stage[seq - log->flashed];
+    } else {
+      // The open segment is reused while the reads stay in it
+      const uint32_t slot = seq % TLOG_CAPACITY;
+      if (!f || slot % TLOG_SEGMENT_RECORDS == 0) {
+        if (f) {
+          f.close();
+        }
+        f = tlog_open_slot(seq, "r");
+      }
+      if (!f || f.read((uint8_t*)&record, sizeof(record)) != sizeof(record)) {
+        break;
+      }
+    }
+
+    // A torn or overwritten slot is skipped rather than wedging the queue
+    if (!tlog_record_valid(&record) || record.sequence != seq) {
+      log->tail++;
+      continue;
+    }
+    if (!sink(&record)) {
+      break;
+    }
+    log->tail++;
+    sent++;
+  }
+
+  if (f) {
+    f.close();
+  }
+  if (sent > 0) {
+    tlog_save_tail(log);
+  }
+  return sent;
+}
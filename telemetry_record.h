@@ -0,0 +1,70 @@
+/**
+ * One sweep as stored in the telemetry log and encoded into frames.
+ *
+ * Kept apart from telemetry_log.h so the frame encoder does not pull in
+ * the filesystem.
+ *
+ * A probe channel that failed its health checks (channel_health.h) is
+ * cleared from channelMask like a channel that is not fitted. With
+ * TLOG_FLAG_FAULTS its slot in readings[] holds the HEALTH_FAULT_* bits
+ * instead of a reading, so the record keeps its size.
+ *
+ * The record is sized to the channel count and rounded up to a power of
+ * two, so staged blocks still tile a log segment: 32 bytes for up to 8
+ * channels (the original layout), then 64, 128 and 256. The rounding goes
+ * into spare readings[] slots past TLOG_CHANNELS, which stay zero.
+ */
+
+#pragma once
+
+#include "hal.h"
+#include "crc.h"
+#include "channel_mask.h"
+
+
+#define TLOG_CHANNELS           (MUX_CHANNEL_COUNT)
+#define TLOG_RECORD_BYTES       (TLOG_CHANNELS <= 8 ? 32 : TLOG_CHANNELS <= 16 ? 64 : TLOG_CHANNELS <= 32 ? 128 : 256)
+#define TLOG_READINGS_OFFSET    (((9 + CHMASK_BYTES + 1) & ~1) + 2)
+#define TLOG_READING_SLOTS      ((TLOG_RECORD_BYTES - 4 - TLOG_READINGS_OFFSET) / 2)
+
+#define TLOG_FLAG_CALIBRATED    (0x01)            //! readings are moisture in 0.1 %, not ADC counts
+#define TLOG_FLAG_EPOCH         (0x02)            //! timestamp is Unix time, not seconds since power-on
+#define TLOG_FLAG_FAULTS        (0x04)            //! some channels were dropped as faulty, see tlog_record_faults()
+
+typedef struct tlog_record {
+  uint32_t timestamp;                           //! Seconds, see TLOG_FLAG_EPOCH
+  uint32_t sequence;
+  chmask_t channelMask;                         //! Bit n set if readings[n] is valid
+  uint8_t flags;                                //! TLOG_FLAG_*
+  uint16_t batteryMv;
+  uint16_t readings[TLOG_READING_SLOTS];        //! TLOG_CHANNELS used, the rest is padding
+  uint32_t crc;                                 //! CRC32 over everything before this field
+} tlog_record_t;
+
+static_assert(offsetof(tlog_record_t, readings) == TLOG_READINGS_OFFSET
+              && sizeof(tlog_record_t) == TLOG_RECORD_BYTES, "record layout changed, bump the file format");
+
+
+static inline uint32_t tlog_record_crc(const tlog_record_t* record) {
+  return crc32_compute(record, offsetof(tlog_record_t, crc));
+}
+
+static inline bool tlog_record_valid(const tlog_record_t* record) {
+  return record->crc == tlog_record_crc(record);
+}
+
+/**
+ * Channels dropped as faulty
+ */
+static inline chmask_t tlog_record_faults(const tlog_record_t* record) {
+  if (!(record->flags & TLOG_FLAG_FAULTS)) {
+    return 0;
+  }
+  chmask_t mask = 0;
+  for (uint8_t ch = 0; ch < TLOG_CHANNELS; ch++) {
+    if (!(record->channelMask & chmask_bit(ch)) && record->readings[ch] != 0) {
+      mask |= chmask_bit(ch);
+    }
+  }
+  return mask;
+}
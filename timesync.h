@@ -0,0 +1,178 @@
+/**
+ * Wall-clock time carried across deep sleep.
+ *
+ * The node keeps a single reference: the epoch, in ms, at which millis()
+ * read 0 on this wake. Right before deep sleep it is moved forward by the
+ * time spent awake plus the sleep. The sleep is corrected by the learned
+ * drift of the RTC sleep timer, which is typically several percent off
+ * and also absorbs the fixed boot time after every wake. Reading the time
+ * costs no network traffic.
+ *
+ * SNTP only runs when the radio is up anyway, and at most every
+ * TIME_SYNC_INTERVAL_S. Each sync compares the carried time with the real
+ * one. The error divided by the sleep since the previous sync is the
+ * drift the correction missed, and half of it is folded into drift_ppm.
+ * A sync completes only when the SNTP client actually sets the clock
+ * (settimeofday_cb with from_sntp), never from the clock merely reading
+ * plausible: in always-on mode it is already set from the previous sync.
+ * The request state is per wake and stays out of RTC memory.
+ *
+ * Until the first sync, and after a reset that lost track of time, the
+ * reference counts from power-on instead. timesync_valid() says which kind
+ * of time a timestamp is.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sntp.h>
+#include <coredecls.h>
+#include "config.h"
+
+
+#define TIME_EPOCH_MIN_S        (1600000000UL)    //! SNTP has answered once time() is past this
+
+typedef struct timesync {
+  uint64_t bootEpoch_ms;                        //! Time at millis() == 0 on this wake
+  uint32_t lastSync_s;                          //! Epoch of the last SNTP sync
+  uint32_t sleptSinceSync_ms;                   //! Requested (uncorrected) sleep since then
+  int32_t drift_ppm;                            //! Sleep timer error: positive means sleeps run long
+  uint8_t valid;                                //! bootEpoch_ms is wall-clock time
+  uint8_t reserved[3];
+} timesync_t;
+
+/**
+ * SNTP request of this wake
+ */
+typedef struct timesync_request {
+  bool syncing;                                 //! Request outstanding
+  volatile bool answered;                       //! SNTP set the clock since the request
+  uint32_t start_ms;                            //! millis() of the last request, 0 for none
+} timesync_request_t;
+
+static timesync_request_t timesyncRequest;
+
+
+static inline bool timesync_valid(const timesync_t* ts) {
+  return ts->valid != 0;
+}
+
+/**
+ * Seconds: Unix time once synced, time since power-on before
+ */
+static inline uint32_t timesync_now_s(const timesync_t* ts) {
+  return (uint32_t)((ts->bootEpoch_ms + millis()) / 1000ULL);
+}
+
+/**
+ * Call once per boot. After anything but a timer wake the time spent in
+ * reset is unknown, so counting restarts from zero. The learned drift is
+ * a property of the chip and is kept.
+ */
+static inline void timesync_boot(timesync_t* ts, bool timerWake) {
+  memset(&timesyncRequest, 0, sizeof(timesyncRequest));
+  if (!timerWake) {
+    ts->bootEpoch_ms = 0;
+    ts->valid = 0;
+    ts->sleptSinceSync_ms = 0;
+  }
+}
+
+/**
+ * Move the reference past the coming sleep. Call right before deep sleep.
+ */
+static inline void timesync_sleep(timesync_t* ts, uint32_t awake_ms, uint32_t sleep_ms) {
+  const int64_t corrected_ms = (int64_t)sleep_ms + (int64_t)sleep_ms * ts->drift_ppm / 1000000LL;
+  ts->bootEpoch_ms += awake_ms + (uint64_t)corrected_ms;
+  ts->sleptSinceSync_ms = (ts->sleptSinceSync_ms > UINT32_MAX - sleep_ms) ? UINT32_MAX
+                        : ts->sleptSinceSync_ms + sleep_ms;
+}
+
+/**
+ * A sync is due: never synced, or the last one is TIME_SYNC_INTERVAL_S old.
+ * Failed requests are retried no sooner than TIME_SYNC_RETRY_MS.
+ */
+static inline bool timesync_due(const timesync_t* ts) {
+  const timesync_request_t* req = &timesyncRequest;
+  if (req->syncing || (req->start_ms != 0 && (uint32_t)(millis() - req->start_ms) < TIME_SYNC_RETRY_MS)) {
+    return false;
+  }
+  return !ts->valid || timesync_now_s(ts) - ts->lastSync_s >= TIME_SYNC_INTERVAL_S;
+}
+
+static inline void timesync_on_settimeofday(bool fromSntp) {
+  if (fromSntp) {
+    timesyncRequest.answered = true;
+  }
+}
+
+/**
+ * Start an SNTP request. Needs the link up.
+ */
+static inline void timesync_begin(timesync_t* ts) {
+  (void)ts;
+  const uint32_t now = millis();
+  timesyncRequest.answered = false;
+  settimeofday_cb(timesync_on_settimeofday);
+  configTime(0, 0, TIME_NTP_SERVER);
+  timesyncRequest.syncing = true;
+  timesyncRequest.start_ms = now ? now : 1;
+}
+
+static inline bool timesync_busy(const timesync_t* ts) {
+  (void)ts;
+  return timesyncRequest.syncing;
+}
+
+/**
+ * Take the real time from any source and learn the drift from it
+ */
+static inline void timesync_set(timesync_t* ts, uint64_t now_ms) {
+  const uint64_t boot_ms = now_ms - millis();
+
+  if (ts->valid && ts->sleptSinceSync_ms >= TIME_DRIFT_LEARN_MIN_S * 1000UL) {
+    const int64_t error_ms = (int64_t)(boot_ms - ts->bootEpoch_ms);
+    const int64_t residual_ppm = error_ms * 1000000LL / (int64_t)ts->sleptSinceSync_ms;
+    int64_t drift = ts->drift_ppm + residual_ppm / 2;
+    if (drift > TIME_DRIFT_MAX_PPM) {
+      drift = TIME_DRIFT_MAX_PPM;
+    } else if (drift < -TIME_DRIFT_MAX_PPM) {
+      drift = -TIME_DRIFT_MAX_PPM;
+    }
+    ts->drift_ppm = (int32_t)drift;
+  }
+
+  ts->bootEpoch_ms = boot_ms;
+  ts->lastSync_s = (uint32_t)(now_ms / 1000ULL);
+  ts->sleptSinceSync_ms = 0;
+  ts->valid = 1;
+}
+
+/**
+ * Poll an outstanding SNTP request and learn from the answer
+ *
+ * @return true on the call that completes a sync
+ */
+static inline bool timesync_service(timesync_t* ts) {
+  timesync_request_t* req = &timesyncRequest;
+  if (!req->syncing) {
+    return false;
+  }
+
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  if (!req->answered || (uint32_t)tv.tv_sec < TIME_EPOCH_MIN_S) {
+    if ((uint32_t)(millis() - req->start_ms) >= TIME_SYNC_TIMEOUT_MS) {
+      sntp_stop();
+      req->syncing = false;
+    }
+    return false;
+  }
+  sntp_stop();
+  req->syncing = false;
+
+  timesync_set(ts, (uint64_t)tv.tv_sec * 1000ULL + (uint64_t)(tv.tv_usec / 1000));
+  return true;
+}
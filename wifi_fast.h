@@ -0,0 +1,137 @@
+/**
+ * Fast reconnect to the last access point.
+ *
+ * WiFiManager's autoConnect() scans every channel and then waits for DHCP,
+ * which keeps the radio at full current for seconds on every wake. Once we
+ * have been associated once, the BSSID, channel and IP lease are cached in
+ * RTC memory and the next connect goes straight to that AP with a static
+ * configuration. Credentials come from the SDK's saved station config (the
+ * one WiFiManager wrote), so nothing secret is kept in RTC memory.
+ *
+ * Connecting is polled from loop(). Without a cached AP, begin does a
+ * plain connect with a full scan and DHCP, and is given
+ * WIFI_SCAN_CONNECT_TIMEOUT_MS. The caller retries that way once the fast
+ * path reports WIFIFAST_FAILED, and leaves the portal to portal.h.
+ *
+ * On its own the SDK re-joins the saved AP at boot, with a full scan and
+ * DHCP, before setup() has decided whether this wake needs the radio at
+ * all. wififast_radio_off() stops that on timer wakes; wififast_begin()
+ * and the other radio users switch the station back on when they need it.
+ */
+
+#pragma once
+
+#include <ESP8266WiFi.h>
+#include "config.h"
+#include "rtc_state.h"
+#include "stats.h"
+
+
+typedef enum wififast_state {
+  WIFIFAST_IDLE = 0,
+  WIFIFAST_CONNECTING,
+  WIFIFAST_CONNECTED,
+  WIFIFAST_FAILED
+} wififast_state_t;
+
+typedef struct wififast {
+  wififast_state_t state;
+  bool noCredentials;                           //! Failed because nothing was ever configured
+  uint32_t start_ms;
+  uint32_t timeout_ms;
+} wififast_t;
+
+
+/**
+ * Remember the current association for the next wake
+ */
+static inline void wififast_capture(rtcwifi_t* cache) {
+  const uint8_t* bssid = WiFi.BSSID();
+  if (bssid == nullptr) {
+    cache->valid = 0;
+    return;
+  }
+  memcpy(cache->bssid, bssid, sizeof(cache->bssid));
+  cache->channel = (uint8_t)WiFi.channel();
+  cache->ip = (uint32_t)WiFi.localIP();
+  cache->gateway = (uint32_t)WiFi.gatewayIP();
+  cache->subnet = (uint32_t)WiFi.subnetMask();
+  cache->dns = (uint32_t)WiFi.dnsIP(0);
+  cache->valid = 1;
+}
+
+/**
+ * Keep the radio off until something asks for it.
+ *
+ * The auto-connect flag lives in the SDK's flash config, so it is only
+ * written when it is still set: after the first wake this costs nothing.
+ */
+static inline void wififast_radio_off(void) {
+  WiFi.persistent(false);
+  if (WiFi.getAutoConnect()) {
+    WiFi.setAutoConnect(false);
+  }
+  WiFi.mode(WIFI_OFF);
+}
+
+/**
+ * Kick off a connection using the cached AP if we have one.
+ *
+ * Nothing is written to flash: WiFi.persistent(false) keeps the SDK from
+ * rewriting its config sector on every wake.
+ */
+static inline void wififast_begin(wififast_t* conn, const rtcwifi_t* cache) {
+  struct station_config saved;
+  memset(&saved, 0, sizeof(saved));
+
+  conn->start_ms = millis();
+  conn->timeout_ms = cache->valid ? WIFI_FAST_CONNECT_TIMEOUT_MS : WIFI_SCAN_CONNECT_TIMEOUT_MS;
+  conn->noCredentials = !wifi_station_get_config_default(&saved) || saved.ssid[0] == '\0';
+
+  if (conn->noCredentials) {
+    conn->state = WIFIFAST_FAILED;
+    return;
+  }
+
+  // The SDK fields are not guaranteed to be NUL terminated
+  char ssid[sizeof(saved.ssid) + 1];
+  char pass[sizeof(saved.password) + 1];
+  memcpy(ssid, saved.ssid, sizeof(saved.ssid));
+  ssid[sizeof(saved.ssid)] = '\0';
+  memcpy(pass, saved.password, sizeof(saved.password));
+  pass[sizeof(saved.password)] = '\0';
+
+  WiFi.persistent(false);
+  WiFi.mode(WIFI_STA);
+
+  if (cache->valid) {
+    WiFi.config(IPAddress(cache->ip), IPAddress(cache->gateway),
+                IPAddress(cache->subnet), IPAddress(cache->dns));
+    WiFi.begin(ssid, pass, cache->channel, cache->bssid);
+  } else {
+    WiFi.begin(ssid, pass);
+  }
+  conn->state = WIFIFAST_CONNECTING;
+}
+
+/**
+ * Poll the connection attempt. On success the cache is refreshed; on
+ * timeout it is dropped so the next wake does not retry a stale AP.
+ */
+static inline wififast_state_t wififast_service(wififast_t* conn, rtcwifi_t* cache) {
+  if (conn->state != WIFIFAST_CONNECTING) {
+    return conn->state;
+  }
+
+  if (WiFi.status() == WL_CONNECTED) {
+    wififast_capture(cache);
+    stats_record_us(STAGE_WIFI_CONNECT, (millis() - conn->start_ms) * 1000UL);
+    conn->state = WIFIFAST_CONNECTED;
+  } else if ((uint32_t)(millis() - conn->start_ms) >= conn->timeout_ms) {
+    cache->valid = 0;
+    WiFi.disconnect();
+    WiFi.config(IPAddress(), IPAddress(), IPAddress());   // back to DHCP
+    conn->state = WIFIFAST_FAILED;
+  }
+  return conn->state;
+}